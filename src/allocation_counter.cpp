@@ -0,0 +1,33 @@
+// Replacements for the global allocation functions that count calls in thread_allocations (see
+// core/allocation_counter.h). The array and nothrow forms forward to these by default.
+//
+// They live in a translation unit of their own: inlined into the call sites that pair them with
+// a delete, the malloc/free underneath reads to GCC as a mismatched new/delete pair.
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "core/allocation_counter.h"
+
+void *operator new(std::size_t size)
+{
+    thread_allocations.value++;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+    thread_allocations.value++;
+    auto alignment = std::max(std::size_t(align), sizeof(void *));
+    if (void *p = std::aligned_alloc(alignment, (std::max<std::size_t>(size, 1) + alignment - 1) / alignment * alignment))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
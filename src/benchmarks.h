@@ -0,0 +1,1584 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+// Micro- and scene-level benchmarks. Each prints its own report to stdout; like the Monte Carlo
+// experiments they are entries of main.cpp's `programs` table, run with `--run NAME` (and
+// listed by `--list`).
+
+#include "./core/rtweekend.h"
+
+#include "./core/allocation_counter.h"
+#include "./core/bvh.h"
+#include "./core/camera.h"
+#include "./core/constant_medium.h"
+#include "./core/environment_light.h"
+#include "./core/fast_math.h"
+#include "./core/hittable_list.h"
+#include "./core/light_sampler.h"
+#include "./core/material.h"
+#include "./core/mesh_cache.h"
+#include "./core/obj_parser.h"
+#include "./core/noise_grid.h"
+#include "./core/oriented_box.h"
+#include "./core/perlin.h"
+#include "./core/quad.h"
+#include "./core/scene.h"
+#include "./core/scene_file.h"
+#include "./core/simd.h"
+#include "./core/sphere.h"
+#include "./core/sphere_set.h"
+#include "./core/texture_cache.h"
+#include "./core/texture_program.h"
+#include "./core/texture_registry.h"
+#include "./core/triangle.h"
+#include "./core/triangle_mesh.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+class bench_timer
+{
+public:
+    bench_timer() : start(std::chrono::steady_clock::now()) {}
+
+    double seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// Tessellated unit sphere of 2 * rings * segments triangles, a stand-in for a dense mesh.
+inline hittable_list make_tessellated_sphere(int rings, int segments, shared_ptr<material> mat)
+{
+    hittable_list triangles;
+    auto vertex = [&](int i, int j)
+    {
+        double theta = pi * i / rings;
+        double phi = 2 * pi * j / segments;
+        return point3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+    };
+
+    for (int i = 0; i < rings; i++)
+    {
+        for (int j = 0; j < segments; j++)
+        {
+            auto a = vertex(i, j), b = vertex(i + 1, j), c = vertex(i + 1, j + 1), d = vertex(i, j + 1);
+            triangles.add(make_shared<triangle>(a, b, c, point2(), point2(), point2(), mat));
+            triangles.add(make_shared<triangle>(a, c, d, point2(), point2(), point2(), mat));
+        }
+    }
+    return triangles;
+}
+
+inline size_t bvh_node_count(size_t span)
+{
+    // Mirrors the split rule in bvh_node: spans of one or two objects become a single node.
+    if (span <= 2)
+        return 1;
+    return 1 + bvh_node_count(span / 2) + bvh_node_count(span - span / 2);
+}
+
+void bench_geometry_precision()
+{
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto mesh = make_tessellated_sphere(256, 512, mat);
+    auto num_triangles = mesh.objects.size();
+
+    bench_timer build_timer;
+    bvh_node world(mesh);
+    double build_time = build_timer.seconds();
+
+    // The shared_ptr control block lives next to the object when created with make_shared.
+    const size_t control_block = 2 * sizeof(long);
+    size_t triangle_bytes = num_triangles * (sizeof(triangle) + control_block);
+    size_t node_bytes = bvh_node_count(num_triangles) * (sizeof(bvh_node) + control_block);
+
+    const int num_rays = 1000000;
+    std::vector<ray> rays;
+    rays.reserve(num_rays);
+    for (int i = 0; i < num_rays; i++)
+    {
+        auto origin = 3.0 * random_unit_vector();
+        auto target = 0.9 * random_unit_vector();
+        rays.emplace_back(origin, target - origin);
+    }
+
+    bench_timer trace_timer;
+    int hits = 0;
+    for (const auto &r : rays)
+    {
+        hit_record rec;
+        if (world.hit(r, interval(0.001, infinity), rec))
+            hits++;
+    }
+    double trace_time = trace_timer.seconds();
+
+    std::cout << "geometry precision: " << (sizeof(geom_real) == 4 ? "single" : "double") << '\n'
+              << "  sizeof(triangle)  = " << sizeof(triangle) << " bytes\n"
+              << "  sizeof(bvh_node)  = " << sizeof(bvh_node) << " bytes\n"
+              << "  sizeof(ray)       = " << sizeof(ray) << " bytes\n"
+              << "  triangles         = " << num_triangles << " (" << triangle_bytes / (1024 * 1024) << " MiB)\n"
+              << "  bvh nodes         = " << node_bytes / (1024 * 1024) << " MiB\n"
+              << "  build time        = " << std::fixed << std::setprecision(3) << build_time << " s\n"
+              << "  closest-hit rays  = " << num_rays / trace_time / 1e6 << " Mrays/s (" << hits << " hits)\n";
+}
+
+// Keeps the optimizer from discarding benchmark results.
+template <typename T>
+inline void bench_keep(const T &value)
+{
+    static volatile unsigned char sink;
+    sink = *reinterpret_cast<const volatile unsigned char *>(&value);
+}
+
+template <int N>
+double bench_packet_kernel(const std::vector<float> &xs, const std::vector<float> &ys,
+                           const std::vector<float> &zs, int repeats)
+{
+    // dot + cross + normalize over consecutive vector pairs, N lanes at a time.
+    size_t count = xs.size() - N;
+    bench_timer timer;
+    vfloat<N> acc(0.0f);
+    for (int rep = 0; rep < repeats; rep++)
+    {
+        for (size_t i = 0; i + N <= count; i += N)
+        {
+            auto a = vec3_packet<N>::load(&xs[i], &ys[i], &zs[i]);
+            auto b = vec3_packet<N>::load(&xs[i + 1], &ys[i + 1], &zs[i + 1]);
+            auto c = unit_vector(cross(a, b));
+            acc = acc + dot(c, a);
+        }
+    }
+    double t = timer.seconds();
+    bench_keep(acc);
+    return t;
+}
+
+void bench_vector_math()
+{
+    const size_t count = 1 << 16;
+    const int repeats = 200;
+
+    std::vector<vec3> aos(count + 8);
+    std::vector<simd_vec3> aos_simd(count + 8);
+    std::vector<float> xs(count + 8), ys(count + 8), zs(count + 8);
+    for (size_t i = 0; i < aos.size(); i++)
+    {
+        aos[i] = vec3::random(-1, 1);
+        aos_simd[i] = simd_vec3(aos[i]);
+        xs[i] = float(aos[i].x());
+        ys[i] = float(aos[i].y());
+        zs[i] = float(aos[i].z());
+    }
+
+    auto report = [&](const char *name, double seconds)
+    {
+        double ns = 1e9 * seconds / (double(count) * repeats);
+        std::cout << "  " << std::left << std::setw(22) << name << std::right << std::fixed
+                  << std::setprecision(3) << ns << " ns/op\n";
+    };
+
+    std::cout << "vector math (dot + cross + normalize), simd_width = " << simd_width << '\n';
+
+    {
+        bench_timer timer;
+        double acc = 0;
+        for (int rep = 0; rep < repeats; rep++)
+            for (size_t i = 0; i < count; i++)
+                acc += dot(unit_vector(cross(aos[i], aos[i + 1])), aos[i]);
+        double t = timer.seconds();
+        bench_keep(acc);
+        report("vec3 (double)", t);
+    }
+
+    {
+        bench_timer timer;
+        float acc = 0;
+        for (int rep = 0; rep < repeats; rep++)
+            for (size_t i = 0; i < count; i++)
+                acc += dot(unit_vector(cross(aos_simd[i], aos_simd[i + 1])), aos_simd[i]);
+        double t = timer.seconds();
+        bench_keep(acc);
+        report("simd_vec3 (AoS)", t);
+    }
+
+    report("vec3_packet<4> (SoA)", bench_packet_kernel<4>(xs, ys, zs, repeats));
+    report("vec3_packet<8> (SoA)", bench_packet_kernel<8>(xs, ys, zs, repeats));
+}
+
+void bench_sphere_set()
+{
+    // Random small spheres in a cube, traced with rays aimed through the cloud.
+    const int num_spheres = 200000;
+    const int num_rays = 200000;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    std::vector<point3> centers(num_spheres);
+    for (auto &c : centers)
+        c = vec3::random(-10, 10);
+
+    std::vector<ray> rays;
+    rays.reserve(num_rays);
+    for (int i = 0; i < num_rays; i++)
+    {
+        auto origin = 30.0 * random_unit_vector();
+        rays.emplace_back(origin, vec3::random(-8, 8) - origin, random_double());
+    }
+
+    auto trace = [&](const hittable &world, int &hits)
+    {
+        bench_timer timer;
+        hits = 0;
+        for (const auto &r : rays)
+        {
+            hit_record rec;
+            if (world.hit(r, interval(0.001, infinity), rec))
+                hits++;
+        }
+        return num_rays / timer.seconds() / 1e6;
+    };
+
+    const size_t control_block = 2 * sizeof(long);
+
+    bench_timer list_build;
+    hittable_list list;
+    for (const auto &c : centers)
+        list.add(make_shared<sphere>(c, 0.05, mat));
+    bvh_node tree(list);
+    double list_build_time = list_build.seconds();
+    size_t list_bytes = num_spheres * (sizeof(sphere) + control_block) +
+                        bvh_node_count(num_spheres) * (sizeof(bvh_node) + control_block);
+    int list_hits;
+    double list_rate = trace(tree, list_hits);
+
+    bench_timer set_build;
+    sphere_set set;
+    for (const auto &c : centers)
+        set.add(c, 0.05, mat);
+    set.build();
+    double set_build_time = set_build.seconds();
+    int set_hits;
+    double set_rate = trace(set, set_hits);
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "sphere soup: " << num_spheres << " spheres, " << num_rays << " rays, simd_width = " << simd_width << '\n'
+              << "  bvh_node of sphere: build " << list_build_time << " s, "
+              << list_bytes / (1024.0 * 1024.0) << " MiB, " << list_rate << " Mrays/s (" << list_hits << " hits)\n"
+              << "  sphere_set:         build " << set_build_time << " s, "
+              << set.memory_bytes() / (1024.0 * 1024.0) << " MiB, " << set_rate << " Mrays/s (" << set_hits << " hits)\n";
+}
+
+// Hides an object's per-time bounds so a BVH over it falls back to the swept box, the way
+// every moving object was bounded before nodes kept motion keys.
+class swept_bounds_only : public hittable
+{
+public:
+    swept_bounds_only(shared_ptr<hittable> object) : object(object) {}
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override { return object->hit(r, ray_t, rec); }
+
+    aabb bounding_box() const override { return object->bounding_box(); }
+
+private:
+    shared_ptr<hittable> object;
+};
+
+void bench_motion_blur()
+{
+    // A field of small spheres bouncing fast along y, viewed from the side so rays at any one
+    // time only pass near the spheres' positions at that time.
+    const int grid = 120;
+    const int num_rays = 200000;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    std::vector<point3> starts, ends;
+    for (int a = 0; a < grid; a++)
+    {
+        for (int b = 0; b < grid; b++)
+        {
+            point3 center(a - grid / 2 + 0.9 * random_double(), 0.2, b - grid / 2 + 0.9 * random_double());
+            starts.push_back(center);
+            ends.push_back(center + vec3(0, random_double(2, 6), 0));
+        }
+    }
+
+    std::vector<ray> rays;
+    rays.reserve(num_rays);
+    for (int i = 0; i < num_rays; i++)
+    {
+        point3 origin(random_double(-grid / 2.0, grid / 2.0), random_double(0, 6), -grid);
+        point3 target(random_double(-grid / 2.0, grid / 2.0), random_double(0, 6), grid);
+        rays.emplace_back(origin, target - origin, random_double());
+    }
+
+    auto trace = [&](const hittable &world, int &hits)
+    {
+        bench_timer timer;
+        hits = 0;
+        for (const auto &r : rays)
+        {
+            hit_record rec;
+            if (world.hit(r, interval(0.001, infinity), rec))
+                hits++;
+        }
+        return num_rays / timer.seconds() / 1e6;
+    };
+
+    hittable_list swept, keyed;
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        auto s = make_shared<sphere>(starts[i], ends[i], 0.2, mat);
+        swept.add(make_shared<swept_bounds_only>(s));
+        keyed.add(s);
+    }
+
+    bvh_node swept_tree(swept);
+    int swept_hits;
+    double swept_rate = trace(swept_tree, swept_hits);
+
+    bvh_node keyed_tree(keyed);
+    int keyed_hits;
+    double keyed_rate = trace(keyed_tree, keyed_hits);
+
+    sphere_set set;
+    for (size_t i = 0; i < starts.size(); i++)
+        set.add(starts[i], ends[i], 0.2, mat);
+    set.build();
+    int set_hits;
+    double set_rate = trace(set, set_hits);
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "motion blur: " << starts.size() << " moving spheres, " << num_rays << " rays\n"
+              << "  bvh_node, swept bounds:        " << swept_rate << " Mrays/s (" << swept_hits << " hits)\n"
+              << "  bvh_node, interpolated bounds: " << keyed_rate << " Mrays/s (" << keyed_hits << " hits)\n"
+              << "  sphere_set, interpolated:      " << set_rate << " Mrays/s (" << set_hits << " hits)\n";
+}
+
+void bench_boxes()
+{
+    // A city block of randomly rotated boxes, built once from six-quad boxes wrapped in
+    // rotate_y and translate and once from oriented_box.
+    const int grid = 60;
+    const int num_rays = 200000;
+    auto mat = make_shared<lambertian>(color(0.73, 0.73, 0.73));
+
+    hittable_list quads, boxes;
+    for (int a = 0; a < grid; a++)
+    {
+        for (int b = 0; b < grid; b++)
+        {
+            auto size = point3(random_double(2, 8), random_double(5, 40), random_double(2, 8));
+            auto angle = random_double(-45, 45);
+            auto offset = vec3(10.0 * a, 0, 10.0 * b);
+
+            shared_ptr<hittable> six_quads = box(point3(0, 0, 0), size, mat);
+            six_quads = make_shared<rotate_y>(six_quads, angle);
+            quads.add(make_shared<translate>(six_quads, offset));
+            boxes.add(make_shared<oriented_box>(point3(0, 0, 0), size, angle, offset, mat));
+        }
+    }
+
+    std::vector<ray> rays;
+    rays.reserve(num_rays);
+    for (int i = 0; i < num_rays; i++)
+    {
+        point3 origin(random_double(0, 10.0 * grid), random_double(1, 60), random_double(0, 10.0 * grid));
+        rays.emplace_back(origin, random_unit_vector(), 0.0);
+    }
+
+    auto trace = [&](const hittable &world, double &depth)
+    {
+        bench_timer timer;
+        depth = 0;
+        for (const auto &r : rays)
+        {
+            hit_record rec;
+            if (world.hit(r, interval(0.001, infinity), rec))
+                depth += rec.t;
+        }
+        return num_rays / timer.seconds() / 1e6;
+    };
+
+    bvh_node quad_tree(quads);
+    bvh_node box_tree(boxes);
+    double quad_depth, box_depth;
+    double quad_rate = trace(quad_tree, quad_depth);
+    double box_rate = trace(box_tree, box_depth);
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "boxes: " << grid * grid << " rotated boxes, " << num_rays << " rays\n"
+              << "  six quads + rotate_y + translate: " << quad_rate << " Mrays/s (mean depth "
+              << quad_depth / num_rays << ")\n"
+              << "  oriented_box:                     " << box_rate << " Mrays/s (mean depth "
+              << box_depth / num_rays << ")\n";
+}
+
+// Writes a grid mesh of `n` x `n` quads with texture coordinates and normals, in the layout
+// typical of exporter output.
+inline void write_grid_obj(const std::string &path, int n)
+{
+    std::ofstream out(path);
+    out << "# generated benchmark mesh\n" << std::fixed << std::setprecision(6);
+    for (int j = 0; j <= n; j++)
+        for (int i = 0; i <= n; i++)
+            out << "v " << i * 0.01 - 0.5 * n * 0.01 << ' ' << 0.05 * std::sin(0.1 * i) * std::cos(0.1 * j)
+                << ' ' << j * -0.01 << '\n';
+    for (int j = 0; j <= n; j++)
+        for (int i = 0; i <= n; i++)
+            out << "vt " << double(i) / n << ' ' << double(j) / n << '\n';
+    out << "vn 0.000000 1.000000 0.000000\n";
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            int a = j * (n + 1) + i + 1, b = a + 1, c = a + n + 2, d = a + n + 1;
+            out << "f " << a << '/' << a << "/1 " << b << '/' << b << "/1 " << c << '/' << c << "/1 " << d << '/'
+                << d << "/1\n";
+        }
+    }
+}
+
+void bench_obj_parser()
+{
+    auto path = (std::filesystem::temp_directory_path() / "rt_bench_grid.obj").string();
+    write_grid_obj(path, 1000);
+    double megabytes = std::filesystem::file_size(path) / (1024.0 * 1024.0);
+
+    // The line-by-line reader the parser used to be: getline, an istringstream and a substr
+    // per line, stoi per index.
+    bench_timer reference_timer;
+    size_t reference_vertices = 0, reference_faces = 0;
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::vector<point3> vertices;
+        std::vector<std::vector<int>> faces;
+        while (std::getline(file, line))
+        {
+            if (line.substr(0, 2) == "v ")
+            {
+                double x, y, z;
+                std::istringstream iss(line.substr(2));
+                if (iss >> x >> y >> z)
+                    vertices.push_back(point3(x, y, z));
+            }
+            else if (line.substr(0, 2) == "f ")
+            {
+                std::vector<int> face;
+                std::istringstream iss(line.substr(2));
+                std::string token;
+                while (iss >> token)
+                    face.push_back(std::stoi(token.substr(0, token.find('/'))) - 1);
+                faces.push_back(face);
+            }
+        }
+        reference_vertices = vertices.size();
+        reference_faces = faces.size();
+    }
+    double reference_time = reference_timer.seconds();
+
+    auto time_parser = [&](int threads, obj_parser &parser)
+    {
+        bench_timer timer;
+        parser.load(path, threads);
+        return timer.seconds();
+    };
+
+    obj_parser single, parallel;
+    double single_time = time_parser(1, single);
+    int hardware_threads = std::max(1, int(std::thread::hardware_concurrency()));
+    double parallel_time = time_parser(hardware_threads, parallel);
+
+    size_t num_vertices = parallel.vertex_count(), num_faces = parallel.face_count();
+    size_t num_tex_coords = parallel.tex_coord_count();
+    bench_timer mesh_timer;
+    auto mesh = parallel.make_mesh(make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    double mesh_time = mesh_timer.seconds();
+
+    // What the same triangles cost as individual `triangle` objects under a bvh_node.
+    const size_t control_block = 2 * sizeof(long);
+    size_t triangle_objects_bytes = mesh->triangle_count() * (sizeof(triangle) + control_block) +
+                                    bvh_node_count(mesh->triangle_count()) * (sizeof(bvh_node) + control_block);
+
+    const double mib = 1024.0 * 1024.0;
+    std::cout << std::fixed << std::setprecision(1)
+              << "obj parser: " << megabytes << " MB, " << num_vertices << " vertices, " << num_tex_coords
+              << " texture coordinates, " << num_faces << " faces\n"
+              << "  getline + istringstream (v, f only): " << megabytes / reference_time << " MB/s ("
+              << reference_vertices << " vertices, " << reference_faces << " faces)\n"
+              << "  obj_parser, 1 thread:                " << megabytes / single_time << " MB/s\n"
+              << "  obj_parser, hardware threads (" << hardware_threads << "):   " << megabytes / parallel_time
+              << " MB/s\n"
+              << "  triangulate + mesh BVH:              " << mesh_time << " s, " << mesh->triangle_count()
+              << " triangles\n"
+              << "  peak import buffers:                 " << parallel.peak_bytes() / mib << " MiB\n"
+              << "  triangle_mesh:                       " << mesh->memory_bytes() / mib << " MiB (vs "
+              << triangle_objects_bytes / mib << " MiB as triangle objects)\n";
+
+    std::filesystem::remove(path);
+}
+
+void bench_mesh_cache()
+{
+    auto path = (std::filesystem::temp_directory_path() / "rt_bench_cache.obj").string();
+    auto cache_path = mesh_cache_path(path);
+    write_grid_obj(path, 1000);
+    std::filesystem::remove(cache_path);
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    // First load parses the OBJ, builds the BVH and writes the cache; the second maps it.
+    bench_timer cold_timer;
+    auto parsed = load_obj_mesh(path, mat);
+    double cold_time = cold_timer.seconds();
+
+    bench_timer warm_timer;
+    auto cached = load_obj_mesh(path, mat);
+    double warm_time = warm_timer.seconds();
+
+    const int num_rays = 200000;
+    std::vector<ray> rays;
+    rays.reserve(num_rays);
+    for (int i = 0; i < num_rays; i++)
+    {
+        point3 origin(random_double(-6, 6), 3, random_double(-11, 1));
+        rays.emplace_back(origin, vec3(random_double(-1, 1), -1, random_double(-1, 1)));
+    }
+
+    auto trace = [&](const hittable &mesh, double &depth)
+    {
+        bench_timer timer;
+        depth = 0;
+        for (const auto &r : rays)
+        {
+            hit_record rec;
+            if (mesh.hit(r, interval(0.001, infinity), rec))
+                depth += rec.t;
+        }
+        return num_rays / timer.seconds() / 1e6;
+    };
+
+    double parsed_depth, cached_depth;
+    double cached_rate = trace(*cached, cached_depth);
+    double parsed_rate = trace(*parsed, parsed_depth);
+
+    const double mib = 1024.0 * 1024.0;
+    std::cout << std::fixed << std::setprecision(3)
+              << "mesh cache: " << parsed->triangle_count() << " triangles, "
+              << std::filesystem::file_size(path) / mib << " MiB obj, " << std::filesystem::file_size(cache_path) / mib
+              << " MiB cache\n"
+              << "  parse + build + write cache: " << 1000 * cold_time << " ms, " << parsed->memory_bytes() / mib
+              << " MiB heap\n"
+              << "  map cache:                   " << 1000 * warm_time << " ms, " << cached->memory_bytes() / mib
+              << " MiB heap\n"
+              << "  first 200k rays, parsed mesh: " << parsed_rate << " Mrays/s (depth " << parsed_depth << ")\n"
+              << "  first 200k rays, mapped mesh: " << cached_rate << " Mrays/s (depth " << cached_depth << ")\n";
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(cache_path);
+}
+
+void bench_texture_cache()
+{
+    // Synthetic 2048x2048 sources with detail at every scale, written as binary PPM.
+    const int num_textures = 6, size = 2048;
+    auto directory = std::filesystem::temp_directory_path();
+    std::vector<std::string> paths;
+    std::vector<unsigned char> rgb(3 * size_t(size) * size);
+    for (int i = 0; i < num_textures; i++)
+    {
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size; x++)
+            {
+                unsigned char *p = &rgb[3 * (size_t(y) * size + x)];
+                p[0] = static_cast<unsigned char>((x * (i + 1)) ^ y);
+                p[1] = static_cast<unsigned char>(((x / 16 + y / 16) % 2) * 200 + i * 9);
+                p[2] = static_cast<unsigned char>((x * y) >> (8 + i % 4));
+            }
+        paths.push_back((directory / ("rt_bench_texture_" + std::to_string(i) + ".ppm")).string());
+        std::ofstream out(paths.back(), std::ios::binary);
+        out << "P6\n" << size << " " << size << "\n255\n";
+        out.write(reinterpret_cast<const char *>(rgb.data()), std::streamsize(rgb.size()));
+        std::filesystem::remove(paths.back() + ".rttex");
+    }
+
+    // Coherent bursts of lookups, as from the rays of one tile of the image hitting one
+    // object: a texture, a neighbourhood of it, and footprints from full resolution to 8
+    // texels wide.
+    struct lookup
+    {
+        int texture;
+        double u, v, width;
+    };
+    const int num_bursts = 400, burst = 4000;
+    std::vector<lookup> lookups;
+    lookups.reserve(size_t(num_bursts) * burst);
+    for (int b = 0; b < num_bursts; b++)
+    {
+        int texture = random_int(0, num_textures - 1);
+        double cu = random_double(), cv = random_double();
+        for (int i = 0; i < burst; i++)
+            lookups.push_back({texture, cu + random_double(-0.03, 0.03), cv + random_double(-0.03, 0.03),
+                               random_double(0, 8.0 / size)});
+    }
+
+    auto run = [&](const std::vector<shared_ptr<texture>> &textures, color &sum)
+    {
+        bench_timer timer;
+        sum = color(0, 0, 0);
+        for (const auto &l : lookups)
+            sum += textures[l.texture]->value_filtered(l.u, l.v, l.width, point3(0, 0, 0));
+        return lookups.size() / timer.seconds() / 1e6;
+    };
+
+    bench_timer resident_timer;
+    std::vector<shared_ptr<texture>> resident;
+    size_t resident_bytes = 0;
+    for (const auto &path : paths)
+    {
+        auto tex = make_shared<image_texture>(path.c_str());
+        resident_bytes += tex->memory_bytes();
+        resident.push_back(tex);
+    }
+    double resident_load = resident_timer.seconds();
+
+    const double mib = 1024.0 * 1024.0;
+    color resident_sum;
+    double resident_rate = run(resident, resident_sum);
+    std::cout << std::fixed << std::setprecision(3) << "texture cache: " << num_textures << " textures of " << size
+              << "x" << size << ", " << lookups.size() << " filtered lookups in bursts of " << burst << "\n"
+              << "  resident mipmaps:   load " << 1000 * resident_load << " ms, " << resident_bytes / mib
+              << " MiB, " << resident_rate << " Mlookups/s\n";
+
+    for (size_t budget : {size_t(256) << 20, size_t(16) << 20, size_t(4) << 20})
+    {
+        auto cache = make_shared<texture_cache>(budget);
+        bench_timer open_timer;
+        std::vector<shared_ptr<texture>> cached;
+        for (const auto &path : paths)
+            cached.push_back(make_shared<cached_image_texture>(cache, cache->add(path)));
+        double open_time = open_timer.seconds();
+
+        color cached_sum;
+        double cached_rate = run(cached, cached_sum);
+        auto stats = cache->stats();
+        bool same = cached_sum.x() == resident_sum.x() && cached_sum.y() == resident_sum.y() &&
+                    cached_sum.z() == resident_sum.z();
+        std::cout << "  cache " << std::setw(3) << budget / (1 << 20) << " MiB:      open " << 1000 * open_time
+                  << " ms, " << stats.resident_bytes / mib << " MiB resident, " << cached_rate << " Mlookups/s, "
+                  << 100 * stats.hit_rate() << "% hits, " << stats.misses << " tile loads, " << stats.evictions
+                  << " evictions" << (same ? "" : " (MISMATCH)") << "\n";
+    }
+
+    for (const auto &path : paths)
+    {
+        std::filesystem::remove(path);
+        std::filesystem::remove(path + ".rttex");
+    }
+}
+
+void bench_texture_registry()
+{
+    // Distinct synthetic images, plus a byte-for-byte copy of the first under another name.
+    const int num_files = 4, size = 2048, uses = 8;
+    auto directory = std::filesystem::temp_directory_path();
+    std::vector<std::string> paths;
+    std::vector<unsigned char> rgb(3 * size_t(size) * size);
+    for (int i = 0; i < num_files; i++)
+    {
+        for (size_t k = 0; k < rgb.size(); k++)
+            rgb[k] = static_cast<unsigned char>((k * (i + 3)) >> 5);
+        paths.push_back((directory / ("rt_bench_registry_" + std::to_string(i) + ".ppm")).string());
+        std::ofstream out(paths.back(), std::ios::binary);
+        out << "P6\n" << size << " " << size << "\n255\n";
+        out.write(reinterpret_cast<const char *>(rgb.data()), std::streamsize(rgb.size()));
+    }
+    auto copy_path = (directory / "rt_bench_registry_copy.ppm").string();
+    std::filesystem::copy_file(paths[0], copy_path, std::filesystem::copy_options::overwrite_existing);
+
+    // Each material decoding its own copy, as image_texture used to.
+    bench_timer separate_timer;
+    size_t separate_bytes = 0;
+    for (const auto &path : paths)
+        for (int use = 0; use < uses; use++)
+            separate_bytes += mipmap(rtw_image(path.c_str())).memory_bytes();
+    double separate_time = separate_timer.seconds();
+
+    // The same requests through a registry: each file decodes once, on the registry's threads.
+    texture_registry registry;
+    bench_timer shared_timer;
+    std::vector<shared_ptr<image_texture>> textures;
+    for (int use = 0; use < uses; use++)
+        for (const auto &path : paths)
+            textures.push_back(make_shared<image_texture>(registry.load(path)));
+    textures.push_back(make_shared<image_texture>(registry.load(copy_path)));
+    double request_time = shared_timer.seconds();
+
+    for (const auto &tex : textures)
+        tex->value(0.5, 0.5, point3(0, 0, 0)); // Waits for the decode
+    double shared_time = shared_timer.seconds();
+
+    size_t shared_bytes = 0;
+    for (const auto &path : paths)
+        shared_bytes += registry.load(path).get()->memory_bytes();
+    bool copy_shared = registry.load(copy_path).get() == registry.load(paths[0]).get();
+    auto stats = registry.stats();
+
+    const double mib = 1024.0 * 1024.0;
+    std::cout << std::fixed << std::setprecision(3) << "texture registry: " << num_files << " images of " << size
+              << "x" << size << ", each used by " << uses << " textures, plus a copy of one under another name\n"
+              << "  decode per texture: " << 1000 * separate_time << " ms, " << separate_bytes / mib << " MiB\n"
+              << "  registry:           " << 1000 * shared_time << " ms (" << 1000 * request_time
+              << " ms to hand out handles), " << shared_bytes / mib << " MiB\n"
+              << "  " << stats.requests << " requests, " << stats.decoded << " decoded, " << stats.shared_by_path
+              << " shared by path, " << stats.shared_by_content << " shared by content; copy "
+              << (copy_shared ? "shares" : "does NOT share") << " the original's image\n";
+
+    for (const auto &path : paths)
+        std::filesystem::remove(path);
+    std::filesystem::remove(copy_path);
+}
+
+void bench_noise()
+{
+    // Shading points over a 4-unit box, with noise at 4 lattice cells per unit. Points come in
+    // bursts around a random center, like the hits of neighbouring camera rays.
+    const int num_points = 1000000, burst = 1000;
+    const double scale = 4;
+    aabb region(point3(-2, -2, -2), point3(2, 2, 2));
+    std::vector<point3> points;
+    points.reserve(num_points);
+    while (points.size() < size_t(num_points))
+    {
+        point3 center(random_double(-1.8, 1.8), random_double(-1.8, 1.8), random_double(-1.8, 1.8));
+        for (int i = 0; i < burst; i++)
+            points.push_back(center + 0.2 * vec3::random(-1, 1));
+    }
+
+    perlin noise;
+    std::vector<double> reference(num_points), turb_reference(num_points);
+    auto rate = [&](auto &&evaluate, std::vector<double> &out)
+    {
+        bench_timer timer;
+        for (int i = 0; i < num_points; i++)
+            out[i] = evaluate(points[i]);
+        return num_points / timer.seconds() / 1e6;
+    };
+    auto errors = [&](const std::vector<double> &values, const std::vector<double> &truth, double &rms)
+    {
+        double worst = 0, sum = 0;
+        for (int i = 0; i < num_points; i++)
+        {
+            double e = std::fabs(values[i] - truth[i]);
+            worst = std::max(worst, e);
+            sum += e * e;
+        }
+        rms = std::sqrt(sum / num_points);
+        return worst;
+    };
+
+    std::vector<double> values(num_points);
+    double noise_rate = rate([&](const point3 &p) { return noise.noise(scale * p); }, reference);
+    double turb_rate = rate([&](const point3 &p) { return noise.turb(p, 6); }, turb_reference);
+
+    std::cout << std::fixed << std::setprecision(2) << "noise: " << num_points
+              << " points in bursts of " << burst << ", 4 lattice cells per unit over a 4-unit box\n"
+              << "  noise, evaluated:   " << noise_rate << " M/s\n"
+              << "  turb(6), evaluated: " << turb_rate << " M/s\n";
+
+    const double mib = 1024.0 * 1024.0;
+    for (double samples : {2.0, 4.0, 8.0})
+    {
+        bench_timer build_timer;
+        noise_grid grid(region, 1.0 / (scale * samples), [&](const point3 &p) { return noise.noise(scale * p); });
+        double build_time = build_timer.seconds();
+        double baked_rate = rate([&](const point3 &p)
+                                 {
+                                     double v = 0;
+                                     grid.sample(p, v);
+                                     return v;
+                                 },
+                                 values);
+        double baked_rms, baked_worst = errors(values, reference, baked_rms);
+        std::cout << std::fixed << "  noise baked, " << samples << " samples/cell:  " << baked_rate << " M/s, "
+                  << grid.memory_bytes() / mib << " MiB, built in " << 1000 * build_time << " ms, max error "
+                  << std::scientific << baked_worst << ", rms " << baked_rms << "\n";
+    }
+    for (double samples : {8.0, 32.0})
+    {
+        bench_timer build_timer;
+        noise_grid grid(region, 1.0 / samples, [&](const point3 &p) { return noise.turb(p, 6); });
+        double build_time = build_timer.seconds();
+        double baked_rate = rate([&](const point3 &p)
+                                 {
+                                     double v = 0;
+                                     grid.sample(p, v);
+                                     return v;
+                                 },
+                                 values);
+        double baked_rms, baked_worst = errors(values, turb_reference, baked_rms);
+        std::cout << std::fixed << "  turb baked, " << samples << " samples/unit: " << baked_rate << " M/s, "
+                  << grid.memory_bytes() / mib << " MiB, built in " << 1000 * build_time << " ms, max error "
+                  << std::scientific << baked_worst << ", rms " << baked_rms << "\n";
+    }
+    std::cout << std::defaultfloat;
+}
+
+void bench_texture_program()
+{
+    const int num_lookups = 4000000;
+    std::vector<point3> points(num_lookups);
+    for (auto &p : points)
+        p = point3(random_double(-4, 4), random_double(-4, 4), random_double(-4, 4));
+
+    auto solid = make_shared<solid_color>(0.73, 0.73, 0.73);
+    auto nested = make_shared<checker_texture>(
+        1.0, make_shared<checker_texture>(0.25, color(0.9, 0.1, 0.1), color(0.9, 0.9, 0.9)),
+        make_shared<checker_texture>(0.5, make_shared<solid_color>(0.2, 0.3, 0.1), make_shared<solid_color>(0.2, 0.3, 0.1)));
+
+    auto run = [&](auto &&lookup, color &sum)
+    {
+        bench_timer timer;
+        sum = color(0, 0, 0);
+        for (const auto &p : points)
+            sum += lookup(p);
+        return num_lookups / timer.seconds() / 1e6;
+    };
+
+    std::cout << std::fixed << std::setprecision(2) << "texture program: " << num_lookups << " lookups\n";
+    for (const auto &[name, tex] : {std::pair<const char *, shared_ptr<texture>>{"solid color", solid},
+                                    std::pair<const char *, shared_ptr<texture>>{"nested checkers", nested}})
+    {
+        texture_program program(tex);
+        color tree_sum, program_sum;
+        double tree_rate = run([&](const point3 &p) { return tex->value_filtered(0.5, 0.5, 0, p); }, tree_sum);
+        double program_rate = run([&](const point3 &p) { return program.evaluate(0.5, 0.5, 0, p); }, program_sum);
+        bool same = tree_sum.x() == program_sum.x() && tree_sum.y() == program_sum.y() &&
+                    tree_sum.z() == program_sum.z();
+        std::cout << "  " << std::left << std::setw(16) << name << std::right << " virtual calls " << tree_rate
+                  << " M/s, program " << program_rate << " M/s (" << program.node_count() << " nodes"
+                  << (program.is_constant() ? ", constant" : "") << ")" << (same ? "" : " MISMATCH") << "\n";
+    }
+}
+
+// Forwards to another hittable, counting the hits it reports.
+class counting_hittable : public hittable
+{
+public:
+    counting_hittable(shared_ptr<hittable> object) : object(object) {}
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        if (!object->hit(r, ray_t, rec))
+            return false;
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    aabb bounding_box() const override { return object->bounding_box(); }
+
+    mutable std::atomic<size_t> hits{0};
+
+private:
+    shared_ptr<hittable> object;
+};
+
+void bench_scatter_allocations()
+{
+    // A Cornell box holding every material that returns a sampling pdf: lambertian walls,
+    // a glossy sphere and an isotropic fog, plus glass for the specular path.
+    hittable_list objects, lights;
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+    objects.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 0, 555), vec3(0, 555, 0), green));
+    objects.add(make_shared<quad>(point3(0, 0, 555), vec3(0, 0, -555), vec3(0, 555, 0), red));
+    objects.add(make_shared<quad>(point3(0, 555, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    objects.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 0, -555), white));
+    objects.add(make_shared<quad>(point3(555, 0, 555), vec3(-555, 0, 0), vec3(0, 555, 0), white));
+    objects.add(make_shared<quad>(point3(213, 554, 227), vec3(130, 0, 0), vec3(0, 0, 105), light));
+    objects.add(make_shared<sphere>(point3(190, 90, 190), 90, make_shared<glossy>(color(0.8, 0.8, 0.8), 0.3, 1.0)));
+    objects.add(make_shared<sphere>(point3(400, 90, 350), 90, make_shared<dielectric>(1.5)));
+    objects.add(make_shared<constant_medium>(make_shared<sphere>(point3(300, 300, 300), 100, nullptr), 0.01,
+                                             color(0.9, 0.9, 0.9)));
+    lights.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), nullptr));
+
+    auto world = make_shared<counting_hittable>(make_shared<bvh_node>(objects));
+
+    camera cam;
+    cam.ar = 1.0;
+    cam.width = 100;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 10;
+    cam.background = color(0, 0, 0);
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+
+    // The image and progress go nowhere; only the counts matter.
+    std::ostringstream image, progress;
+    auto *out = std::cout.rdbuf(image.rdbuf());
+    auto *log = std::clog.rdbuf(progress.rdbuf());
+    size_t before = heap_allocations();
+    bench_timer timer;
+    cam.render(*world, lights);
+    double seconds = timer.seconds();
+    size_t allocations = heap_allocations() - before;
+    std::cout.rdbuf(out);
+    std::clog.rdbuf(log);
+
+    // The renderer itself allocates its image rows and worker threads; the image's own output
+    // string grows a few times as well.
+    size_t vertices = world->hits.load();
+    std::cout << std::fixed << std::setprecision(3) << "scatter allocations: " << cam.width << "x" << cam.width
+              << ", " << cam.samples_per_pixel << " spp\n"
+              << "  path vertices:    " << vertices << " (" << vertices / seconds / 1e6 << " M/s)\n"
+              << "  heap allocations: " << allocations << " ("
+              << std::setprecision(6) << double(allocations) / std::max<size_t>(vertices, 1)
+              << " per vertex)\n";
+}
+
+void bench_light_sampling()
+{
+    // Noise at equal render time, with and without next-event estimation, on the scene files
+    // that mirror the built-in cornell_box and simple_scene. Noise is the RMS difference between
+    // two independent renders over sqrt(2), in 8-bit display values, so no reference image is
+    // needed.
+    const int width = 100;
+    const double seconds_per_render = 1.5;
+
+    auto find_scene = [](const std::string &name)
+    {
+        for (std::string prefix : {"", "../", "../../"})
+            if (std::filesystem::exists(prefix + "scenes/" + name))
+                return prefix + "scenes/" + name;
+        return std::string();
+    };
+
+    auto to_display = [](double linear)
+    {
+        return int(256 * interval(0.000, 0.999).clamp(linear_to_gamma(linear)));
+    };
+
+    std::cout << std::fixed << std::setprecision(2) << "light sampling: noise at " << seconds_per_render
+              << " s per render, " << width << " px wide\n";
+
+    std::ostringstream progress;
+    auto *log = std::clog.rdbuf(progress.rdbuf());
+    for (const char *name : {"cornell_box.scene", "simple.scene"})
+    {
+        auto path = find_scene(name);
+        scene s;
+        if (path.empty() || !scene_file::load(path, s))
+        {
+            std::clog.rdbuf(log);
+            std::cout << "  " << name << ": not found (run from the repository or build directory)\n";
+            std::clog.rdbuf(progress.rdbuf());
+            continue;
+        }
+        s.commit();
+        s.cam.width = width;
+
+        for (bool nee : {false, true})
+        {
+            s.cam.next_event_estimation = nee;
+
+            // Time a short render, then pick the largest square sample count (the camera
+            // stratifies on a square grid) that fits the budget.
+            s.cam.samples_per_pixel = 4;
+            bench_timer calibration;
+            s.cam.render_pixels(s.world, s.light_set());
+            double seconds_per_sample = calibration.seconds() / 4;
+            int sqrt_spp = std::max(1, int(std::sqrt(seconds_per_render / seconds_per_sample)));
+            s.cam.samples_per_pixel = sqrt_spp * sqrt_spp;
+
+            bench_timer timer;
+            auto a = s.cam.render_pixels(s.world, s.light_set());
+            auto b = s.cam.render_pixels(s.world, s.light_set());
+            double seconds = timer.seconds() / 2;
+
+            double squared = 0, mean = 0;
+            for (size_t i = 0; i < a.size(); i++)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    double d = to_display(a[i][k]) - to_display(b[i][k]);
+                    squared += d * d;
+                    mean += to_display(a[i][k]) + to_display(b[i][k]);
+                }
+            }
+            double noise = std::sqrt(squared / (3 * a.size()) / 2);
+            mean /= 6 * a.size();
+
+            // Square sample counts don't hit the budget exactly; noise falls as 1/sqrt(time), so
+            // scale it to what the full budget would have given.
+            double noise_at_budget = noise * std::sqrt(seconds / seconds_per_render);
+
+            std::clog.rdbuf(log);
+            std::cout << "  " << std::left << std::setw(18) << name << std::setw(22)
+                      << (nee ? "next-event + MIS" : "light/BSDF mixture") << std::right << std::setw(5)
+                      << s.cam.samples_per_pixel << " spp in " << seconds << " s, noise " << noise
+                      << " (" << noise_at_budget << " at budget), mean " << mean << "\n";
+            std::clog.rdbuf(progress.rdbuf());
+        }
+    }
+    std::clog.rdbuf(log);
+}
+
+void bench_many_lights()
+{
+    // Noise at equal render time for each way of picking a light, over a floor lit by a grid
+    // of small downward-facing panels whose power spans four orders of magnitude. The camera
+    // looks down on them, so it only sees their light on the floor. Noise is measured as in
+    // bench_light_sampling; a lower mean means more light was cut by the camera's firefly clamp,
+    // which poorly chosen bright lights run into.
+    const int grid = 64;
+    const int width = 80;
+    const double seconds_per_render = 1.5;
+
+    hittable_list objects, lights;
+    auto floor = make_shared<lambertian>(color(.73, .73, .73));
+    objects.add(make_shared<quad>(point3(-60, 0, -60), vec3(0, 0, 120), vec3(120, 0, 0), floor));
+    for (int i = 0; i < grid; i++)
+    {
+        for (int j = 0; j < grid; j++)
+        {
+            auto strength = std::pow(10.0, random_double(0, 4));
+            auto light = make_shared<diffuse_light>(strength * color(random_double(0.5, 1), random_double(0.5, 1), 1));
+            auto center = point3(-50 + 100 * (i + random_double()) / grid, random_double(0.5, 3),
+                                 -50 + 100 * (j + random_double()) / grid);
+            auto panel = make_shared<quad>(center, vec3(0.2, 0, 0), vec3(0, 0, 0.2), light);
+            objects.add(panel);
+            lights.add(panel);
+        }
+    }
+    bvh_node world(objects);
+
+    camera cam;
+    cam.ar = 1.0;
+    cam.width = width;
+    cam.max_depth = 4;
+    cam.background = color(0, 0, 0);
+    cam.vfov = 50;
+    cam.lookfrom = point3(0, 40, -60);
+    cam.lookat = point3(0, 0, 0);
+
+    auto to_display = [](double linear)
+    {
+        return int(256 * interval(0.000, 0.999).clamp(linear_to_gamma(linear)));
+    };
+
+    std::cout << std::fixed << std::setprecision(2) << "many lights: " << lights.objects.size()
+              << " lights, noise at " << seconds_per_render << " s per render, " << width << " px wide\n";
+
+    std::ostringstream progress;
+    auto *log = std::clog.rdbuf(progress.rdbuf());
+    for (auto mode : {light_selection::uniform, light_selection::power, light_selection::tree})
+    {
+        bench_timer build;
+        light_sampler sampler(lights, mode);
+        double build_seconds = build.seconds();
+
+        cam.samples_per_pixel = 4;
+        bench_timer calibration;
+        cam.render_pixels(world, sampler);
+        double seconds_per_sample = calibration.seconds() / 4;
+        int sqrt_spp = std::max(1, int(std::sqrt(seconds_per_render / seconds_per_sample)));
+        cam.samples_per_pixel = sqrt_spp * sqrt_spp;
+
+        bench_timer timer;
+        auto a = cam.render_pixels(world, sampler);
+        auto b = cam.render_pixels(world, sampler);
+        double seconds = timer.seconds() / 2;
+
+        double squared = 0, mean = 0;
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                double d = to_display(a[i][k]) - to_display(b[i][k]);
+                squared += d * d;
+                mean += to_display(a[i][k]) + to_display(b[i][k]);
+            }
+        }
+        double noise = std::sqrt(squared / (3 * a.size()) / 2);
+        double noise_at_budget = noise * std::sqrt(seconds / seconds_per_render);
+        mean /= 6 * a.size();
+
+        const char *name = mode == light_selection::uniform ? "uniform"
+                           : mode == light_selection::power ? "power (alias table)"
+                                                            : "tree (light BVH)";
+        std::clog.rdbuf(log);
+        std::cout << "  " << std::left << std::setw(20) << name << std::right << std::setw(5)
+                  << cam.samples_per_pixel << " spp in " << seconds << " s, noise " << noise << " ("
+                  << noise_at_budget << " at budget), mean " << mean << ", built in "
+                  << std::setprecision(4) << build_seconds << std::setprecision(2) << " s\n";
+        std::clog.rdbuf(progress.rdbuf());
+    }
+    std::clog.rdbuf(log);
+}
+
+void bench_environment_light()
+{
+    // Noise at equal render time for an outdoor scene lit only by an environment map: a dim
+    // blue sky and a sun 2 degrees across that delivers most of the light. Found by BSDF samples
+    // alone the sun is a rare, very bright hit; sampled as a light it is hit nearly every time.
+    // Error is the RMS difference, in 8-bit display values, from a reference rendered with
+    // environment sampling at 4x the budget. Unlike the noise between two renders this also
+    // counts the light the camera's firefly clamp cuts from rare bright samples.
+    const int width = 100;
+    const double seconds_per_render = 1.5;
+
+    const int sky_width = 1024, sky_height = 512;
+    const vec3 sun_direction = unit_vector(vec3(1, 1.2, 0.6));
+    const double sun_radius = degrees_to_radians(1.0);
+    const double sun_solid_angle = 2 * pi * (1 - std::cos(sun_radius));
+    const color sun = color(1.0, 0.95, 0.85) * (2.5 / sun_solid_angle); // Irradiance 2.5 head-on
+    std::vector<color> sky(size_t(sky_width) * sky_height);
+    for (int y = 0; y < sky_height; y++)
+    {
+        for (int x = 0; x < sky_width; x++)
+        {
+            // Texel centers, mapped as environment_light maps directions.
+            auto phi = 2 * pi * (x + 0.5) / sky_width;
+            auto theta = pi * (y + 0.5) / sky_height;
+            vec3 d(-std::cos(phi) * std::sin(theta), std::cos(theta), std::sin(phi) * std::sin(theta));
+            auto up = std::fmax(0.0, d.y());
+            color c = (1 - up) * color(0.25, 0.3, 0.35) + up * color(0.1, 0.2, 0.45);
+            if (dot(d, sun_direction) > std::cos(sun_radius))
+                c = sun;
+            sky[size_t(y) * sky_width + x] = c;
+        }
+    }
+
+    hittable_list objects;
+    objects.add(make_shared<quad>(point3(-50, 0, -50), vec3(0, 0, 100), vec3(100, 0, 0),
+                                  make_shared<lambertian>(color(0.5, 0.5, 0.45))));
+    objects.add(make_shared<sphere>(point3(0, 1, 0), 1, make_shared<lambertian>(color(0.7, 0.3, 0.2))));
+    objects.add(make_shared<sphere>(point3(-2.2, 1, 0.5), 1, make_shared<glossy>(color(0.8, 0.8, 0.8), 0.3, 1.0)));
+    objects.add(make_shared<sphere>(point3(2.2, 1, -0.5), 1, make_shared<dielectric>(1.5)));
+    bvh_node world(objects);
+    hittable_list lights; // Empty: the environment is the only light
+
+    camera cam;
+    cam.ar = 16.0 / 9.0;
+    cam.width = width;
+    cam.max_depth = 8;
+    cam.vfov = 35;
+    cam.lookfrom = point3(0, 2.5, 9);
+    cam.lookat = point3(0, 0.8, 0);
+    cam.environment = make_shared<environment_light>(sky_width, sky_height, sky);
+
+    auto to_display = [](double linear)
+    {
+        return int(256 * interval(0.000, 0.999).clamp(linear_to_gamma(linear)));
+    };
+
+    std::cout << std::fixed << std::setprecision(2) << "environment light: " << sky_width << "x" << sky_height
+              << " sky with a sun, error at " << seconds_per_render << " s per render, " << width << " px wide\n";
+
+    // Renders with the largest square sample count (the camera stratifies on a square grid)
+    // that fits `seconds` after timing a short render, and returns the seconds it took.
+    auto render = [&](double seconds, std::vector<color> &pixels)
+    {
+        cam.samples_per_pixel = 4;
+        bench_timer calibration;
+        cam.render_pixels(world, lights);
+        double seconds_per_sample = calibration.seconds() / 4;
+        int sqrt_spp = std::max(1, int(std::sqrt(seconds / seconds_per_sample)));
+        cam.samples_per_pixel = sqrt_spp * sqrt_spp;
+
+        bench_timer timer;
+        pixels = cam.render_pixels(world, lights);
+        return timer.seconds();
+    };
+
+    std::ostringstream progress;
+    auto *log = std::clog.rdbuf(progress.rdbuf());
+    std::vector<color> reference;
+    cam.sample_environment = true;
+    render(4 * seconds_per_render, reference);
+
+    for (bool sampled : {false, true})
+    {
+        cam.sample_environment = sampled;
+        std::vector<color> pixels;
+        double seconds = render(seconds_per_render, pixels);
+
+        double squared = 0, mean = 0;
+        for (size_t i = 0; i < pixels.size(); i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                double d = to_display(pixels[i][k]) - to_display(reference[i][k]);
+                squared += d * d;
+                mean += to_display(pixels[i][k]);
+            }
+        }
+        double error = std::sqrt(squared / (3 * pixels.size()));
+        mean /= 3 * pixels.size();
+
+        std::clog.rdbuf(log);
+        std::cout << "  " << std::left << std::setw(28) << (sampled ? "environment sampled + MIS" : "BSDF sampling only")
+                  << std::right << std::setw(5) << cam.samples_per_pixel << " spp in " << seconds << " s, error "
+                  << error << ", mean " << mean << "\n";
+        std::clog.rdbuf(progress.rdbuf());
+    }
+    std::clog.rdbuf(log);
+}
+
+void bench_path_guiding()
+{
+    // Error at equal render time with and without path guiding, on the scene file that mirrors
+    // the built-in cornell_box (its glossy sphere sees the room mostly through reflected light)
+    // and on a room lit only through a small opening in its ceiling, where most of the light
+    // arrives from the patch of floor under the opening. Guided renders learn over
+    // `guiding_passes` training passes within their own budget. Error is the RMS difference, in
+    // 8-bit display values, from a reference rendered with guiding at 4x the budget, as in
+    // bench_environment_light; noise between two renders, as in bench_light_sampling, leaves out
+    // the light the firefly clamp cuts, which the mean shows. Guided paths clamp less of it.
+    const int width = 100;
+    const double seconds_per_render = 3.0;
+    const int guiding_passes = 5;
+
+    auto find_scene = [](const std::string &name)
+    {
+        for (std::string prefix : {"", "../", "../../"})
+            if (std::filesystem::exists(prefix + "scenes/" + name))
+                return prefix + "scenes/" + name;
+        return std::string();
+    };
+
+    auto to_display = [](double linear)
+    {
+        return int(256 * interval(0.000, 0.999).clamp(linear_to_gamma(linear)));
+    };
+
+    std::cout << std::fixed << std::setprecision(2) << "path guiding: error at " << seconds_per_render
+              << " s per render, " << width << " px wide, " << guiding_passes << " training passes\n";
+
+    std::ostringstream progress;
+    auto *log = std::clog.rdbuf(progress.rdbuf());
+    for (const char *name : {"cornell_box.scene", "skylight room"})
+    {
+        scene s;
+        if (std::string(name) == "skylight room")
+        {
+            // A 10 x 4 x 10 room with a 1 x 1 opening in a thick ceiling, and the only light
+            // above it. Walls rise into the ceiling slab so that no seam lets light in.
+            auto white = make_shared<lambertian>(color(.75, .75, .75));
+            auto red = make_shared<lambertian>(color(.6, .1, .1));
+            s.world.add(make_shared<quad>(point3(0, 0, 0), vec3(10, 0, 0), vec3(0, 0, 10), white));
+            s.world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 4.3, 0), vec3(10, 0, 0), white));
+            s.world.add(make_shared<quad>(point3(0, 0, 10), vec3(10, 0, 0), vec3(0, 4.3, 0), white));
+            s.world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 0, 10), vec3(0, 4.3, 0), red));
+            s.world.add(make_shared<quad>(point3(10, 0, 0), vec3(0, 4.3, 0), vec3(0, 0, 10), white));
+            s.world.add(make_shared<oriented_box>(point3(0, 4, 0), point3(4.5, 4.3, 10), white));
+            s.world.add(make_shared<oriented_box>(point3(5.5, 4, 0), point3(10, 4.3, 10), white));
+            s.world.add(make_shared<oriented_box>(point3(4.5, 4, 0), point3(5.5, 4.3, 4.5), white));
+            s.world.add(make_shared<oriented_box>(point3(4.5, 4, 5.5), point3(5.5, 4.3, 10), white));
+            s.world.add(make_shared<oriented_box>(point3(6, 0, 3), point3(8, 2, 5), white));
+            auto light = make_shared<quad>(point3(3, 7, 3), vec3(4, 0, 0), vec3(0, 0, 4),
+                                           make_shared<diffuse_light>(color(40, 40, 40)));
+            s.world.add(light);
+            s.lights.add(light);
+
+            s.cam.ar = 1.0;
+            s.cam.max_depth = 8;
+            s.cam.background = color(0, 0, 0);
+            s.cam.vfov = 70;
+            s.cam.lookfrom = point3(1, 2, 9.5);
+            s.cam.lookat = point3(6, 1.2, 2);
+        }
+        else
+        {
+            auto path = find_scene(name);
+            if (path.empty() || !scene_file::load(path, s))
+            {
+                std::clog.rdbuf(log);
+                std::cout << "  " << name << ": not found (run from the repository or build directory)\n";
+                std::clog.rdbuf(progress.rdbuf());
+                continue;
+            }
+        }
+        s.commit();
+        s.cam.width = width;
+
+        // Renders with the largest sample count that fits `seconds` after timing a short
+        // render, and returns the seconds it took. Guided renders spend part of their samples on
+        // training, so this times them at a count that includes every pass.
+        auto render = [&](bool guided, double seconds, std::vector<color> &pixels)
+        {
+            s.cam.guiding_passes = guided ? guiding_passes : 0;
+            const int calibration_spp = 1 << guiding_passes;
+            s.cam.samples_per_pixel = calibration_spp;
+            bench_timer calibration;
+            s.cam.render_pixels(s.world, s.light_set());
+            double seconds_per_sample = calibration.seconds() / calibration_spp;
+            s.cam.samples_per_pixel = std::max(1, int(seconds / seconds_per_sample));
+
+            bench_timer timer;
+            pixels = s.cam.render_pixels(s.world, s.light_set());
+            return timer.seconds();
+        };
+
+        std::vector<color> reference;
+        render(true, 4 * seconds_per_render, reference);
+
+        for (bool guided : {false, true})
+        {
+            std::vector<color> a, b;
+            double seconds = (render(guided, seconds_per_render, a) + render(guided, seconds_per_render, b)) / 2;
+
+            double error = 0, squared = 0, mean = 0;
+            for (size_t i = 0; i < a.size(); i++)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    double e = to_display(a[i][k]) - to_display(reference[i][k]);
+                    double d = to_display(a[i][k]) - to_display(b[i][k]);
+                    error += e * e;
+                    squared += d * d;
+                    mean += to_display(a[i][k]) + to_display(b[i][k]);
+                }
+            }
+            error = std::sqrt(error / (3 * a.size()));
+            double noise = std::sqrt(squared / (3 * a.size()) / 2);
+            double noise_at_budget = noise * std::sqrt(seconds / seconds_per_render);
+            mean /= 6 * a.size();
+
+            std::clog.rdbuf(log);
+            std::cout << "  " << std::left << std::setw(19) << name << std::setw(10) << (guided ? "guided" : "unguided")
+                      << std::right << std::setw(5) << s.cam.samples_per_pixel << " spp in " << seconds
+                      << " s, error " << error << ", noise " << noise << " (" << noise_at_budget
+                      << " at budget), mean " << mean << "\n";
+            std::clog.rdbuf(progress.rdbuf());
+        }
+    }
+    std::clog.rdbuf(log);
+}
+
+// One row of bench_fast_math. `libm` and `fast` map an input pair to a double (one-argument
+// kernels ignore y), and `batch` does the same for arrays of floats. A kernel with no scalar
+// form passes nullptr for `fast`, and one with no batch form leaves `batch` null.
+template <typename Libm, typename Fast>
+void fast_math_row(const char *name, const std::vector<double> &xs, const std::vector<double> &ys, bool relative,
+                   double scalar_bound, Libm libm, Fast fast,
+                   double batch_bound = 0, void (*batch)(const float *, const float *, float *, size_t) = nullptr)
+{
+    const int repeats = 8;
+    size_t n = xs.size();
+
+    auto error = [&](double value, double exact)
+    {
+        double e = std::fabs(value - exact);
+        return relative ? e / std::fmax(1.0, std::fabs(exact)) : e;
+    };
+
+    constexpr bool scalar = !std::is_same_v<Fast, std::nullptr_t>;
+    double scalar_error = 0;
+    if constexpr (scalar)
+        for (size_t i = 0; i < n; i++)
+            scalar_error = std::fmax(scalar_error, error(fast(xs[i], ys[i]), libm(xs[i], ys[i])));
+
+    // Batch results are compared with libm on the same float inputs, so float rounding of the
+    // inputs isn't counted against the kernel.
+    std::vector<float> fx(xs.begin(), xs.end()), fy(ys.begin(), ys.end()), out(n);
+    double batch_error = 0;
+    if (batch)
+    {
+        batch(fx.data(), fy.data(), out.data(), n);
+        for (size_t i = 0; i < n; i++)
+            batch_error = std::fmax(batch_error, error(out[i], libm(fx[i], fy[i])));
+    }
+
+    volatile double sink = 0;
+    auto nanoseconds = [&](auto &&pass)
+    {
+        bench_timer timer;
+        for (int r = 0; r < repeats; r++)
+            sink = sink + pass();
+        return timer.seconds() / (double(n) * repeats) * 1e9;
+    };
+    double libm_ns = nanoseconds([&]()
+    {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += libm(xs[i], ys[i]);
+        return sum;
+    });
+    double fast_ns = 0;
+    if constexpr (scalar)
+        fast_ns = nanoseconds([&]()
+        {
+            double sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += fast(xs[i], ys[i]);
+            return sum;
+        });
+    double batch_ns = batch ? nanoseconds([&]()
+    {
+        batch(fx.data(), fy.data(), out.data(), n);
+        return double(out[n / 2]);
+    }) : 0;
+
+    bool pass = scalar_error <= scalar_bound && batch_error <= batch_bound;
+    std::cout << "  " << std::left << std::setw(6) << name << std::right << std::scientific << std::setprecision(1);
+    if (scalar)
+        std::cout << std::setw(10) << scalar_error << " (" << scalar_bound << ")";
+    else
+        std::cout << std::setw(20) << "-";
+    if (batch)
+        std::cout << std::setw(10) << batch_error << " (" << batch_bound << ")";
+    else
+        std::cout << std::setw(20) << "-";
+    std::cout << std::fixed << std::setprecision(2) << std::setw(9) << libm_ns;
+    if (scalar)
+        std::cout << std::setw(9) << fast_ns << " (" << libm_ns / fast_ns << "x)";
+    else
+        std::cout << std::setw(16) << "-";
+    if (batch)
+        std::cout << std::setw(8) << batch_ns << " (" << libm_ns / batch_ns << "x)";
+    else
+        std::cout << std::setw(16) << "-";
+    std::cout << "  " << (pass ? "ok" : "FAIL") << "\n";
+}
+
+void bench_fast_math()
+{
+    // Checks each fast_math.h kernel against libm over its documented domain, in double and in
+    // float batches, and times the forms on the same inputs. Errors are absolute, except for
+    // log and pow5, whose are relative to max(1, |exact|). A kernel over a bound documented in
+    // fast_math.h prints FAIL.
+    const size_t n = size_t(1) << 20;
+
+    auto inputs = [&](double low, double high, bool exponential = false)
+    {
+        std::vector<double> v(n);
+        for (auto &x : v)
+            x = exponential ? std::exp(random_double(low, high)) : random_double(low, high);
+        return v;
+    };
+    std::vector<double> none(n, 0.0);
+
+    std::cout << "fast math: " << n << " inputs per kernel, batches " << simd_width << " floats wide\n"
+              << "  kernel  double error (bound)  float error (bound)   libm ns  scalar ns         batch ns\n";
+
+    auto angles = inputs(-1e3, 1e3);
+    fast_math_row("sin", angles, none, false, 1e-14,
+                  [](double x, double) { return std::sin(x); },
+                  [](double x, double) { double s, c; fast_sin_cos(x, s, c); return s; },
+                  2e-7, [](const float *x, const float *, float *out, size_t count)
+                  {
+                      thread_local std::vector<float> cosines;
+                      cosines.resize(count);
+                      fast_sin_cos(x, out, cosines.data(), count);
+                  });
+    fast_math_row("cos", angles, none, false, 1e-14,
+                  [](double x, double) { return std::cos(x); },
+                  [](double x, double) { return fast_cos(x); },
+                  2e-7, [](const float *x, const float *, float *out, size_t count)
+                  {
+                      thread_local std::vector<float> sines;
+                      sines.resize(count);
+                      fast_sin_cos(x, sines.data(), out, count);
+                  });
+    fast_math_row("acos", inputs(-1, 1), none, false, 3e-8,
+                  [](double x, double) { return std::acos(x); },
+                  [](double x, double) { return fast_acos(x); },
+                  6e-7, [](const float *x, const float *, float *out, size_t count) { fast_acos(x, out, count); });
+
+    // Points around the origin at every angle and a wide range of radii.
+    std::vector<double> ys(n), xs(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        auto angle = random_double(-pi, pi), radius = std::exp(random_double(-20, 20));
+        ys[i] = radius * std::sin(angle);
+        xs[i] = radius * std::cos(angle);
+    }
+    fast_math_row("atan2", ys, xs, false, 2e-12,
+                  [](double y, double x) { return std::atan2(y, x); },
+                  [](double y, double x) { return fast_atan2(y, x); },
+                  5e-7, [](const float *y, const float *x, float *out, size_t count) { fast_atan2(y, x, out, count); });
+
+    fast_math_row("log", inputs(-40, 40, true), none, true, 0,
+                  [](double x, double) { return std::log(x); }, nullptr,
+                  3e-7, [](const float *x, const float *, float *out, size_t count) { fast_log(x, out, count); });
+    fast_math_row("pow5", inputs(0, 1), none, true, 1e-15,
+                  [](double x, double) { return std::pow(x, 5); },
+                  [](double x, double) { return pow5(x); });
+    std::cout << std::defaultfloat;
+}
+
+void bench_bsdf_convention()
+{
+    // Checks that every BSDF follows the bsdf_sample contract, whose value includes the cosine
+    // term, by estimating each one's directional albedo (the share of light from the viewer's
+    // direction that it reflects) two ways: integrating eval() over uniform hemisphere
+    // directions, and averaging value / pdf over its own sample(). The two must agree, and
+    // with the cosine in the albedo can't exceed 1; a value without it integrates a diffuse
+    // lobe to twice its albedo. A material that breaks either prints FAIL.
+    const int samples = 400000;
+
+    struct entry
+    {
+        const char *name;
+        shared_ptr<material> mat;
+    };
+    const entry materials[] = {
+        {"lambertian", make_shared<lambertian>(color(.8, .8, .8))},
+        {"glossy plastic", make_shared<glossy>(color(.8, .8, .8), 0.6, 0.0)},
+        {"glossy metal", make_shared<glossy>(color(.9, .9, .9), 0.4, 1.0)},
+    };
+
+    std::cout << std::fixed << std::setprecision(3) << "bsdf convention: directional albedo from " << samples
+              << " samples\n"
+              << "  material        cos(view)   eval()   sample()\n";
+
+    for (const auto &[name, mat] : materials)
+    {
+        for (double cos_view : {0.9, 0.5, 0.2})
+        {
+            hit_record rec;
+            rec.p = point3(0, 0, 0);
+            rec.normal = vec3(0, 0, 1);
+            rec.front_face = true;
+            rec.u = rec.v = 0;
+            rec.uv_footprint = 0;
+            point3 eye(std::sqrt(1 - cos_view * cos_view), 0, cos_view);
+            shading_frame frame(ray(eye, rec.p - eye), rec);
+
+            double by_eval = 0, by_sample = 0;
+            for (int i = 0; i < samples; i++)
+            {
+                double pdf;
+                vec3 direction = random_on_hemisphere(rec.normal);
+                by_eval += luminance(mat->eval(rec, frame, direction, pdf)) * 2 * pi;
+
+                bsdf_sample s;
+                if (mat->sample(rec, frame, s) && s.pdf > 0)
+                    by_sample += luminance(s.value) / s.pdf;
+            }
+            by_eval /= samples;
+            by_sample /= samples;
+
+            bool pass = std::fabs(by_eval - by_sample) <= 0.03 * std::fmax(by_eval, by_sample) + 0.005 &&
+                        std::fmax(by_eval, by_sample) <= 1.01;
+            std::cout << "  " << std::left << std::setw(16) << name << std::right << std::setw(9) << cos_view
+                      << std::setw(9) << by_eval << std::setw(11) << by_sample << "  " << (pass ? "ok" : "FAIL")
+                      << "\n";
+        }
+    }
+    std::cout << std::defaultfloat;
+}
+
+#endif
@@ -118,4 +118,79 @@ aabb operator+(const aabb& bbox, const vec3& offset) {
 aabb operator+(const vec3& offset, const aabb& bbox) {
     return bbox + offset;
 }
+
+// Bounding box stored in geometry precision, rounded outward so it always encloses the
+// double-precision box it was built from. Used for BVH node storage and traversal.
+class packed_aabb
+{
+public:
+    geom_vec3 lo, hi;
+
+    packed_aabb() {}
+
+    packed_aabb(const aabb &box)
+        : lo(round_down(box.x.min), round_down(box.y.min), round_down(box.z.min)),
+          hi(round_up(box.x.max), round_up(box.y.max), round_up(box.z.max)) {}
+
+    aabb to_aabb() const
+    {
+        return aabb(interval(lo[0], hi[0]), interval(lo[1], hi[1]), interval(lo[2], hi[2]));
+    }
+
+    bool operator==(const packed_aabb &other) const
+    {
+        for (int axis = 0; axis < 3; axis++)
+            if (lo[axis] != other.lo[axis] || hi[axis] != other.hi[axis])
+                return false;
+        return true;
+    }
+
+    // The box at shutter time `time`, interpolated between this box (time 0) and `end`
+    // (time 1) and widened by the rounding error of the interpolation.
+    packed_aabb lerp(const packed_aabb &end, double time) const
+    {
+        packed_aabb box;
+        auto t = geom_real(time);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            auto lo_t = lo[axis] + t * (end.lo[axis] - lo[axis]);
+            auto hi_t = hi[axis] + t * (end.hi[axis] - hi[axis]);
+            auto err_lo = geom_gamma(3) * std::max(std::fabs(lo[axis]), std::fabs(end.lo[axis]));
+            auto err_hi = geom_gamma(3) * std::max(std::fabs(hi[axis]), std::fabs(end.hi[axis]));
+            box.lo[axis] = lo_t - err_lo;
+            box.hi[axis] = hi_t + err_hi;
+        }
+        return box;
+    }
+
+    bool hit(const ray &r, interval ray_t) const
+    {
+        const geom_vec3 &orig = r.origin_g();
+        const geom_vec3 &inv_dir = r.inv_direction_g();
+
+        geom_real t_min = geom_real(ray_t.min);
+        geom_real t_max = round_up(ray_t.max);
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            auto t0 = (lo[axis] - orig[axis]) * inv_dir[axis];
+            auto t1 = (hi[axis] - orig[axis]) * inv_dir[axis];
+            if (t0 > t1)
+                std::swap(t0, t1);
+
+            // Widen the far slab distance by the rounding error of the computation above so a
+            // box touched by the exact ray is never culled.
+            t1 *= 1 + 2 * geom_gamma(3);
+
+            if (t0 > t_min)
+                t_min = t0;
+            if (t1 < t_max)
+                t_max = t1;
+
+            if (t_max < t_min)
+                return false;
+        }
+        return true;
+    }
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+
+// Samples an index with probability proportional to its weight in constant time (Walker's
+// alias method, built with Vose's algorithm). Each bin holds the chance of keeping its own
+// index and the index it otherwise hands over to.
+class alias_table
+{
+public:
+    alias_table() {}
+
+    // Weights must be non-negative. If they are all zero, every index is equally likely.
+    explicit alias_table(const std::vector<double> &weights)
+    {
+        size_t n = weights.size();
+        bins.resize(n);
+        probabilities.resize(n);
+        if (n == 0)
+            return;
+
+        double total = 0;
+        for (double w : weights)
+            total += w;
+
+        std::vector<double> scaled(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            probabilities[i] = total > 0 ? weights[i] / total : 1.0 / n;
+            scaled[i] = probabilities[i] * n;
+        }
+
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; i++)
+            (scaled[i] < 1 ? small : large).push_back(uint32_t(i));
+
+        while (!small.empty() && !large.empty())
+        {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            bins[s] = {scaled[s], l};
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1)
+            {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Whatever is left is 1 up to rounding.
+        for (uint32_t i : large)
+            bins[i] = {1, i};
+        for (uint32_t i : small)
+            bins[i] = {1, i};
+    }
+
+    size_t size() const { return bins.size(); }
+
+    // Probability of sampling index `i`.
+    double probability(size_t i) const { return probabilities[i]; }
+
+    size_t sample() const
+    {
+        double u = random_double() * bins.size();
+        size_t i = std::min(size_t(u), bins.size() - 1);
+        return u - i < bins[i].keep ? i : bins[i].alias;
+    }
+
+private:
+    struct bin
+    {
+        double keep = 1;    // Chance of returning this bin's own index
+        uint32_t alias = 0; // Index returned otherwise
+    };
+
+    std::vector<bin> bins;
+    std::vector<double> probabilities;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <atomic>
+#include <cstddef>
+
+// Heap allocations made through the global operator new since the program started.
+// allocation_counter.cpp replaces operator new to count them; in a program that doesn't link
+// it, the count stays at 0.
+//
+// Each thread counts its own in a plain thread_local, so allocating threads never contend on a
+// shared counter, and folds it into one total when it exits. heap_allocations() is that total
+// plus the calling thread's count: exact for the calling thread and for threads it has joined,
+// which is how a render's workers end.
+struct thread_allocation_count
+{
+    size_t value = 0;
+    ~thread_allocation_count();
+};
+
+inline std::atomic<size_t> exited_thread_allocations{0};
+inline thread_local thread_allocation_count thread_allocations;
+
+inline thread_allocation_count::~thread_allocation_count()
+{
+    exited_thread_allocations.fetch_add(value, std::memory_order_relaxed);
+    value = 0;
+}
+
+inline size_t heap_allocations()
+{
+    return exited_thread_allocations.load(std::memory_order_relaxed) + thread_allocations.value;
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef BVH_H
 #define BVH_H
 
+#include <algorithm>
+
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
@@ -8,6 +10,16 @@
 class bvh_node : public hittable
 {
 public:
+    // An object together with its bounding box, computed once before the build so the
+    // recursive splits and sorts don't keep re-deriving it through virtual calls.
+    struct build_entry
+    {
+        aabb box;       // Bounds over the whole shutter interval, used to pick splits
+        aabb box_start; // Bounds at time 0
+        aabb box_end;   // Bounds at time 1
+        shared_ptr<hittable> object;
+    };
+
     bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size())
     {
         // There's a C++ subtlety here. This constructor (without span indices) creates an
@@ -17,42 +29,60 @@ public:
     }
 
     bvh_node(std::vector<shared_ptr<hittable>> &objects, size_t start, size_t end)
+        : bvh_node(make_entries(objects, start, end), 0, end - start)
+    {}
+
+    bvh_node(std::vector<build_entry> &&entries, size_t start, size_t end)
+        : bvh_node(entries, start, end)
+    {}
+
+    bvh_node(std::vector<build_entry> &entries, size_t start, size_t end)
     {
-        bbox = aabb::empty;
+        aabb bbox = aabb::empty;
+        aabb bbox_start = aabb::empty;
+        aabb bbox_end = aabb::empty;
 
-        for (size_t object_index = start; object_index < end; object_index++)
-            bbox = aabb(bbox, objects[object_index]->bounding_box());
+        for (size_t index = start; index < end; index++)
+        {
+            bbox = aabb(bbox, entries[index].box);
+            bbox_start = aabb(bbox_start, entries[index].box_start);
+            bbox_end = aabb(bbox_end, entries[index].box_end);
+        }
 
         int axis = bbox.longest_axis();
 
-        auto comparator = (axis == 0)   ? box_x_compare
-                        : (axis == 1)   ? box_y_compare
-                                        : box_z_compare;
-
         size_t object_span = end - start;
 
         if (object_span == 1)
         {
-            left = right = objects[start];
+            left = right = entries[start].object;
         }
         else if (object_span == 2)
         {
-            left = objects[start];
-            right = objects[start + 1];
+            left = entries[start].object;
+            right = entries[start + 1].object;
         }
         else
         {
-            std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+            std::sort(std::begin(entries) + start, std::begin(entries) + end,
+                      [axis](const build_entry &a, const build_entry &b)
+                      { return a.box.axis_interval(axis).min < b.box.axis_interval(axis).min; });
 
             auto mid = start + object_span / 2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            left = make_shared<bvh_node>(entries, start, mid);
+            right = make_shared<bvh_node>(entries, mid, end);
         }
+
+        // Keep bounds at both shutter keys. Static subtrees, where they coincide, skip the
+        // interpolation during traversal.
+        bounds = packed_aabb(bbox_start);
+        end_bounds = packed_aabb(bbox_end);
+        moving = !(bounds == end_bounds);
     }
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        if (!bbox.hit(r, ray_t))
+        if (!(moving ? bounds.lerp(end_bounds, r.time()) : bounds).hit(r, ray_t))
             return false;
 
         bool left_hit = left->hit(r, ray_t, rec);
@@ -61,32 +91,33 @@ public:
         return left_hit || right_hit;
     }
 
-    aabb bounding_box() const override { return bbox; }
+    aabb bounding_box() const override { return aabb(bounds.to_aabb(), end_bounds.to_aabb()); }
+
+    aabb bounding_box_at(double time) const override
+    {
+        return moving ? bounds.lerp(end_bounds, time).to_aabb() : bounds.to_aabb();
+    }
 
 private:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
-    aabb bbox;
+    packed_aabb bounds;     // Bounds at shutter time 0
+    packed_aabb end_bounds; // Bounds at shutter time 1
+    bool moving;
 
-    static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index)
-    {
-        auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-        auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-        return a_axis_interval.min < b_axis_interval.min;
-    }
-
-    static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
-    {
-        return box_compare(a, b, 0);
-    }
-    static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
-    {
-        return box_compare(a, b, 1);
-    }
-    static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+    static std::vector<build_entry> make_entries(const std::vector<shared_ptr<hittable>> &objects,
+                                                 size_t start, size_t end)
     {
-        return box_compare(a, b, 2);
+        std::vector<build_entry> entries;
+        entries.reserve(end - start);
+        for (size_t index = start; index < end; index++)
+        {
+            const auto &object = objects[index];
+            entries.push_back({object->bounding_box(), object->bounding_box_at(0),
+                               object->bounding_box_at(1), object});
+        }
+        return entries;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -7,9 +7,11 @@
 #include <cstdio>
 #include <ctime>
 
+#include "environment_light.h"
 #include "hittable.h"
 #include "pdf.h"
 #include "material.h"
+#include "path_guiding.h"
 
 class camera
 {
@@ -30,72 +32,85 @@ public:
     double defocus_angle = 0; // Variation angle of rays through each pixel
     double focus_dist = 10;   // Distance from camera lookfrom point to plane of perfect focus
 
+    // At each diffuse or glossy hit, trace a shadow ray toward a sampled point on a light as
+    // well as continuing the path along a BSDF sample, and weight the two with the power
+    // heuristic. Off: diffuse hits pick one direction from an even mix of light and BSDF
+    // sampling, and glossy hits sample the BSDF only.
+    bool next_event_estimation = true;
+
+    // Light from every direction that leaves the scene, in place of `background` when set. It
+    // is sampled as a light along with the light list; with `sample_environment` off it is only
+    // found by BSDF samples that happen to escape.
+    shared_ptr<environment_light> environment;
+    bool sample_environment = true;
+
+    // Path guiding: the first samples per pixel are taken in up to this many training passes of
+    // 1, 2, 4, ... samples, which learn where light arrives from across the scene (see
+    // path_guide) as they render. Diffuse and glossy hits after the first pass draw half their
+    // directions from what was learned and half from the BSDF, and the rest of the samples are
+    // taken with all that was learned. 0 renders unguided.
+    int guiding_passes = 0;
+
+    // Renders and writes the image to stdout as a PPM.
     void render(const hittable &world, const hittable& lights)
     {
-        initialize();
-
-        std::vector<std::vector<color>> pixel_colors(height, std::vector<color>(width));
-
-        const int num_threads = std::thread::hardware_concurrency();
-        std::vector<std::thread> threads;
-        std::atomic<int> scanlines_completed{0};
-
-        auto center_x = width / 2;
-        auto center_y = height / 2;
-
-        // Launch threads with chunk-based work distribution for better cache locality
-        const int chunk_size = (height + num_threads - 1) / num_threads;
-        for (int t = 0; t < num_threads; ++t)
-        {
-            threads.emplace_back([this, &world, &lights, &pixel_colors, &scanlines_completed, chunk_size, num_threads, t, center_x, center_y]()
-                                 {
-                // Each thread processes a chunk of consecutive rows
-                int start_row = t * chunk_size;
-                int end_row = std::min(start_row + chunk_size, height);
-                for (int j = start_row; j < end_row; j++)
-                {
-                    for (int i = 0; i < width; i++)
-                    {
-                        color pixel_color(0, 0, 0);
-                        for (int s_i = 0; s_i < sqrt_spp; s_i++)
-                        {
-                            for (int s_j = 0; s_j < sqrt_spp; s_j++)
-                            {
-                                ray r = get_ray(i, j, s_i, s_j);
-                                pixel_color += ray_color(r, max_depth, world, lights);
-                            }
-                        }
-                        pixel_colors[j][i] = pixel_color;
-                    }
-                    
-                    // Update progress (atomic operation)
-                    int completed = ++scanlines_completed;
-                    std::clog << "\rScanlines remaining: " << (height - completed) << ' ' << std::flush;
-                } });
-        }
-
-        // Wait for all threads to complete
-        for (auto &thread : threads)
-        {
-            thread.join();
-        }
+        auto pixels = render_pixels(world, lights);
 
         // Write PPM header
         std::cout << "P3\n"
                   << width << ' ' << height << "\n255\n";
 
         // Write pixel data in order
-        for (int j = 0; j < height; j++)
+        for (const auto &pixel : pixels)
+            write_color(std::cout, pixel);
+    }
+
+    // Renders the image and returns its linear pixel colors, row by row from the top.
+    std::vector<color> render_pixels(const hittable &world, const hittable& lights)
+    {
+        initialize();
+
+        // An empty light list has an empty bounding box; light sampling is skipped then.
+        auto light_bounds = lights.bounding_box();
+        has_lights = light_bounds.x.min <= light_bounds.x.max;
+        sampled_environment = sample_environment ? environment.get() : nullptr;
+
+        std::vector<std::vector<color>> pixel_colors(height, std::vector<color>(width, color(0, 0, 0)));
+
+        guide.reset();
+        if (guiding_passes > 0)
         {
-            for (int i = 0; i < width; i++)
+            // Training passes of 1, 2, 4, ... samples take their share of samples_per_pixel,
+            // leaving at least one for the last pass. Every pass estimates the same image, so
+            // all of their samples are kept.
+            guide = make_shared<path_guide>(world.bounding_box());
+            int trained = 0;
+            sqrt_spp = 1;
+            inv_sqrt_spp = 1;
+            recording = true;
+            for (int pass = 0; pass < guiding_passes && trained + (1 << pass) < samples_per_pixel; pass++)
             {
-                write_color(std::cout, pixel_samples_scale * pixel_colors[j][i]);
+                trace_pixels(world, lights, 1 << pass, pixel_colors);
+                trained += 1 << pass;
+                guide->refine(pass);
             }
+            recording = false;
+            sqrt_spp = std::max(1, int(std::sqrt(samples_per_pixel - trained)));
+            inv_sqrt_spp = 1.0 / sqrt_spp;
+            pixel_samples_scale = 1.0 / (trained + sqrt_spp * sqrt_spp);
         }
+        trace_pixels(world, lights, 1, pixel_colors);
 
-        std::clog << "\rDone.                 \n";
+        std::vector<color> pixels;
+        pixels.reserve(size_t(width) * height);
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+                pixels.push_back(pixel_samples_scale * pixel_colors[j][i]);
+        return pixels;
     }
 
+    int image_height() const { return height; }
+
 private:
     int height;                 // Rendered image height
     double pixel_samples_scale; // Color scale factor for a sum of pixel samples
@@ -108,6 +123,11 @@ private:
     vec3 u, v, w;               // Camera frame basis vectors
     vec3 defocus_disk_u;        // Defocus disk horizontal radius
     vec3 defocus_disk_v;        // Defocus disk vertical radius
+    double pixel_spread;        // Angle subtended by one pixel, the spread of each camera ray cone
+    bool has_lights;            // Whether the light list passed to render() is non-empty
+    const environment_light *sampled_environment; // The environment, if it is sampled as a light
+    shared_ptr<path_guide> guide;       // While guiding_passes > 0
+    bool recording = false;             // Whether paths feed the guide (during training passes)
 
     void initialize()
     {
@@ -124,6 +144,7 @@ private:
         auto theta = degrees_to_radians(vfov);
         auto h = std::tan(theta / 2);
         auto viewport_height = 2 * h * focus_dist;
+        pixel_spread = 2 * h / height;
         auto viewport_width = viewport_height * (double(width) / height);
 
         w = unit_vector(lookfrom - lookat);
@@ -158,7 +179,9 @@ private:
         auto ray_direction = pixel_sample - ray_origin;
         auto ray_time = random_double();
 
-        return ray(ray_origin, ray_direction, ray_time);
+        ray r(ray_origin, ray_direction, ray_time);
+        r.set_cone(0, pixel_spread);
+        return r;
     }
    
     vec3 sample_square_stratified(int s_i, int s_j) const
@@ -182,7 +205,119 @@ private:
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color ray_color(const ray &r, int depth, const hittable &world, const hittable& lights) const
+    // Traces `repeats` rounds of sqrt_spp x sqrt_spp stratified samples for every pixel on all
+    // cores, and adds them to the pixels' sums.
+    void trace_pixels(const hittable &world, const hittable &lights, int repeats,
+                      std::vector<std::vector<color>> &pixel_colors)
+    {
+        const int num_threads = std::thread::hardware_concurrency();
+        std::vector<std::thread> threads;
+        std::atomic<int> scanlines_completed{0};
+
+        // Launch threads with chunk-based work distribution for better cache locality
+        const int chunk_size = (height + num_threads - 1) / num_threads;
+        for (int t = 0; t < num_threads; ++t)
+        {
+            threads.emplace_back([this, &world, &lights, &pixel_colors, &scanlines_completed, chunk_size, repeats, t]()
+                                 {
+                // Each thread processes a chunk of consecutive rows
+                int start_row = t * chunk_size;
+                int end_row = std::min(start_row + chunk_size, height);
+                for (int j = start_row; j < end_row; j++)
+                {
+                    for (int i = 0; i < width; i++)
+                    {
+                        color pixel_color(0, 0, 0);
+                        for (int repeat = 0; repeat < repeats; repeat++)
+                        {
+                            for (int s_i = 0; s_i < sqrt_spp; s_i++)
+                            {
+                                for (int s_j = 0; s_j < sqrt_spp; s_j++)
+                                {
+                                    ray r = get_ray(i, j, s_i, s_j);
+                                    pixel_color += ray_color(r, max_depth, world, lights);
+                                }
+                            }
+                        }
+                        pixel_colors[j][i] += pixel_color;
+                    }
+                    
+                    // Update progress (atomic operation)
+                    int completed = ++scanlines_completed;
+                    std::clog << "\rScanlines remaining: " << (height - completed) << ' ' << std::flush;
+                } });
+        }
+
+        // Wait for all threads to complete
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        std::clog << "\rDone.                 \n";
+    }
+
+    // Fills in the surface at the closest hit along `r`, including its texture footprint, and
+    // returns the width of the ray's cone there.
+    double resolve_hit(const ray &r, hit_record &rec) const
+    {
+        resolve_surface(r, rec);
+
+        // The ray cone's width where it hits, in texture units. Viewed at an angle, the
+        // footprint stretches by 1/cos along one axis; the filter is isotropic, so it
+        // covers the long axis.
+        auto cone_width = r.cone_width_at(rec.t);
+        auto cos_incidence = std::fabs(dot(rec.normal, unit_vector(r.direction())));
+        rec.uv_footprint = rec.uv_density * cone_width / std::fmax(cos_incidence, 1e-3);
+        return cone_width;
+    }
+
+    // One next-event estimate at `rec`: the light arriving along a direction sampled toward the
+    // lights, through the BSDF, weighted against finding it by BSDF sampling instead. The
+    // shadow ray finds the closest surface and takes whatever it emits, so a light hidden
+    // behind another contributes nothing and no separate visibility test is needed. With a guide
+    // region, BSDF sampling is its mix with the region's distribution, and while training the
+    // arriving light is recorded there.
+    color sample_light(const ray &r, const hit_record &rec, const material &mat, const shading_frame &frame,
+                       const light_pdf &light, const hittable &world, path_guide::region *region,
+                       double guide_fraction) const
+    {
+        vec3 direction = light.generate();
+        double light_pdf = light.value(direction);
+        if (!(light_pdf > 0))
+            return color(0, 0, 0);
+
+        double bsdf_pdf;
+        color f = mat.eval(rec, frame, direction, bsdf_pdf);
+        if (f.x() <= 0 && f.y() <= 0 && f.z() <= 0)
+            return color(0, 0, 0);
+        if (guide_fraction > 0)
+            bsdf_pdf = guide_fraction * region->pdf(direction) + (1 - guide_fraction) * bsdf_pdf;
+
+        ray shadow(rec.p, direction, r.time());
+        shadow.set_cone(r.cone_width_at(rec.t), r.cone_spread());
+        hit_record light_rec;
+        // A shadow ray that escapes sees the environment. Unless that is sampled as a light, the
+        // BSDF sample that escapes the same way counts it in full, so this sample takes none.
+        color arriving = sampled_environment ? sampled_environment->radiance(direction) : color(0, 0, 0);
+        if (world.hit(shadow, interval(0.001, infinity), light_rec))
+        {
+            resolve_hit(shadow, light_rec);
+            // A surface without a material (`none`) is black.
+            const material *emitter = material_table::global().get(light_rec.mat);
+            arriving = emitter ? emitter->emitted(shadow, light_rec, light_rec.u, light_rec.v, light_rec.p)
+                               : color(0, 0, 0);
+        }
+
+        color weighted = power_heuristic(light_pdf, bsdf_pdf) * arriving / light_pdf;
+        if (recording && region)
+            region->record(direction, luminance(weighted));
+        return f * weighted;
+    }
+
+    // `emission_weight` scales the light emitted by the surface this ray hits: the MIS weight of
+    // having found it by BSDF sampling, when the vertex the ray left also sampled the lights.
+    color ray_color(const ray &r, int depth, const hittable &world, const hittable& lights,
+                    double emission_weight = 1) const
     {
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
@@ -191,77 +326,122 @@ private:
         hit_record rec;
         if (world.hit(r, interval(0.001, infinity), rec))
         {
-            ray scattered;
-            color attenuation;
-            double pdf_value;
-            scatter_record srec;
-            color color_from_emission = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
-
-            
-            
-            if (rec.mat->scatter(r, rec, srec))
+            double cone_width = resolve_hit(r, rec);
+
+            // Hits only carry the material's id. One without a material (`none`) neither emits
+            // nor scatters.
+            const material *mat = material_table::global().get(rec.mat);
+            if (!mat)
+                return color(0, 0, 0);
+            color color_from_emission = emission_weight * mat->emitted(r, rec, rec.u, rec.v, rec.p);
+
+            int lobes = mat->lobes();
+            if (lobes == 0)
+                return color_from_emission;
+
+            shading_frame frame(r, rec);
+            bsdf_sample sample;
+            light_pdf light(has_lights ? &lights : nullptr, sampled_environment, rec.p);
+            bool any_lights = has_lights || sampled_environment;
+
+            // Next-event estimation covers the direct light at diffuse and glossy hits; the BSDF
+            // sample below then only counts the emission it finds with its share of the weight.
+            // Guiding covers diffuse and glossy materials: a specular lobe's directions are
+            // already as good as they get.
+            path_guide::region *region = nullptr;
+            double guide_fraction = 0;
+            if (guide && !(lobes & lobe_specular))
             {
-                if (srec.skip_pdf) 
-                {
-                    return srec.attenuation * ray_color(srec.skip_pdf_ray, depth-1, world, lights);
-                }
-                
-                if (rec.mat->use_light_sampling())
-                {
-                    // Use mixture PDF (light + material) for diffuse materials
-                auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-                mixture_pdf p(light_ptr, srec.pdf_ptr);
-
-                scattered = ray(rec.p, p.generate(), r.time());
-                pdf_value = p.value(scattered.direction());
-                }
-                else
-                {
-                    // Use only material PDF for glossy materials (BRDF importance sampling)
-                    scattered = ray(rec.p, srec.pdf_ptr->generate(), r.time());
-                    pdf_value = srec.pdf_ptr->value(scattered.direction());
-                }
-                    
-                color brdf_value = rec.mat->eval_brdf(r, rec, scattered);
-                color sample_color = ray_color(scattered, depth-1, world, lights);
-                color color_from_scatter = (brdf_value * sample_color) / pdf_value;
-
-                // Use ratio-preserving clamp to maintain color when clamping
-                const double max_radiance = 0.6;
-                double max_component = std::max({color_from_scatter.x(), color_from_scatter.y(), color_from_scatter.z()});
-                if (max_component > max_radiance) {
-                    double scale = max_radiance / max_component;
-                    color_from_scatter = color_from_scatter * scale;
-                }
-
-                // Russian Roulette: probabilistically terminate rays based on BRDF value
-                // This allows rays to terminate early when they contribute little light
-                double max_brdf = std::max({brdf_value.x(), brdf_value.y(), brdf_value.z()});
-
-                // After a few bounces, use Russian Roulette
-                if (depth > (max_depth - 3))
-                {
-                    // Always continue for first few bounces
-                    return color_from_emission + color_from_scatter;
-                }
-                else if (random_double() < max_brdf)
-                {
-                    // Continue with probability proportional to BRDF value
-                    return (color_from_emission + color_from_scatter) / max_brdf;
-                }
-                else
-                {
-                    // Terminate early
-                    return color(0, 0, 0);
-                }
+                region = &guide->region_at(rec.p);
+                guide_fraction = region->trained() ? 0.5 : 0.0;
             }
-            else if(!rec.mat->scatter(r, rec, srec))
-                return color_from_emission;
 
-            return color(0, 0, 0);
+            bool use_nee = next_event_estimation && any_lights && (lobes & (lobe_diffuse | lobe_glossy));
+            color color_from_lights = use_nee ? sample_light(r, rec, *mat, frame, light, world, region, guide_fraction)
+                                              : color(0, 0, 0);
+
+            // Otherwise, diffuse lobes mix in light sampling: half of their directions head for
+            // a light, and the pdf is the average of the two strategies'.
+            bool mix_lights = !next_event_estimation && any_lights && (lobes & lobe_diffuse);
+            double guide_pdf = -1;
+            if (mix_lights && random_double() < 0.5)
+            {
+                sample.direction = light.generate();
+                sample.value = mat->eval(rec, frame, sample.direction, sample.pdf);
+                sample.lobe = lobe_diffuse;
+            }
+            else if (guide_fraction > 0 && random_double() < guide_fraction)
+            {
+                sample.direction = region->sample(guide_pdf);
+                sample.value = mat->eval(rec, frame, sample.direction, sample.pdf);
+                sample.lobe = lobes;
+            }
+            else if (!mat->sample(rec, frame, sample))
+                return color_from_emission + color_from_lights;
+
+            // The BSDF strategy is now the mix of the two, whichever of them drew the direction.
+            if (guide_fraction > 0)
+            {
+                if (guide_pdf < 0)
+                    guide_pdf = region->pdf(sample.direction);
+                sample.pdf = guide_fraction * guide_pdf + (1 - guide_fraction) * sample.pdf;
+            }
+
+            if (sample.lobe & lobe_specular)
+            {
+                // Specular bounces carry the cone on; a curved mirror would also change its
+                // spread, which is ignored here.
+                ray next(rec.p, sample.direction, r.time());
+                next.set_cone(cone_width, r.cone_spread());
+                return color_from_emission + color_from_lights + sample.value * ray_color(next, depth-1, world, lights);
+            }
+
+            double pdf_value = sample.pdf;
+            double next_emission_weight = 1;
+            if (mix_lights)
+                pdf_value = 0.5 * light.value(sample.direction) + 0.5 * sample.pdf;
+            else if (use_nee)
+                next_emission_weight = power_heuristic(sample.pdf, light.value(sample.direction));
+            if (!(pdf_value > 0))
+                return color_from_emission + color_from_lights;
+
+            // Russian Roulette: after the first few bounces, continue with a probability given by
+            // the BSDF value, decided before tracing so that terminated paths cost nothing
+            color brdf_value = sample.value;
+            double max_brdf = std::max({brdf_value.x(), brdf_value.y(), brdf_value.z()});
+            double continue_probability = depth > (max_depth - 3) ? 1.0 : std::min(1.0, max_brdf);
+
+            color color_from_scatter(0, 0, 0);
+            if (random_double() < continue_probability)
+            {
+                ray scattered(rec.p, sample.direction, r.time());
+                scattered.set_cone(cone_width, r.cone_spread());
+
+                color sample_color = ray_color(scattered, depth-1, world, lights, next_emission_weight);
+                color_from_scatter = (brdf_value * sample_color) / (pdf_value * continue_probability);
+                if (recording && region)
+                    region->record(sample.direction, luminance(sample_color) / (pdf_value * continue_probability));
+            }
+            // Use ratio-preserving clamp to maintain color when clamping. Only the BSDF-sampled
+            // indirect light is clamped: the light sample is low-variance already, and clamping
+            // it would bias the direct light next-event estimation finds.
+            const double max_radiance = 0.6;
+            double max_component = std::max({color_from_scatter.x(), color_from_scatter.y(), color_from_scatter.z()});
+            if (max_component > max_radiance) {
+                double scale = max_radiance / max_component;
+                color_from_scatter = color_from_scatter * scale;
+            }
+
+            return color_from_emission + color_from_lights + color_from_scatter;
         }
         else if(!world.hit(r, interval(0.001, infinity), rec))
-            return background;
+        {
+            if (!environment)
+                return background;
+            // Weighted like emission when the environment is sampled as a light.
+            double weight = sampled_environment ? emission_weight : 1.0;
+            return weight * environment->radiance(r.direction());
+        }
 
         vec3 unit_direction = unit_vector(r.direction());
         auto a = 0.5 * (unit_direction.y() + 1.0);
@@ -14,6 +14,12 @@ inline double linear_to_gamma(double linear_component)
     return 0;
 }
 
+// Brightness of a linear color as the eye sees it (Rec. 709 weights).
+inline double luminance(const color &c)
+{
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 void write_color(std::ostream &out, const color &pixel_color)
 {
 
@@ -10,12 +10,12 @@ class constant_medium : public hittable {
   public:
     constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
       : boundary(boundary), neg_inv_density(-1/density),
-        phase_function(make_shared<isotropic>(tex))
+        phase_function(material_table::global().add(make_shared<isotropic>(tex)))
     {}
 
     constant_medium(shared_ptr<hittable> boundary, double density, const color& albedo)
       : boundary(boundary), neg_inv_density(-1/density),
-        phase_function(make_shared<isotropic>(albedo))
+        phase_function(material_table::global().add(make_shared<isotropic>(albedo)))
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -51,6 +51,7 @@ class constant_medium : public hittable {
         rec.normal = vec3(1,0,0);  // arbitrary
         rec.front_face = true;     // also arbitrary
         rec.mat = phase_function;
+        rec.prim = nullptr;
 
         return true;
     }
@@ -60,7 +61,7 @@ class constant_medium : public hittable {
   private:
     shared_ptr<hittable> boundary;
     double neg_inv_density;
-    shared_ptr<material> phase_function;
+    material_id phase_function;
 };
 
 #endif
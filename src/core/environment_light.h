@@ -0,0 +1,128 @@
+#ifndef ENVIRONMENT_LIGHT_H
+#define ENVIRONMENT_LIGHT_H
+
+#include <vector>
+
+#include "rtweekend.h"
+#include "alias_table.h"
+#include "rtw_stb_image.h"
+
+// Light arriving from infinitely far away, from a latitude-longitude image: columns run once
+// around the y axis (the same way as a sphere's u coordinate) and rows from straight up at the
+// top to straight down at the bottom. Each texel is a patch of constant radiance.
+//
+// Directions are sampled in proportion to the radiance (luminance) each texel sends, weighted
+// by the solid angle it covers: an alias table over the rows picks a row by its total, and a
+// table per row then picks the texel within it, so a sample costs O(1) whatever the image size.
+// A small bright sun in a dim sky then gets nearly every sample.
+class environment_light
+{
+public:
+    // Radiance is the image's linear texels times `scale`. Load HDR images as half or float to
+    // keep their range.
+    explicit environment_light(const rtw_image &image, double scale = 1.0)
+    {
+        std::vector<color> texels(size_t(image.width()) * image.height());
+        for (int y = 0; y < image.height(); y++)
+        {
+            for (int x = 0; x < image.width(); x++)
+            {
+                float rgb[3];
+                decode_texel(image.format(), image.pixel_data(x, y), rgb);
+                texels[size_t(y) * image.width() + x] = scale * color(rgb[0], rgb[1], rgb[2]);
+            }
+        }
+        build(image.width(), image.height(), std::move(texels));
+    }
+
+    // `texels` holds `width` x `height` linear radiances, row by row from the top.
+    environment_light(int width, int height, std::vector<color> texels)
+    {
+        build(width, height, std::move(texels));
+    }
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    // Radiance arriving from `direction` (any length).
+    color radiance(const vec3 &direction) const
+    {
+        int x, y;
+        texel_of(unit_vector(direction), x, y);
+        return texels[size_t(y) * image_width + x];
+    }
+
+    // A unit direction drawn in proportion to radiance.
+    vec3 sample() const
+    {
+        auto y = rows.sample();
+        auto x = columns[y].sample();
+        double sin_phi, cos_phi, sin_theta, cos_theta;
+        fast_sin_cos(2 * pi * (x + random_double()) / image_width, sin_phi, cos_phi);
+        fast_sin_cos(pi * (y + random_double()) / image_height, sin_theta, cos_theta);
+        return vec3(-cos_phi * sin_theta, cos_theta, sin_phi * sin_theta);
+    }
+
+    // Solid angle density of sample() drawing `direction` (any length).
+    double pdf(const vec3 &direction) const
+    {
+        auto unit = unit_vector(direction);
+        auto sin_theta = std::sqrt(std::fmax(0.0, 1 - unit.y() * unit.y()));
+        if (sin_theta <= 0)
+            return 0;
+        int x, y;
+        texel_of(unit, x, y);
+        // Uniform over the texel's patch of (phi, theta), which covers
+        // (2 pi / width) (pi / height) sin(theta) of solid angle per unit area.
+        auto probability = rows.probability(y) * columns[y].probability(x);
+        return probability * image_width * image_height / (2 * pi * pi * sin_theta);
+    }
+
+private:
+    int image_width = 0;
+    int image_height = 0;
+    std::vector<color> texels;
+    alias_table rows;                 // By each row's total weight
+    std::vector<alias_table> columns; // By texel weight within each row
+
+    void build(int width, int height, std::vector<color> radiances)
+    {
+        if (width <= 0 || height <= 0 || radiances.size() != size_t(width) * height)
+        {
+            // Nothing usable: a black environment, sampled uniformly.
+            width = height = 1;
+            radiances.assign(1, color(0, 0, 0));
+        }
+        image_width = width;
+        image_height = height;
+        texels = std::move(radiances);
+
+        std::vector<double> row_weights(height);
+        columns.reserve(height);
+        for (int y = 0; y < height; y++)
+        {
+            // Rows near the poles cover less solid angle.
+            auto sin_theta = std::sin(pi * (y + 0.5) / height);
+            std::vector<double> weights(width);
+            for (int x = 0; x < width; x++)
+            {
+                const color &c = texels[size_t(y) * width + x];
+                auto luminance = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+                weights[x] = std::fmax(0.0, luminance) * sin_theta;
+                row_weights[y] += weights[x];
+            }
+            columns.emplace_back(weights);
+        }
+        rows = alias_table(row_weights);
+    }
+
+    void texel_of(const vec3 &unit, int &x, int &y) const
+    {
+        auto theta = fast_acos(unit.y());
+        auto phi = fast_atan2(-unit.z(), unit.x()) + pi;
+        x = std::min(int(phi / (2 * pi) * image_width), image_width - 1);
+        y = std::min(int(theta / pi * image_height), image_height - 1);
+    }
+};
+
+#endif
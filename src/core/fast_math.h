@@ -0,0 +1,261 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+// Approximations of the libm functions on the shading paths, with bounded error.
+//
+//   function          domain                     max error vs libm   (double / batch float)
+//   fast_sin_cos      |x| <= 1e5 (else libm)     1e-14 abs            / 2e-7 abs for |x| <= 1e3
+//   fast_cos          as fast_sin_cos
+//   fast_acos         [-1, 1] (clamped)          3e-8 abs             / 6e-7 abs
+//   fast_atan2        any finite y, x            2e-12 abs            / 5e-7 abs
+//   fast_log          positive normal x          (batch only)         / 3e-7 rel
+//   pow5              any                        rounding only
+//
+// Each reduces its argument to a short interval and evaluates a fixed polynomial there, with no
+// table lookups and no data-dependent loops, so the same code vectorizes: the batch forms take
+// simd.h lanes (vfloat<N>) or whole float arrays and work in single precision. The bounds are
+// checked against libm by the `fast_math` benchmark, which also times each kernel. There is no
+// scalar log: glibc's table-driven one is already faster than this series with its division.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "simd.h"
+
+namespace fast_math_detail
+{
+constexpr double pi = 3.14159265358979323846;
+constexpr double half_pi = 1.57079632679489661923;
+constexpr double two_over_pi = 0.63661977236758134308;
+constexpr double sixth_pi = 0.52359877559829887308;
+constexpr double sqrt3 = 1.73205080756887729353;
+constexpr double tan_twelfth_pi = 0.26794919243112270647; // tan(pi/12)
+constexpr double ln2 = 0.69314718055994530942;
+constexpr double sqrt_half = 0.70710678118654752440;
+
+// pi/2 split in two: the first part has few enough bits that q * part is exact for the
+// quadrant counts allowed (Cody-Waite reduction).
+constexpr double half_pi_high = 1.57079632673412561417e+00;
+constexpr double half_pi_low = 6.07710050650619224932e-11;
+} // namespace fast_math_detail
+
+inline double pow5(double x)
+{
+    double x2 = x * x;
+    return x2 * x2 * x;
+}
+
+// Sine and cosine of `x` at once.
+inline void fast_sin_cos(double x, double &s, double &c)
+{
+    using namespace fast_math_detail;
+    if (!(std::fabs(x) <= 1e5))
+    {
+        s = std::sin(x);
+        c = std::cos(x);
+        return;
+    }
+
+    // x = q pi/2 + r with |r| <= pi/4, then Taylor series of sin and cos in r, whose first
+    // omitted terms are below 3e-15 there.
+    double q = std::floor(x * two_over_pi + 0.5);
+    double r = (x - q * half_pi_high) - q * half_pi_low;
+    double r2 = r * r;
+    double sin_r = r + r * r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040 + r2 * (1.0 / 362880 +
+                   r2 * (-1.0 / 39916800 + r2 * (1.0 / 6227020800.0 + r2 * (-1.0 / 1307674368000.0)))))));
+    double cos_r = 1 + r2 * (-0.5 + r2 * (1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320 +
+                   r2 * (-1.0 / 3628800 + r2 * (1.0 / 479001600.0 + r2 * (-1.0 / 87178291200.0)))))));
+
+    // Rotate by the quadrant with selects rather than a switch: quadrants of random angles
+    // would mispredict most of the time.
+    auto quadrant = int64_t(q);
+    bool odd = quadrant & 1;
+    double sin_q = odd ? cos_r : sin_r;
+    double cos_q = odd ? sin_r : cos_r;
+    s = (quadrant & 2) ? -sin_q : sin_q;
+    c = ((quadrant + 1) & 2) ? -cos_q : cos_q;
+}
+
+inline double fast_cos(double x)
+{
+    double s, c;
+    fast_sin_cos(x, s, c);
+    return c;
+}
+
+// Arc cosine, with `x` clamped to [-1, 1]. Abramowitz and Stegun 4.4.46: acos(x) is
+// sqrt(1 - x) times a degree 7 polynomial on [0, 1], and pi minus that for negative x.
+inline double fast_acos(double x)
+{
+    double a = std::fmin(std::fabs(x), 1.0);
+    double p = 1.5707963050 + a * (-0.2145988016 + a * (0.0889789874 + a * (-0.0501743046 +
+               a * (0.0308918810 + a * (-0.0170881256 + a * (0.0066700901 + a * -0.0012624911))))));
+    double r = std::sqrt(1 - a) * p;
+    return x < 0 ? fast_math_detail::pi - r : r;
+}
+
+inline double fast_atan2(double y, double x)
+{
+    using namespace fast_math_detail;
+    double ax = std::fabs(x), ay = std::fabs(y);
+    double big = std::fmax(ax, ay), small = std::fmin(ax, ay);
+    if (big == 0)
+        return 0;
+
+    // atan of t in [0, 1], shifted by pi/6 to |t| <= tan(pi/12) where its Taylor series
+    // converges fast; the first omitted term is below 2e-12.
+    // Selects rather than branches throughout, as in fast_sin_cos.
+    double t = small / big;
+    bool shifted = t > tan_twelfth_pi;
+    double shifted_t = (t * sqrt3 - 1) / (t + sqrt3);
+    t = shifted ? shifted_t : t;
+    double t2 = t * t;
+    double a = t + t * t2 * (-1.0 / 3 + t2 * (1.0 / 5 + t2 * (-1.0 / 7 + t2 * (1.0 / 9 + t2 * (-1.0 / 11 +
+               t2 * (1.0 / 13 + t2 * (-1.0 / 15 + t2 * (1.0 / 17))))))));
+    a += shifted ? sixth_pi : 0.0;
+
+    a = ay > ax ? half_pi - a : a;
+    a = x < 0 ? fast_math_detail::pi - a : a;
+    return y < 0 ? -a : a;
+}
+
+// Batch forms ------------------------------------------------------------------------------------
+
+template <int N>
+inline vfloat<N> abs(const vfloat<N> &a)
+{
+    return max(a, vfloat<N>(0.0f) - a);
+}
+
+template <int N>
+inline void fast_sin_cos(const vfloat<N> &x, vfloat<N> &s, vfloat<N> &c)
+{
+    using namespace fast_math_detail;
+    using vf = vfloat<N>;
+
+    vf q = floor(x * vf(float(two_over_pi)) + vf(0.5f));
+    // pi/2 in three parts, the first two exact in float for the quadrant counts of |x| <= 1e3.
+    vf r = x - q * vf(1.5703125f);
+    r = r - q * vf(4.83751296997070312500e-04f);
+    r = r - q * vf(7.54978995489188216e-08f);
+    vf r2 = r * r;
+
+    vf sin_r = r + r * r2 * (vf(-1.0f / 6) + r2 * (vf(1.0f / 120) + r2 * (vf(-1.0f / 5040) + r2 * vf(1.0f / 362880))));
+    vf cos_r = vf(1.0f) + r2 * (vf(-0.5f) + r2 * (vf(1.0f / 24) + r2 * (vf(-1.0f / 720) +
+               r2 * (vf(1.0f / 40320) + r2 * vf(-1.0f / 3628800)))));
+
+    // Quadrant q mod 4, as a float in {0, 1, 2, 3}.
+    vf quadrant = q - vf(4.0f) * floor(q * vf(0.25f));
+    vbool<N> odd = quadrant - vf(2.0f) * floor(quadrant * vf(0.5f)) > vf(0.5f);
+    vbool<N> negate_sin = quadrant > vf(1.5f);
+    vbool<N> negate_cos = (quadrant > vf(0.5f)) & (quadrant < vf(2.5f));
+
+    vf sin_q = select(odd, cos_r, sin_r);
+    vf cos_q = select(odd, sin_r, cos_r);
+    s = select(negate_sin, vf(0.0f) - sin_q, sin_q);
+    c = select(negate_cos, vf(0.0f) - cos_q, cos_q);
+}
+
+template <int N>
+inline vfloat<N> fast_acos(const vfloat<N> &x)
+{
+    using vf = vfloat<N>;
+    vf a = min(abs(x), vf(1.0f));
+    vf p = vf(1.5707963050f) + a * (vf(-0.2145988016f) + a * (vf(0.0889789874f) + a * (vf(-0.0501743046f) +
+           a * (vf(0.0308918810f) + a * (vf(-0.0170881256f) + a * (vf(0.0066700901f) + a * vf(-0.0012624911f)))))));
+    vf r = sqrt(vf(1.0f) - a) * p;
+    return select(x < vf(0.0f), vf(float(fast_math_detail::pi)) - r, r);
+}
+
+template <int N>
+inline vfloat<N> fast_atan2(const vfloat<N> &y, const vfloat<N> &x)
+{
+    using namespace fast_math_detail;
+    using vf = vfloat<N>;
+
+    vf ax = abs(x), ay = abs(y);
+    vf big = max(ax, ay), small = min(ax, ay);
+    vf t = select(big > vf(0.0f), small / big, vf(0.0f));
+    vbool<N> shifted = t > vf(float(tan_twelfth_pi));
+    t = select(shifted, (t * vf(float(sqrt3)) - vf(1.0f)) / (t + vf(float(sqrt3))), t);
+    vf t2 = t * t;
+    vf a = t + t * t2 * (vf(-1.0f / 3) + t2 * (vf(1.0f / 5) + t2 * (vf(-1.0f / 7) + t2 * vf(1.0f / 9))));
+    a = select(shifted, a + vf(float(sixth_pi)), a);
+
+    a = select(ay > ax, vf(float(half_pi)) - a, a);
+    a = select(x < vf(0.0f), vf(float(fast_math_detail::pi)) - a, a);
+    return select(y < vf(0.0f), vf(0.0f) - a, a);
+}
+
+// Natural log of lanes holding positive normal floats, through x = m 2^e with m in
+// [sqrt(1/2), sqrt(2)).
+template <int N>
+inline vfloat<N> fast_log(const vfloat<N> &x)
+{
+    using namespace fast_math_detail;
+    using vf = vfloat<N>;
+
+    vf e;
+    vf m = frexp(x, e);
+    vbool<N> low = m < vf(float(sqrt_half));
+    m = select(low, m + m, m);
+    e = select(low, e - vf(1.0f), e);
+
+    // log(m) = 2 atanh(s), s = (m - 1) / (m + 1), from its series in s (|s| <= 0.172).
+    vf s = (m - vf(1.0f)) / (m + vf(1.0f));
+    vf s2 = s * s;
+    vf log_m = vf(2.0f) * s * (vf(1.0f) + s2 * (vf(1.0f / 3) + s2 * (vf(1.0f / 5) + s2 * vf(1.0f / 7))));
+    return log_m + e * vf(float(ln2));
+}
+
+// The same over arrays of `n` floats, `simd_width` at a time.
+
+inline void fast_sin_cos(const float *x, float *s, float *c, size_t n)
+{
+    size_t i = 0;
+    for (; i + simd_width <= n; i += simd_width)
+    {
+        vfloat<simd_width> lane_s, lane_c;
+        fast_sin_cos(vfloat<simd_width>::load(x + i), lane_s, lane_c);
+        lane_s.store(s + i);
+        lane_c.store(c + i);
+    }
+    for (; i < n; i++)
+    {
+        double lane_s, lane_c;
+        fast_sin_cos(double(x[i]), lane_s, lane_c);
+        s[i] = float(lane_s);
+        c[i] = float(lane_c);
+    }
+}
+
+inline void fast_acos(const float *x, float *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + simd_width <= n; i += simd_width)
+        fast_acos(vfloat<simd_width>::load(x + i)).store(out + i);
+    for (; i < n; i++)
+        out[i] = float(fast_acos(double(x[i])));
+}
+
+inline void fast_atan2(const float *y, const float *x, float *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + simd_width <= n; i += simd_width)
+        fast_atan2(vfloat<simd_width>::load(y + i), vfloat<simd_width>::load(x + i)).store(out + i);
+    for (; i < n; i++)
+        out[i] = float(fast_atan2(double(y[i]), double(x[i])));
+}
+
+inline void fast_log(const float *x, float *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + simd_width <= n; i += simd_width)
+        fast_log(vfloat<simd_width>::load(x + i)).store(out + i);
+    for (; i < n; i++)
+        out[i] = std::log(x[i]);
+}
+
+#endif
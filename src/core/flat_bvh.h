@@ -0,0 +1,238 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.h"
+
+// Pointer-free BVH over the primitives of a single aggregate (a sphere set, a mesh). Unlike
+// `bvh_node`, which links `hittable` objects through shared_ptrs and virtual calls, nodes live
+// in one array in depth-first order and leaves refer to contiguous ranges of primitives, so
+// the owner can store its primitives in leaf order and test a whole leaf at once.
+class flat_bvh
+{
+public:
+    struct node
+    {
+        packed_aabb bounds;
+        uint32_t offset; // Leaf: first primitive slot. Interior: index of the right child.
+        uint16_t count;  // Number of primitives in a leaf, 0 for interior nodes.
+        uint16_t axis;   // Split axis of an interior node (the left child is the next node).
+    };
+
+    flat_bvh() {}
+
+    // `node_ptr` may point into `nodes`, which a move carries along but a copy would not.
+    flat_bvh(const flat_bvh &) = delete;
+    flat_bvh &operator=(const flat_bvh &) = delete;
+    flat_bvh(flat_bvh &&) = default;
+    flat_bvh &operator=(flat_bvh &&) = default;
+
+    // Builds the hierarchy over `bounds`, one box per primitive. Afterwards `order()[slot]` is
+    // the index of the primitive the owner should store at `slot`.
+    void build(const std::vector<aabb> &bounds, int max_leaf_size)
+    {
+        build(bounds, bounds, max_leaf_size);
+    }
+
+    // Builds a motion hierarchy from per-primitive bounds at shutter times 0 and 1. Nodes keep
+    // both boxes and traversal tests the box interpolated at the ray's time.
+    void build(const std::vector<aabb> &start_bounds, const std::vector<aabb> &end_bounds, int max_leaf_size)
+    {
+        nodes.clear();
+        node_end_bounds.clear();
+        prim_order.clear();
+        node_ptr = nullptr;
+        num_nodes = 0;
+        if (start_bounds.empty())
+            return;
+
+        std::vector<build_prim> prims(start_bounds.size());
+        for (size_t i = 0; i < start_bounds.size(); i++)
+        {
+            aabb b(start_bounds[i], end_bounds[i]);
+            prims[i].box = start_bounds[i];
+            prims[i].end_box = end_bounds[i];
+            prims[i].centroid = point3(0.5 * (b.x.min + b.x.max), 0.5 * (b.y.min + b.y.max),
+                                       0.5 * (b.z.min + b.z.max));
+            prims[i].index = uint32_t(i);
+        }
+
+        nodes.reserve(2 * start_bounds.size() / std::max(1, max_leaf_size) + 1);
+        build_recursive(prims, 0, prims.size(), std::max(1, max_leaf_size));
+
+        // Only keep the second set of boxes if something actually moves.
+        bool moving = false;
+        for (size_t i = 0; i < nodes.size() && !moving; i++)
+            moving = !(nodes[i].bounds == node_end_bounds[i]);
+        if (!moving)
+            std::vector<packed_aabb>().swap(node_end_bounds);
+
+        prim_order.resize(prims.size());
+        for (size_t i = 0; i < prims.size(); i++)
+            prim_order[i] = prims[i].index;
+
+        node_ptr = nodes.data();
+        num_nodes = nodes.size();
+    }
+
+    // Uses `count` previously built static nodes stored elsewhere (e.g. in a mapped cache
+    // file) without copying them. The memory must outlive this object.
+    void adopt(const node *external_nodes, size_t count)
+    {
+        nodes.clear();
+        node_end_bounds.clear();
+        prim_order.clear();
+        node_ptr = external_nodes;
+        num_nodes = count;
+    }
+
+    // The node array in depth-first order, for serialization. Only static hierarchies can be
+    // written out this way.
+    const node *node_data() const { return node_ptr; }
+    bool is_static() const { return node_end_bounds.empty(); }
+
+    const std::vector<uint32_t> &order() const { return prim_order; }
+
+    // Bounds over the whole shutter interval.
+    aabb bounds() const
+    {
+        if (num_nodes == 0)
+            return aabb::empty;
+        if (node_end_bounds.empty())
+            return node_ptr[0].bounds.to_aabb();
+        return aabb(node_ptr[0].bounds.to_aabb(), node_end_bounds[0].to_aabb());
+    }
+
+    aabb bounds_at(double time) const
+    {
+        if (num_nodes == 0)
+            return aabb::empty;
+        if (node_end_bounds.empty())
+            return node_ptr[0].bounds.to_aabb();
+        return node_ptr[0].bounds.lerp(node_end_bounds[0], time).to_aabb();
+    }
+
+    size_t node_count() const { return num_nodes; }
+
+    size_t memory_bytes() const
+    {
+        return nodes.capacity() * sizeof(node) + node_end_bounds.capacity() * sizeof(packed_aabb) +
+               prim_order.capacity() * sizeof(uint32_t);
+    }
+
+    // Visits leaves front to back. `leaf(first, count, ray_t)` tests primitives
+    // [first, first + count), returns whether it found a hit, and shrinks `ray_t.max` to the
+    // closest hit so far, which culls the rest of the traversal.
+    template <typename LeafFn>
+    bool traverse(const ray &r, interval ray_t, LeafFn &&leaf) const
+    {
+        if (num_nodes == 0)
+            return false;
+
+        uint32_t stack[64];
+        int stack_size = 0;
+        uint32_t current = 0;
+        bool hit_anything = false;
+        bool moving = !node_end_bounds.empty();
+
+        while (true)
+        {
+            const node &n = node_ptr[current];
+            bool hit_node = moving ? n.bounds.lerp(node_end_bounds[current], r.time()).hit(r, ray_t)
+                                   : n.bounds.hit(r, ray_t);
+            if (hit_node)
+            {
+                if (n.count > 0)
+                {
+                    if (leaf(n.offset, n.count, ray_t))
+                        hit_anything = true;
+                }
+                else
+                {
+                    // Descend into the child on the ray's near side first.
+                    if (r.direction()[n.axis] < 0)
+                    {
+                        stack[stack_size++] = current + 1;
+                        current = n.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = n.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+
+        return hit_anything;
+    }
+
+private:
+    struct build_prim
+    {
+        aabb box;     // Bounds at time 0
+        aabb end_box; // Bounds at time 1
+        point3 centroid;
+        uint32_t index;
+    };
+
+    std::vector<node> nodes;
+    std::vector<packed_aabb> node_end_bounds; // Per-node bounds at time 1, empty when static
+    std::vector<uint32_t> prim_order;
+    const node *node_ptr = nullptr;           // Nodes in use: `nodes` or adopted storage
+    size_t num_nodes = 0;
+
+    uint32_t build_recursive(std::vector<build_prim> &prims, size_t begin, size_t end, int max_leaf_size)
+    {
+        uint32_t node_index = uint32_t(nodes.size());
+        nodes.emplace_back();
+        node_end_bounds.emplace_back();
+
+        aabb box = aabb::empty;
+        aabb end_box = aabb::empty;
+        aabb centroid_box = aabb::empty;
+        for (size_t i = begin; i < end; i++)
+        {
+            box = aabb(box, prims[i].box);
+            end_box = aabb(end_box, prims[i].end_box);
+            centroid_box = aabb(centroid_box, aabb(prims[i].centroid, prims[i].centroid));
+        }
+
+        size_t span = end - begin;
+        node_end_bounds[node_index] = packed_aabb(end_box);
+        if (span <= size_t(max_leaf_size))
+        {
+            nodes[node_index].bounds = packed_aabb(box);
+            nodes[node_index].offset = uint32_t(begin);
+            nodes[node_index].count = uint16_t(span);
+            nodes[node_index].axis = 0;
+            return node_index;
+        }
+
+        // Median split along the widest axis of the centroids.
+        int axis = centroid_box.longest_axis();
+        size_t mid = begin + span / 2;
+        std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                         [axis](const build_prim &a, const build_prim &b)
+                         { return a.centroid[axis] < b.centroid[axis]; });
+
+        build_recursive(prims, begin, mid, max_leaf_size);
+        uint32_t right = build_recursive(prims, mid, end, max_leaf_size);
+
+        nodes[node_index].bounds = packed_aabb(box);
+        nodes[node_index].offset = right;
+        nodes[node_index].count = 0;
+        nodes[node_index].axis = uint16_t(axis);
+        return node_index;
+    }
+};
+
+#endif
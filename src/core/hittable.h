@@ -2,20 +2,37 @@
 #define HITTABLE_H
 
 #include "aabb.h"
+#include "material_table.h"
+#include "transform.h"
 
 class material;
+class hittable;
 
 class hit_record
 {
 public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    material_id mat = material_table::none;
     double t;
     double u;
     double v;
     bool front_face;
 
+    // Texture filtering. Primitives set `uv_density`, the change in (u, v) per unit of
+    // distance along the surface (0 when unknown); the camera turns it into `uv_footprint`,
+    // the width in texture units of the ray cone where it hits.
+    double uv_density = 0;
+    double uv_footprint = 0;
+
+    // Traversal-phase state. Primitives that defer their surface evaluation only write `t`,
+    // `prim`, `prim_id` and the barycentrics `b0`/`b1` while the closest hit is being searched
+    // for; `resolve_surface()` then fills in the rest once for the final hit.
+    const hittable *prim = nullptr;
+    int prim_id = 0;
+    double b0 = 0;
+    double b1 = 0;
+
     void set_face_normal(const ray &r, const vec3 &outward_normal)
     {
         // Sets the hit record normal vector.
@@ -35,6 +52,16 @@ public:
 
     virtual aabb bounding_box() const = 0;
 
+    // Bounds at a given shutter time in [0,1]. Moving objects override this so a BVH can
+    // store boxes at the shutter's time keys and interpolate between them, instead of testing
+    // the box swept over the whole interval. Bounds at intermediate times must lie within the
+    // linear interpolation of the bounds at 0 and 1, which holds for linear motion.
+    virtual aabb bounding_box_at(double time) const { return bounding_box(); }
+
+    // Second intersection phase: computes p, normal, UVs and material for a hit whose
+    // traversal phase recorded this object in `rec.prim`. Only called for the closest hit.
+    virtual void surface(const ray &r, hit_record &rec) const {}
+
     virtual double pdf_value(const point3& origin, const vec3& direction) const {
         return 0.0;
     }
@@ -42,8 +69,29 @@ public:
     virtual vec3 random(const point3& origin) const {
         return vec3(1,0,0);
     }
+
+    // What a light sampler weighs a light by: the area of its surface and the material on it.
+    // 0 and `material_table::none` for objects that don't say.
+    virtual double surface_area() const { return 0; }
+    virtual material_id surface_material() const { return material_table::none; }
+
+    // A copy of this object with `to_world` applied to its geometry, or null if the object
+    // can't bake the transform exactly. Small primitives implement this so a scene commit can
+    // drop their `translate`/`rotate_y` wrappers.
+    virtual shared_ptr<hittable> transformed_copy(const rigid_transform &to_world) const { return nullptr; }
 };
 
+inline void resolve_surface(const ray &r, hit_record &rec)
+{
+    // Completes a (possibly deferred) hit. Hittables that evaluate eagerly leave `rec.prim`
+    // empty, so this is a no-op for them.
+    if (rec.prim)
+    {
+        rec.prim->surface(r, rec);
+        rec.prim = nullptr;
+    }
+}
+
 class translate : public hittable
 {
 public:
@@ -60,6 +108,8 @@ public:
         if(!object->hit(offset_r, ray_t, rec))
             return false;
 
+        // The child's surface has to be evaluated in its own space, so resolve it here.
+        resolve_surface(offset_r, rec);
         rec.p += offset;
 
         return true;
@@ -67,6 +117,11 @@ public:
 
     aabb bounding_box() const override { return bbox; } 
 
+    aabb bounding_box_at(double time) const override { return object->bounding_box_at(time) + offset; }
+
+    const shared_ptr<hittable> &child() const { return object; }
+    rigid_transform to_world() const { return rigid_transform::translation(offset); }
+
 private:
     shared_ptr<hittable> object;
     vec3 offset;
@@ -82,32 +137,7 @@ public:
         auto radians = degrees_to_radians(angle);
         sin_theta = std::sin(radians);
         cos_theta = std::cos(radians);
-        bbox = object->bounding_box();
-
-        point3 min( infinity,  infinity,  infinity);
-        point3 max(-infinity, -infinity, -infinity);
-
-        for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
-
-                    auto newx =  cos_theta*x + sin_theta*z;
-                    auto newz = -sin_theta*x + cos_theta*z;
-
-                    vec3 tester(newx, y, newz);
-
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = std::fmin(min[c], tester[c]);
-                        max[c] = std::fmax(max[c], tester[c]);
-                    }
-                }
-            }
-        }
-
-        bbox = aabb(min, max);
+        bbox = rotated_bounds(object->bounding_box());
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override
@@ -130,6 +160,8 @@ public:
         if (!object->hit(rotated_r, ray_t, rec))
             return false;
 
+        resolve_surface(rotated_r, rec);
+
         // Transform the intersection from object space back to world space.
         rec.p = point3(
             (cos_theta * rec.p.x()) + (sin_theta * rec.p.z()),
@@ -148,11 +180,99 @@ public:
 
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(double time) const override { return rotated_bounds(object->bounding_box_at(time)); }
+
+    const shared_ptr<hittable> &child() const { return object; }
+    rigid_transform to_world() const { return rigid_transform::rotation_y(sin_theta, cos_theta); }
+
 private:
     shared_ptr<hittable> object;
     double sin_theta;
     double cos_theta;
     aabb bbox;
+    // Bounds of `box` after rotating it about the Y axis.
+    aabb rotated_bounds(const aabb &box) const
+    {
+        point3 min( infinity,  infinity,  infinity);
+        point3 max(-infinity, -infinity, -infinity);
+
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                for (int k = 0; k < 2; k++) {
+                    auto x = i*box.x.max + (1-i)*box.x.min;
+                    auto y = j*box.y.max + (1-j)*box.y.min;
+                    auto z = k*box.z.max + (1-k)*box.z.min;
+
+                    auto newx =  cos_theta*x + sin_theta*z;
+                    auto newz = -sin_theta*x + cos_theta*z;
+
+                    vec3 tester(newx, y, newz);
+
+                    for (int c = 0; c < 3; c++) {
+                        min[c] = std::fmin(min[c], tester[c]);
+                        max[c] = std::fmax(max[c], tester[c]);
+                    }
+                }
+            }
+        }
+
+        return aabb(min, max);
+    }
+};
+
+// An object under a general rigid transform. A scene commit replaces each chain of
+// `translate` and `rotate_y` wrappers around an object it can't bake with one of these, so a
+// ray is transformed once instead of once per wrapper.
+class transformed : public hittable
+{
+public:
+    transformed(shared_ptr<hittable> object, const rigid_transform &to_world)
+        : object(object), xf(to_world)
+    {
+        bbox = xf.bounds(object->bounding_box());
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        ray local_r(xf.inverse_point(r.origin()), xf.inverse_vector(r.direction()), r.time());
+
+        if (!object->hit(local_r, ray_t, rec))
+            return false;
+
+        resolve_surface(local_r, rec);
+        rec.p = xf.point(rec.p);
+        rec.normal = xf.vector(rec.normal);
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb bounding_box_at(double time) const override { return xf.bounds(object->bounding_box_at(time)); }
+
+    // A rigid transform preserves distances and angles, so densities carry over unchanged.
+    double pdf_value(const point3 &origin, const vec3 &direction) const override
+    {
+        return object->pdf_value(xf.inverse_point(origin), xf.inverse_vector(direction));
+    }
+
+    vec3 random(const point3 &origin) const override { return xf.vector(object->random(xf.inverse_point(origin))); }
+
+    double surface_area() const override { return object->surface_area(); }
+    material_id surface_material() const override { return object->surface_material(); }
+
+    shared_ptr<hittable> transformed_copy(const rigid_transform &to_world) const override
+    {
+        return make_shared<transformed>(object, to_world * xf);
+    }
+
+    const shared_ptr<hittable> &child() const { return object; }
+    const rigid_transform &to_world() const { return xf; }
+
+private:
+    shared_ptr<hittable> object;
+    rigid_transform xf;
+    aabb bbox;
 };
 
 #endif
\ No newline at end of file
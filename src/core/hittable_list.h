@@ -24,17 +24,17 @@ public:
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        hit_record temp_rec;
+        // Objects only write to the record when they find a hit closer than the current
+        // interval allows, so the record can be filled in place without a temporary copy.
         bool hit_anything = false;
         double closest_so_far = ray_t.max;
 
         for (const auto &object : objects)
         {
-            if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec))
+            if (object->hit(r, interval(ray_t.min, closest_so_far), rec))
             {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                closest_so_far = rec.t;
             }
         }
 
@@ -43,8 +43,19 @@ public:
 
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(double time) const override
+    {
+        aabb box = aabb::empty;
+        for (const auto &object : objects)
+            box = aabb(box, object->bounding_box_at(time));
+        return box;
+    }
+
     double pdf_value(const point3& origin, const vec3& direction) const override
     {
+        if (objects.empty())
+            return 0.0;
+
         auto weight = 1.0 / objects.size();
         auto sum = 0.0;
 
@@ -55,6 +66,9 @@ public:
     }
 
     vec3 random(const point3& origin) const override {
+        if (objects.empty())
+            return vec3(1, 0, 0);
+
         auto int_size = int(objects.size());
         return objects[random_int(0, int_size-1)]->random(origin);
     }
@@ -0,0 +1,258 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "rtweekend.h"
+#include "alias_table.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+
+// How a light_sampler picks the light to sample.
+enum class light_selection
+{
+    uniform, // Every light equally often, like a hittable_list
+    power,   // In proportion to emitted power, from an alias table
+    tree,    // By estimated contribution at the shading point, down a light BVH
+};
+
+// A scene's lights as a single hittable for light sampling. random() picks one light and
+// samples a direction toward it; pdf_value() sums, over the lights a direction passes through,
+// the chance of picking that light times its own density.
+//
+// The lights sit in a BVH in every mode, so pdf_value() only visits the lights along the
+// direction rather than all of them. In `tree` mode each node also holds the power of the
+// lights below it, and a pick walks down from the root taking each child in proportion to
+// power / distance^2 from the shading point (with the distance clamped to the node's radius,
+// and light orientation ignored); the chance of having picked a given light is recomputed by
+// walking up from its leaf. Picks and lookups cost O(log n) in every mode.
+//
+// A light's power is its area times the luminance of its material's average emission. Lights
+// that don't report one (such as scene-file `sample` shapes with material `none`) are given the
+// mean power of the others. If no light reports one there is nothing to weigh them by, and they
+// are picked uniformly whatever the mode, as a hittable_list would.
+class light_sampler : public hittable
+{
+public:
+    light_sampler() {}
+
+    light_sampler(const hittable_list &list, light_selection selection = light_selection::tree)
+        : mode(selection), lights(list.objects)
+    {
+        if (lights.empty())
+            return;
+
+        std::vector<double> power(lights.size());
+        double known_total = 0;
+        size_t known = 0;
+        for (size_t i = 0; i < lights.size(); i++)
+        {
+            power[i] = emitted_power(*lights[i]);
+            if (power[i] > 0)
+            {
+                known_total += power[i];
+                known++;
+            }
+        }
+        if (known == 0)
+            mode = light_selection::uniform;
+        double fallback = known > 0 ? known_total / known : 1.0;
+        for (auto &p : power)
+            if (!(p > 0))
+                p = fallback;
+
+        by_power = alias_table(power);
+
+        std::vector<uint32_t> order(lights.size());
+        std::iota(order.begin(), order.end(), 0);
+        leaf_of.resize(lights.size());
+        nodes.reserve(2 * lights.size());
+        build(order, 0, order.size(), -1, power);
+        bbox = nodes[0].box;
+    }
+
+    size_t size() const { return lights.size(); }
+    light_selection selection() const { return mode; }
+
+    // Lights are only sampled through this object, never intersected.
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override { return false; }
+
+    aabb bounding_box() const override { return bbox; }
+
+    double pdf_value(const point3 &origin, const vec3 &direction) const override
+    {
+        if (nodes.empty())
+            return 0.0;
+
+        ray r(origin, direction);
+        interval ray_t(0.001, infinity);
+        double pdf = 0;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const node &n = nodes[stack[--top]];
+            if (!n.box.hit(r, ray_t))
+                continue;
+            if (n.left < 0)
+            {
+                double light_pdf = lights[n.light]->pdf_value(origin, direction);
+                if (light_pdf > 0)
+                    pdf += probability(n.light, origin) * light_pdf;
+            }
+            else
+            {
+                stack[top++] = n.left;
+                stack[top++] = n.right;
+            }
+        }
+        return pdf;
+    }
+
+    vec3 random(const point3 &origin) const override
+    {
+        if (lights.empty())
+            return vec3(1, 0, 0);
+        return lights[pick(origin)]->random(origin);
+    }
+
+    // Chance that random(origin) samples light `i`.
+    double probability(size_t i, const point3 &origin) const
+    {
+        switch (mode)
+        {
+        case light_selection::uniform:
+            return 1.0 / lights.size();
+        case light_selection::power:
+            return by_power.probability(i);
+        default:
+            break;
+        }
+
+        double p = 1;
+        for (int child = leaf_of[i], parent = nodes[child].parent; parent >= 0;
+             child = parent, parent = nodes[child].parent)
+        {
+            const node &n = nodes[parent];
+            double left = importance(nodes[n.left], origin);
+            double right = importance(nodes[n.right], origin);
+            double p_left = left + right > 0 ? left / (left + right) : 0.5;
+            p *= child == n.left ? p_left : 1 - p_left;
+        }
+        return p;
+    }
+
+private:
+    struct node
+    {
+        aabb box;
+        point3 center;
+        double radius_squared; // Of the sphere around `box`
+        double power;          // Of all the lights below
+        int left = -1, right = -1; // Children, or -1 for a leaf
+        int parent = -1;
+        uint32_t light = 0;    // For a leaf
+    };
+
+    light_selection mode = light_selection::tree;
+    std::vector<shared_ptr<hittable>> lights;
+    alias_table by_power;
+    std::vector<node> nodes;   // Root first
+    std::vector<int> leaf_of;  // Leaf node of each light
+    aabb bbox = aabb::empty;
+
+    static double emitted_power(const hittable &light)
+    {
+        const material *mat = material_table::global().get(light.surface_material());
+        if (!mat)
+            return 0;
+        color e = mat->average_emission();
+        double luminance = 0.2126 * e.x() + 0.7152 * e.y() + 0.0722 * e.z();
+        return light.surface_area() * luminance;
+    }
+
+    size_t pick(const point3 &origin) const
+    {
+        switch (mode)
+        {
+        case light_selection::uniform:
+            return std::min(size_t(random_double() * lights.size()), lights.size() - 1);
+        case light_selection::power:
+            return by_power.sample();
+        default:
+            break;
+        }
+
+        int i = 0;
+        while (nodes[i].left >= 0)
+        {
+            const node &n = nodes[i];
+            double left = importance(nodes[n.left], origin);
+            double right = importance(nodes[n.right], origin);
+            double p_left = left + right > 0 ? left / (left + right) : 0.5;
+            i = random_double() < p_left ? n.left : n.right;
+        }
+        return nodes[i].light;
+    }
+
+    static double importance(const node &n, const point3 &origin)
+    {
+        double distance_squared = (n.center - origin).length_squared();
+        return n.power / std::max(distance_squared, n.radius_squared);
+    }
+
+    // Builds the subtree over order[begin, end), splitting at the median centroid along the
+    // longest axis of the centroids' bounds, and returns its node index.
+    int build(std::vector<uint32_t> &order, size_t begin, size_t end, int parent, const std::vector<double> &power)
+    {
+        int index = int(nodes.size());
+        nodes.emplace_back();
+        nodes[index].parent = parent;
+
+        if (end - begin == 1)
+        {
+            uint32_t light = order[begin];
+            nodes[index].box = lights[light]->bounding_box();
+            nodes[index].power = power[light];
+            nodes[index].light = light;
+            leaf_of[light] = index;
+        }
+        else
+        {
+            auto centroid = [&](uint32_t light)
+            {
+                const aabb &b = lights[light]->bounding_box();
+                return point3(b.x.min + b.x.max, b.y.min + b.y.max, b.z.min + b.z.max) / 2;
+            };
+            aabb centroids = aabb::empty;
+            for (size_t i = begin; i < end; i++)
+                centroids = aabb(centroids, aabb(centroid(order[i]), centroid(order[i])));
+            int axis = centroids.longest_axis();
+
+            size_t mid = begin + (end - begin) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                             [&](uint32_t a, uint32_t b) { return centroid(a)[axis] < centroid(b)[axis]; });
+
+            int left = build(order, begin, mid, index, power);
+            int right = build(order, mid, end, index, power);
+            nodes[index].left = left;
+            nodes[index].right = right;
+            nodes[index].box = aabb(nodes[left].box, nodes[right].box);
+            nodes[index].power = nodes[left].power + nodes[right].power;
+        }
+
+        const aabb &b = nodes[index].box;
+        vec3 half_diagonal(b.x.size() / 2, b.y.size() / 2, b.z.size() / 2);
+        nodes[index].center = point3(b.x.min, b.y.min, b.z.min) + half_diagonal;
+        nodes[index].radius_squared = half_diagonal.length_squared();
+        return index;
+    }
+};
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fstream>
+#include <mutex>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. On POSIX systems the file is memory-mapped, so opening a
+// multi-gigabyte asset costs no copy and pages are faulted in as they are touched; elsewhere
+// the file is read into a buffer.
+class mapped_file
+{
+public:
+    // How the mapping will be read, passed on to the kernel's readahead.
+    enum class access
+    {
+        sequential, // Front to back, once (text and image files being parsed)
+        random,     // In no particular order (BVHs and the arrays they index)
+    };
+
+    mapped_file() {}
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    mapped_file(mapped_file &&other) noexcept { *this = std::move(other); }
+
+    mapped_file &operator=(mapped_file &&other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            bytes = std::exchange(other.bytes, nullptr);
+            length = std::exchange(other.length, 0);
+            buffer = std::move(other.buffer);
+        }
+        return *this;
+    }
+
+    ~mapped_file() { close(); }
+
+    // Maps `path`. Returns false if the file cannot be opened; an empty file opens with
+    // size() == 0.
+    bool open(const std::string &path, access pattern = access::sequential)
+    {
+        close();
+#if defined(_WIN32)
+        (void)pattern;
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open())
+            return false;
+        buffer.resize(size_t(file.tellg()));
+        file.seekg(0);
+        file.read(buffer.data(), std::streamsize(buffer.size()));
+        bytes = buffer.data();
+        length = buffer.size();
+        return bool(file);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        length = size_t(info.st_size);
+        if (length > 0)
+        {
+            void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            bytes = static_cast<const char *>(mapping);
+            madvise(mapping, length, pattern == access::random ? MADV_RANDOM : MADV_SEQUENTIAL);
+        }
+
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+        return true;
+#endif
+    }
+
+    void close()
+    {
+#if !defined(_WIN32)
+        if (bytes && buffer.empty())
+            munmap(const_cast<char *>(bytes), length);
+#endif
+        buffer.clear();
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const char *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+    std::vector<char> buffer; // Backing storage when the file was read instead of mapped
+};
+
+// A file read at explicit offsets, which any number of threads may do at once: with pread() on
+// POSIX systems, and elsewhere through one stream behind a lock.
+class random_access_file
+{
+public:
+    random_access_file() {}
+
+    random_access_file(const random_access_file &) = delete;
+    random_access_file &operator=(const random_access_file &) = delete;
+
+    ~random_access_file() { close(); }
+
+    bool open(const std::string &path)
+    {
+        close();
+#if defined(_WIN32)
+        stream.open(path, std::ios::binary);
+        return stream.is_open();
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        return fd >= 0;
+#endif
+    }
+
+    void close()
+    {
+#if defined(_WIN32)
+        stream.close();
+#else
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+    }
+
+    // Reads `bytes` bytes at `offset` into `out`; false if the file has fewer.
+    bool read(uint64_t offset, void *out, size_t bytes) const
+    {
+#if defined(_WIN32)
+        std::lock_guard<std::mutex> lock(mutex);
+        stream.clear();
+        stream.seekg(std::streamoff(offset));
+        stream.read(static_cast<char *>(out), std::streamsize(bytes));
+        return bool(stream);
+#else
+        auto *p = static_cast<char *>(out);
+        while (bytes > 0)
+        {
+            ssize_t n = pread(fd, p, bytes, off_t(offset));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            offset += uint64_t(n);
+            bytes -= size_t(n);
+        }
+        return true;
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    mutable std::ifstream stream;
+    mutable std::mutex mutex;
+#else
+    int fd = -1;
+#endif
+};
+
+// Size and modification time of `path`, as recorded by derived caches (e.g. `.rtmesh` files)
+// to notice when their source changed.
+inline bool file_stamp(const std::string &path, uint64_t &bytes, int64_t &mtime)
+{
+    std::error_code error;
+    bytes = std::filesystem::file_size(path, error);
+    if (error)
+        return false;
+    mtime = int64_t(std::filesystem::last_write_time(path, error).time_since_epoch().count());
+    return !error;
+}
+
+#endif
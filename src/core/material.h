@@ -7,14 +7,44 @@
 #include "hittable.h"
 #include "pdf.h"
 #include "texture.h"
+#include "texture_program.h"
 #include "onb.h"
 
-class scatter_record {
-  public:
-    color attenuation;
-    shared_ptr<pdf> pdf_ptr;
-    bool skip_pdf;
-    ray skip_pdf_ray;
+// Kinds of scattering, as bit flags.
+enum bsdf_lobe : int
+{
+    lobe_diffuse = 1,  // Spread over the sphere or hemisphere; worth mixing light samples into
+    lobe_glossy = 2,   // Concentrated around a direction
+    lobe_specular = 4, // A single direction; its pdf is a delta and isn't evaluated
+};
+
+// The local frame of a hit, built once and shared by every BSDF call there: an orthonormal
+// basis whose w axis is the shading normal, and the direction back toward the viewer.
+class shading_frame
+{
+public:
+    shading_frame(const ray &r_in, const hit_record &rec)
+        : basis(rec.normal), to_viewer(unit_vector(-r_in.direction())), wi(basis.local(to_viewer)), time(r_in.time())
+    {}
+
+    vec3 local(const vec3 &world) const { return basis.local(world); }
+    vec3 world(const vec3 &local) const { return basis.world(local); }
+    const vec3 &normal() const { return basis.w(); }
+
+    onb basis;
+    vec3 to_viewer; // Unit, world space
+    vec3 wi;        // `to_viewer` in the local frame
+    double time;
+};
+
+// A direction chosen by a material, with what it carries.
+class bsdf_sample
+{
+public:
+    vec3 direction; // World space
+    color value;    // Multiplies the radiance arriving from `direction`, before dividing by `pdf`
+    double pdf = 0; // Solid angle density of having sampled `direction`; unused for specular lobes
+    int lobe = 0;   // The bsdf_lobe it came from
 };
 
 class material
@@ -26,58 +56,55 @@ public:
         return color(0,0,0);
     }
 
-    virtual bool scatter(
-        const ray &r_in, const hit_record &rec, scatter_record& srec) const
-    {
-        return false;
-    }
+    // Mean radiance emitted from a surface with this material, for weighting lights by power.
+    virtual color average_emission() const { return color(0, 0, 0); }
 
-    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
-    {
-        return 0;
-    }
+    // The bsdf_lobe flags sample() can return; 0 for a material that only absorbs (or emits).
+    virtual int lobes() const { return 0; }
 
-    virtual color eval_brdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+    // Picks a direction to continue in and fills in everything about it, or returns false to
+    // end the path.
+    virtual bool sample(const hit_record &rec, const shading_frame &frame, bsdf_sample &s) const
     {
-        // Default implementation for backward compatibility
-        // Returns attenuation * scattering_pdf for simple materials
-        scatter_record srec;
-        if (scatter(r_in, rec, srec)) {
-            return srec.attenuation * scattering_pdf(r_in, rec, scattered);
-        }
-        return color(0, 0, 0);
+        return false;
     }
 
-    virtual bool use_light_sampling() const
+    // The value and pdf that sample() would give `direction`, for a direction chosen some other
+    // way, such as toward a light. Specular lobes contribute nothing here.
+    virtual color eval(const hit_record &rec, const shading_frame &frame, const vec3 &direction, double &pdf) const
     {
-        // Return true to use mixture PDF (light + material), false to use only material PDF
-        return true;
+        pdf = 0;
+        return color(0, 0, 0);
     }
 };
 
 class lambertian : public material
 {
 public:
-    lambertian(const color &albedo) : tex(make_shared<solid_color>(albedo)) {}
-    lambertian(shared_ptr<texture> tex) : tex(tex) {}
+    lambertian(const color &albedo) : tex(albedo) {}
+    lambertian(shared_ptr<texture> tex) : tex(std::move(tex)) {}
+
+    int lobes() const override { return lobe_diffuse; }
 
-    bool scatter(const ray &r_in, const hit_record &rec, scatter_record& srec)
-        const override
+    bool sample(const hit_record &rec, const shading_frame &frame, bsdf_sample &s) const override
     {
-        srec.attenuation = tex->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
-        srec.skip_pdf = false;
+        vec3 local = random_cos_direction();
+        s.direction = frame.world(local);
+        s.pdf = local.z() / pi;
+        s.value = tex.evaluate(rec.u, rec.v, rec.uv_footprint, rec.p) * s.pdf;
+        s.lobe = lobe_diffuse;
         return true;
     }
 
-    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+    color eval(const hit_record &rec, const shading_frame &frame, const vec3 &direction, double &pdf) const override
     {
-        auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
-        return cos_theta < 0 ? 0 : cos_theta/pi;
+        auto cos_theta = dot(frame.normal(), unit_vector(direction));
+        pdf = cos_theta < 0 ? 0 : cos_theta / pi;
+        return tex.evaluate(rec.u, rec.v, rec.uv_footprint, rec.p) * pdf;
     }
 
 private:
-    shared_ptr<texture> tex;
+    texture_program tex;
 };
 
 class metal : public material
@@ -85,17 +112,14 @@ class metal : public material
 public:
     metal(const color &albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
-    bool scatter(const ray &r_in, const hit_record &rec, scatter_record& srec)
-        const override
-    {
-        vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-
-        srec.attenuation = albedo;
-        srec.pdf_ptr = nullptr;
-        srec.skip_pdf = true;
-        srec.skip_pdf_ray = ray(rec.p, reflected, r_in.time());
+    int lobes() const override { return lobe_specular; }
 
+    bool sample(const hit_record &rec, const shading_frame &frame, bsdf_sample &s) const override
+    {
+        vec3 reflected = reflect(-frame.to_viewer, rec.normal);
+        s.direction = reflected + (fuzz * random_unit_vector());
+        s.value = albedo;
+        s.lobe = lobe_specular;
         return true;
     }
 
@@ -109,15 +133,15 @@ class dielectric : public material
 public:
     dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
-    bool scatter(const ray &r_in, const hit_record &rec, scatter_record& srec)
-        const override
+    int lobes() const override { return lobe_specular; }
+
+    bool sample(const hit_record &rec, const shading_frame &frame, bsdf_sample &s) const override
     {
-        srec.attenuation = color(1.0, 1.0, 1.0);
-        srec.pdf_ptr = nullptr;
-        srec.skip_pdf = true;
+        s.value = color(1.0, 1.0, 1.0);
+        s.lobe = lobe_specular;
         double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
 
-        vec3 unit_direction = unit_vector(r_in.direction());
+        vec3 unit_direction = -frame.to_viewer;
         double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
         double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
 
@@ -129,7 +153,7 @@ public:
         else
             direction = refract(unit_direction, rec.normal, ri);
 
-        srec.skip_pdf_ray = ray(rec.p, direction, r_in.time());
+        s.direction = direction;
         return true;
     }
 
@@ -143,7 +167,7 @@ private:
         // Use Schlick's approximation for reflectance.
         auto r0 = (1 - refraction_index) / (1 + refraction_index);
         r0 = r0 * r0;
-        return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+        return r0 + (1 - r0) * pow5(1 - cosine);
     }
 };
 
@@ -153,25 +177,32 @@ public:
     iridescent(std::shared_ptr<material> base, double strength)
         : base(base), strength(strength) {}
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override
+    int lobes() const override { return base->lobes(); }
+
+    // The film tints whatever the base material scatters.
+    bool sample(const hit_record &rec, const shading_frame &frame, bsdf_sample &s) const override
     {
-        if (!base->scatter(r_in, rec, srec)) return false;
-        
-        color base_atten = srec.attenuation;
-        
-        vec3 view_dir = unit_vector(-r_in.direction());
-        double cos_theta = dot(view_dir, rec.normal);
-
-        color iri = iridescent_color(cos_theta);
-        srec.attenuation = (1.0 - strength) * base_atten + strength * iri;
+        if (!base->sample(rec, frame, s)) return false;
+        s.value = s.value * tint(frame);
         return true;
     }
-    
+
+    color eval(const hit_record &rec, const shading_frame &frame, const vec3 &direction, double &pdf) const override
+    {
+        return base->eval(rec, frame, direction, pdf) * tint(frame);
+    }
+
 
 private:
     std::shared_ptr<material> base;
     double strength;
 
+    color tint(const shading_frame &frame) const
+    {
+        double cos_theta = dot(frame.to_viewer, frame.normal());
+        return (1.0 - strength) * color(1, 1, 1) + strength * iridescent_color(cos_theta);
+    }
+
     color iridescent_color(double cos_theta) const
     {
         double x = 1 - cos_theta;
@@ -183,9 +214,14 @@ private:
         double fg = 1.3;
         double fb = 1.7;
 
-        double R = 0.5 * (1.0 + cos(fr * phase));
-        double G = 0.5 * (1.0 + cos(fg * phase));
-        double B = 0.5 * (1.0 + cos(fb * phase));
+        // The three cosines in one batch; float precision is plenty for a tint.
+        float phases[4] = {float(fr * phase), float(fg * phase), float(fb * phase), 0.0f};
+        vfloat<4> sines, cosines;
+        fast_sin_cos(vfloat<4>::load(phases), sines, cosines);
+
+        double R = 0.5 * (1.0 + cosines[0]);
+        double G = 0.5 * (1.0 + cosines[1]);
+        double B = 0.5 * (1.0 + cosines[2]);
 
         return color(R,G,B);
     }
@@ -194,41 +230,46 @@ private:
 class diffuse_light : public material
 {
 public:
-    diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
-    diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {};
+    diffuse_light(shared_ptr<texture> tex) : tex(std::move(tex)) {}
+    diffuse_light(const color& emit) : tex(emit) {};
 
     color emitted(const ray& r_in, const hit_record& rec, double u, double v, const point3& p)
     const override {
         if (!rec.front_face)
             return color(0,0,0);
-        return tex->value(u, v, p);
+        return tex.evaluate(u, v, rec.uv_footprint, p);
     }
 
+    color average_emission() const override { return tex.average(); }
+
 private:
-    shared_ptr<texture> tex;
+    texture_program tex;
 };
 
 class isotropic : public material
 {
 public:
-    isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    isotropic(shared_ptr<texture> tex) : tex(tex) {}
+    isotropic(const color& albedo) : tex(albedo) {}
+    isotropic(shared_ptr<texture> tex) : tex(std::move(tex)) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override
+    int lobes() const override { return lobe_diffuse; }
+
+    bool sample(const hit_record &rec, const shading_frame &frame, bsdf_sample &s) const override
     {
-        srec.attenuation = tex->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<sphere_pdf>();
-        srec.skip_pdf = false;
+        s.direction = random_unit_vector();
+        s.value = eval(rec, frame, s.direction, s.pdf);
+        s.lobe = lobe_diffuse;
         return true;
     }
 
-    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
-    const override {
-        return 1 / (4 * pi);
+    color eval(const hit_record &rec, const shading_frame &frame, const vec3 &direction, double &pdf) const override
+    {
+        pdf = 1 / (4 * pi);
+        return tex.evaluate(rec.u, rec.v, rec.uv_footprint, rec.p) * pdf;
     }
 
 private:
-    shared_ptr<texture> tex;
+    texture_program tex;
 };
 
 class glossy : public material
@@ -240,34 +281,24 @@ public:
         alpha = roughness * roughness;
     }
 
-    bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) 
-        const override
-    {
-        srec.pdf_ptr = make_shared<ggx_pdf>(rec.normal, r_in.direction(), alpha, alpha);
-        srec.skip_pdf = false;
-        srec.attenuation = color(1.0,1.0,1.0);
-        return true;
-    }
+    int lobes() const override { return lobe_glossy; }
 
-    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+    bool sample(const hit_record &rec, const shading_frame &frame, bsdf_sample &s) const override
     {
-        auto pdf = make_shared<ggx_pdf>(rec.normal, r_in.direction(), alpha, alpha);
-        return pdf->value(scattered.direction());
-    }
-
-    bool use_light_sampling() const override
-    {
-        // Glossy materials use only BRDF importance sampling, not light sampling
-        return false;
+        ggx_pdf distribution(frame.wi, alpha, alpha);
+        vec3 wo = distribution.generate();
+        s.direction = frame.world(wo);
+        s.pdf = distribution.value(wo);
+        s.value = eval_brdf_impl(frame.wi, wo);
+        s.lobe = lobe_glossy;
+        return true;
     }
 
-    color eval_brdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+    color eval(const hit_record &rec, const shading_frame &frame, const vec3 &direction, double &pdf) const override
     {
-        vec3 wi = unit_vector(-r_in.direction());  // Incoming direction (pointing away from surface)
-        vec3 wo = unit_vector(scattered.direction());  // Outgoing direction
-        vec3 n = rec.normal;
-        
-        return eval_brdf_impl(wi, wo, n);
+        vec3 wo = frame.local(unit_vector(direction));
+        pdf = ggx_pdf(frame.wi, alpha, alpha).value(wo);
+        return eval_brdf_impl(frame.wi, wo);
     }
 
 private:
@@ -281,21 +312,20 @@ private:
         // Use Schlick's approximation for reflectance.
         auto r0 = (1 - refraction_index) / (1 + refraction_index);
         r0 = r0 * r0;
-        return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+        return r0 + (1 - r0) * pow5(1 - cosine);
     }
 
     // Fresnel-Schlick approximation
     color fresnel_schlick(double cos_theta, const color& F0) const
     {
-        return F0 + (color(1.0, 1.0, 1.0) - F0) * std::pow(1.0 - cos_theta, 5.0);
+        return F0 + (color(1.0, 1.0, 1.0) - F0) * pow5(1.0 - cos_theta);
     }
 
-    // Evaluate full Cook-Torrance BRDF (internal implementation)
-    color eval_brdf_impl(const vec3& wi, const vec3& wo, const vec3& n) const
+    // Evaluate full Cook-Torrance BRDF for unit directions in the shading frame: `wi_local`
+    // toward the viewer, `wo_local` toward where the light comes from. Multiplied by the cosine
+    // term, as bsdf_sample::value is.
+    color eval_brdf_impl(const vec3& wi_local, const vec3& wo_local) const
     {
-        onb uvw(n);
-        vec3 wi_local = uvw.local(wi);
-        vec3 wo_local = uvw.local(wo);
 
         // Check if directions are above surface
         if (wo_local.z() <= 0.0 || wi_local.z() <= 0.0) {
@@ -348,7 +378,7 @@ private:
             result = specular;
         }
 
-        return result;
+        return result * wo_local.z();
     }
 };
 
@@ -0,0 +1,80 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+
+class material;
+
+// A material's index in the material table. Primitives and hit records carry this instead of
+// a shared_ptr, so searching for the closest hit never touches a reference count; the camera
+// looks the material up once, when it shades the final hit.
+using material_id = uint32_t;
+
+// Owns every material a primitive refers to. Id 0 stands for no material (a shape only used
+// as a light sampling target); adding a material again returns the id it already has.
+//
+// Primitives are built before they are added to any scene, and they take their id when they
+// are built, so there is one table for the whole process; materials stay alive with it.
+// add() may be called from several threads at once (meshes load on a thread pool); get()
+// is unsynchronized and must not race with add(), which holds as long as a scene is built
+// before it is rendered.
+class material_table
+{
+public:
+    static constexpr material_id none = 0;
+
+    static material_table &global()
+    {
+        static material_table table;
+        return table;
+    }
+
+    material_table() : materials{nullptr} {}
+
+    material_table(const material_table &) = delete;
+    material_table &operator=(const material_table &) = delete;
+
+    material_id add(const shared_ptr<material> &mat)
+    {
+        if (!mat)
+            return none;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(mat.get());
+        if (found != index.end())
+            return found->second;
+
+        auto id = material_id(materials.size());
+        materials.push_back(mat);
+        index.emplace(mat.get(), id);
+        return id;
+    }
+
+    // The material for `id`, or null for `none`.
+    const material *get(material_id id) const { return materials[id].get(); }
+
+    // The shared_ptr behind `id`, for building another primitive with the same material.
+    shared_ptr<material> owner(material_id id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return materials[id];
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return materials.size() - 1;
+    }
+
+private:
+    mutable std::mutex mutex; // Guards add() against itself and owner()
+    std::vector<shared_ptr<material>> materials; // By id; slot 0 is `none`
+    std::unordered_map<const material *, material_id> index;
+};
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "obj_parser.h"
+#include "triangle_mesh.h"
+
+// Binary mesh cache. A `.rtmesh` file holds a triangle_mesh exactly as it is laid out in
+// memory: the arrays in BVH leaf order and the BVH nodes themselves, each section starting on
+// a 64-byte boundary. Loading maps the file read-only and points the mesh straight at the
+// sections, so nothing is parsed, copied or rebuilt.
+//
+// The header records the source file's size and modification time; a cache that doesn't
+// match its source, or was written by a build with a different layout (version, byte order,
+// geometry precision), is ignored and rewritten. So is one whose indices or BVH links point
+// outside its arrays: a single pass over them at load is still far cheaper than a reparse,
+// and traversal can then trust them.
+struct mesh_cache_header
+{
+    static constexpr char expected_magic[8] = {'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0'};
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t byte_order_mark = 0x01020304;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;      // byte_order_mark as written by the producing machine
+    uint32_t geom_real_bytes; // sizeof(geom_real); the BVH node layout depends on it
+    uint32_t node_bytes;      // sizeof(flat_bvh::node)
+    uint64_t file_bytes;
+    uint64_t source_bytes;
+    int64_t source_mtime;
+
+    uint64_t num_vertices;
+    uint64_t num_uvs;
+    uint64_t num_triangles;
+    uint64_t num_nodes;
+    uint64_t num_materials;
+
+    // Byte offsets of each section from the start of the file; 0 for an absent section.
+    uint64_t positions_offset;
+    uint64_t uvs_offset;
+    uint64_t indices_offset;
+    uint64_t uv_indices_offset;
+    uint64_t material_ids_offset;
+    uint64_t nodes_offset;
+    uint64_t names_offset; // Material slot names, each NUL-terminated
+    uint64_t names_bytes;
+};
+
+inline std::string mesh_cache_path(const std::string &source_path) { return source_path + ".rtmesh"; }
+
+// Writes `mesh` to `path`. The file is written under a temporary name of its own and renamed
+// into place, so a concurrent reader never maps a partial cache and concurrent writers don't
+// write into each other's.
+inline bool write_mesh_cache(const std::string &path, const triangle_mesh &mesh, uint64_t source_bytes, int64_t source_mtime)
+{
+    const auto &arrays = mesh.data();
+
+    std::string names;
+    for (const auto &name : mesh.material_names())
+        names.append(name).push_back('\0');
+
+    mesh_cache_header header = {};
+    std::memcpy(header.magic, mesh_cache_header::expected_magic, sizeof(header.magic));
+    header.version = mesh_cache_header::current_version;
+    header.byte_order = mesh_cache_header::byte_order_mark;
+    header.geom_real_bytes = sizeof(geom_real);
+    header.node_bytes = sizeof(flat_bvh::node);
+    header.source_bytes = source_bytes;
+    header.source_mtime = source_mtime;
+    header.num_vertices = arrays.num_vertices;
+    header.num_uvs = arrays.num_uvs;
+    header.num_triangles = arrays.num_triangles;
+    header.num_nodes = arrays.num_nodes;
+    header.num_materials = mesh.material_names().size();
+
+    struct section
+    {
+        uint64_t *offset;
+        const void *data;
+        size_t bytes;
+    };
+    section sections[] = {
+        {&header.positions_offset, arrays.positions, 3 * arrays.num_vertices * sizeof(float)},
+        {&header.uvs_offset, arrays.uvs, arrays.uvs ? 2 * arrays.num_uvs * sizeof(float) : 0},
+        {&header.indices_offset, arrays.indices, 3 * arrays.num_triangles * sizeof(uint32_t)},
+        {&header.uv_indices_offset, arrays.uv_indices, arrays.uv_indices ? 3 * arrays.num_triangles * sizeof(uint32_t) : 0},
+        {&header.material_ids_offset, arrays.material_ids, arrays.material_ids ? arrays.num_triangles * sizeof(uint32_t) : 0},
+        {&header.nodes_offset, arrays.nodes, arrays.num_nodes * sizeof(flat_bvh::node)},
+        {&header.names_offset, names.data(), names.size()},
+    };
+
+    const uint64_t alignment = 64;
+    uint64_t offset = sizeof(header);
+    for (auto &s : sections)
+    {
+        if (s.bytes == 0)
+            continue;
+        offset = (offset + alignment - 1) / alignment * alignment;
+        *s.offset = offset;
+        offset += s.bytes;
+    }
+    header.file_bytes = offset;
+    header.names_bytes = names.size();
+
+    std::string temp_path = path + "." + std::to_string(std::random_device()()) + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        uint64_t written = sizeof(header);
+        const char padding[alignment] = {};
+        for (const auto &s : sections)
+        {
+            if (s.bytes == 0)
+                continue;
+            out.write(padding, std::streamsize(*s.offset - written));
+            out.write(static_cast<const char *>(s.data), std::streamsize(s.bytes));
+            written = *s.offset + s.bytes;
+        }
+        if (!out)
+            return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error)
+    {
+        std::filesystem::remove(temp_path, error);
+        return false;
+    }
+    return true;
+}
+
+// Whether every index in `arrays` points inside the array it indexes, and the BVH nodes form a
+// depth-first hierarchy that flat_bvh::traverse can walk: interior nodes link forward to
+// nodes that exist, with an axis it can index a vector by and no deeper than its stack, and
+// leaves cover triangles that exist. Material slots need no check: unknown ones read as none.
+inline bool valid_mesh_links(const triangle_mesh::view &arrays)
+{
+    const uint64_t triangles = arrays.num_triangles, nodes = arrays.num_nodes;
+    if ((triangles > 0) != (nodes > 0))
+        return false;
+
+    for (uint64_t i = 0; i < 3 * triangles; i++)
+    {
+        if (arrays.indices[i] >= arrays.num_vertices)
+            return false;
+        if (arrays.uv_indices && arrays.uv_indices[i] != triangle_mesh::no_uv &&
+            (!arrays.uvs || arrays.uv_indices[i] >= arrays.num_uvs))
+            return false;
+    }
+
+    // Children always come after their parent, so one forward pass sees every node's depth
+    // before its own links are checked. The traversal stack holds at most one node per level.
+    const int max_depth = 64;
+    std::vector<uint8_t> depth(nodes, 0);
+    for (uint64_t i = 0; i < nodes; i++)
+    {
+        const flat_bvh::node &n = arrays.nodes[i];
+        if (n.count > 0)
+        {
+            if (n.offset > triangles || n.count > triangles - n.offset)
+                return false;
+            continue;
+        }
+        if (n.axis > 2 || i + 1 >= nodes || n.offset <= i + 1 || n.offset >= nodes || depth[i] + 1 >= max_depth)
+            return false;
+        uint8_t child_depth = uint8_t(depth[i] + 1);
+        depth[i + 1] = std::max(depth[i + 1], child_depth);
+        depth[n.offset] = std::max(depth[n.offset], child_depth);
+    }
+    return true;
+}
+
+// Maps the cache at `path` if it exists, fits this build, and was made from a source with the
+// given size and modification time. Returns null otherwise.
+inline shared_ptr<triangle_mesh> read_mesh_cache(const std::string &path, uint64_t source_bytes, int64_t source_mtime,
+                                                 shared_ptr<material> mat,
+                                                 const obj_parser::material_lookup &lookup = nullptr)
+{
+    auto file = make_shared<mapped_file>();
+    if (!file->open(path, mapped_file::access::random) || file->size() < sizeof(mesh_cache_header))
+        return nullptr;
+
+    mesh_cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, mesh_cache_header::expected_magic, sizeof(header.magic)) != 0 ||
+        header.version != mesh_cache_header::current_version ||
+        header.byte_order != mesh_cache_header::byte_order_mark || header.geom_real_bytes != sizeof(geom_real) ||
+        header.node_bytes != sizeof(flat_bvh::node) || header.file_bytes != file->size() ||
+        header.source_bytes != source_bytes || header.source_mtime != source_mtime)
+        return nullptr;
+
+    // Every section must lie inside the file: `count` elements of `element_bytes` each, counted
+    // by division so that no count can wrap the size around.
+    auto section = [&](uint64_t offset, uint64_t count, uint64_t element_bytes) -> const char *
+    {
+        if (offset == 0 || offset > header.file_bytes || count > (header.file_bytes - offset) / element_bytes)
+            return nullptr;
+        return file->data() + offset;
+    };
+
+    triangle_mesh::view arrays;
+    arrays.num_vertices = header.num_vertices;
+    arrays.num_uvs = header.num_uvs;
+    arrays.num_triangles = header.num_triangles;
+    arrays.num_nodes = header.num_nodes;
+    arrays.positions = reinterpret_cast<const float *>(section(header.positions_offset, header.num_vertices, 3 * sizeof(float)));
+    arrays.indices = reinterpret_cast<const uint32_t *>(section(header.indices_offset, header.num_triangles, 3 * sizeof(uint32_t)));
+    arrays.nodes = reinterpret_cast<const flat_bvh::node *>(section(header.nodes_offset, header.num_nodes, sizeof(flat_bvh::node)));
+    if ((header.num_vertices > 0 && !arrays.positions) || (header.num_triangles > 0 && !arrays.indices) ||
+        (header.num_nodes > 0 && !arrays.nodes))
+        return nullptr;
+
+    // Optional sections, which must be valid when present.
+    if (header.uvs_offset &&
+        !(arrays.uvs = reinterpret_cast<const float *>(section(header.uvs_offset, header.num_uvs, 2 * sizeof(float)))))
+        return nullptr;
+    if (header.uv_indices_offset &&
+        !(arrays.uv_indices = reinterpret_cast<const uint32_t *>(section(header.uv_indices_offset, header.num_triangles, 3 * sizeof(uint32_t)))))
+        return nullptr;
+    if (header.material_ids_offset &&
+        !(arrays.material_ids = reinterpret_cast<const uint32_t *>(section(header.material_ids_offset, header.num_triangles, sizeof(uint32_t)))))
+        return nullptr;
+
+    if (!valid_mesh_links(arrays))
+        return nullptr;
+
+    std::vector<std::string> names;
+    if (const char *p = section(header.names_offset, header.names_bytes, 1))
+    {
+        const char *end = p + header.names_bytes;
+        while (p < end && names.size() < header.num_materials)
+        {
+            size_t length = strnlen(p, size_t(end - p));
+            names.emplace_back(p, length);
+            p += length + 1;
+        }
+    }
+
+    auto slot_materials = triangle_mesh::resolve_materials(names, mat, lookup);
+    return make_shared<triangle_mesh>(arrays, std::move(slot_materials), std::move(names), std::move(file));
+}
+
+// Loads an OBJ file as a mesh through its binary cache: maps `<path>.rtmesh` when it is up to
+// date, and otherwise parses the OBJ and writes the cache for next time.
+inline shared_ptr<triangle_mesh> load_obj_mesh(const std::string &path, shared_ptr<material> mat,
+                                               const obj_parser::material_lookup &lookup = nullptr,
+                                               int num_threads = 0)
+{
+    uint64_t source_bytes;
+    int64_t source_mtime;
+    if (!file_stamp(path, source_bytes, source_mtime))
+    {
+        std::cerr << "Failed to open file: " << path << "\n";
+        return nullptr;
+    }
+
+    auto cache_path = mesh_cache_path(path);
+    if (auto cached = read_mesh_cache(cache_path, source_bytes, source_mtime, mat, lookup))
+        return cached;
+
+    obj_parser parser;
+    if (!parser.load(path, num_threads))
+        return nullptr;
+    auto mesh = parser.make_mesh(mat, lookup);
+
+    if (!write_mesh_cache(cache_path, *mesh, source_bytes, source_mtime))
+        std::cerr << "Could not write mesh cache " << cache_path << "\n";
+    return mesh;
+}
+
+#endif
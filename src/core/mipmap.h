@@ -0,0 +1,169 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "rtweekend.h"
+#include "rtw_stb_image.h"
+#include "texel_format.h"
+
+// Mip level to sample for a footprint `width` texture units across on an image whose base
+// level is `w` x `h` texels, clamped to the `levels` that exist.
+inline double mip_lod(double width, int w, int h, int levels)
+{
+    double lod = std::log2(width * std::sqrt(double(w) * h));
+    return lod > 0 ? std::min(lod, double(levels - 1)) : 0.0; // Also maps NaN to 0
+}
+
+// Bilinear lookup at (u, v) in [0,1]^2 on a `w` x `h` image. `texel(x, y, rgb)` decodes the
+// linear color of the texel at (x, y), which is always inside the image. Texel centers sit at
+// half-integer coordinates.
+template <typename TexelFn>
+color bilinear_filter(int w, int h, double u, double v, TexelFn &&texel)
+{
+    double x = u * w - 0.5;
+    double y = v * h - 0.5;
+    int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+    double fx = x - x0, fy = y - y0;
+    int x1 = std::clamp(x0 + 1, 0, w - 1), y1 = std::clamp(y0 + 1, 0, h - 1);
+    x0 = std::clamp(x0, 0, w - 1);
+    y0 = std::clamp(y0, 0, h - 1);
+
+    float a[3], b[3], c[3], d[3];
+    texel(x0, y0, a);
+    texel(x1, y0, b);
+    texel(x0, y1, c);
+    texel(x1, y1, d);
+
+    double rgb[3];
+    for (int k = 0; k < 3; k++)
+    {
+        double top = (1 - fx) * a[k] + fx * b[k];
+        double bottom = (1 - fx) * c[k] + fx * d[k];
+        rgb[k] = (1 - fy) * top + fy * bottom;
+    }
+    return color(rgb[0], rgb[1], rgb[2]);
+}
+
+// An RGB image with its chain of box-filtered mip levels, each half the size of the one before
+// down to 1x1. Lookups blend the two levels whose texel size brackets the requested
+// footprint, so a minified texture is averaged over the area a ray covers instead of being
+// point sampled at full resolution. Every level keeps the source image's texel format;
+// filtering happens on linear values.
+class mipmap
+{
+public:
+    mipmap() {}
+
+    explicit mipmap(const rtw_image &image) : mipmap(image.width(), image.height(), image.data(), image.format()) {}
+
+    // From `w` x `h` tightly packed texels in `format`.
+    mipmap(int w, int h, const unsigned char *data, texel_format format = texel_format::srgb8)
+        : storage(format), stride(texel_bytes(format))
+    {
+        if (w <= 0 || h <= 0 || data == nullptr)
+            return;
+
+        size_t chain_texels = 0;
+        for (int lw = w, lh = h;; lw = std::max(1, lw / 2), lh = std::max(1, lh / 2))
+        {
+            chain_texels += size_t(lw) * lh;
+            if (lw == 1 && lh == 1)
+                break;
+        }
+        texels.reserve(stride * chain_texels);
+
+        add_level(w, h);
+        std::copy_n(data, stride * size_t(w) * h, texels.data());
+        build_levels();
+    }
+
+    bool empty() const { return levels.empty(); }
+    texel_format format() const { return storage; }
+    int level_count() const { return int(levels.size()); }
+    int level_width(int level) const { return levels[level].width; }
+    int level_height(int level) const { return levels[level].height; }
+    const unsigned char *level_data(int level) const { return &texels[levels[level].offset]; }
+    size_t memory_bytes() const { return texels.capacity(); }
+
+    // Trilinear lookup at (u, v) in [0,1]^2 (v pointing down the image) for a footprint
+    // `width` texture units wide. A width of 0 samples the full-resolution level.
+    color sample(double u, double v, double width) const
+    {
+        double lod = mip_lod(width, levels[0].width, levels[0].height, level_count());
+        int fine = int(lod);
+        double blend = lod - fine;
+        color c = bilinear(fine, u, v);
+        if (blend > 0 && fine + 1 < level_count())
+            c = (1 - blend) * c + blend * bilinear(fine + 1, u, v);
+        return c;
+    }
+
+private:
+    struct level
+    {
+        int width, height;
+        size_t offset; // Into `texels`
+    };
+
+    texel_format storage = texel_format::srgb8;
+    size_t stride = 3; // Bytes per texel
+    std::vector<level> levels;
+    std::vector<unsigned char> texels;
+
+    void add_level(int w, int h)
+    {
+        levels.push_back({w, h, texels.size()});
+        texels.resize(texels.size() + stride * size_t(w) * h);
+    }
+
+    const unsigned char *texel(const level &l, int x, int y) const
+    {
+        return &texels[l.offset + stride * (size_t(y) * l.width + x)];
+    }
+
+    void build_levels()
+    {
+        // Each texel of the next level averages the (up to) 2x2 texels it covers; an odd
+        // edge row or column folds into its neighbour.
+        int w = levels[0].width, h = levels[0].height;
+        while (w > 1 || h > 1)
+        {
+            int nw = std::max(1, w / 2);
+            int nh = std::max(1, h / 2);
+            add_level(nw, nh);
+
+            const level &src = levels[levels.size() - 2];
+            const level &dst = levels.back();
+            for (int y = 0; y < nh; y++)
+            {
+                int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                for (int x = 0; x < nw; x++)
+                {
+                    int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                    float a[3], b[3], c[3], d[3], mean[3];
+                    decode_texel(storage, texel(src, x0, y0), a);
+                    decode_texel(storage, texel(src, x1, y0), b);
+                    decode_texel(storage, texel(src, x0, y1), c);
+                    decode_texel(storage, texel(src, x1, y1), d);
+                    for (int k = 0; k < 3; k++)
+                        mean[k] = 0.25f * (a[k] + b[k] + c[k] + d[k]);
+                    encode_texel(storage, mean, &texels[dst.offset + stride * (size_t(y) * nw + x)]);
+                }
+            }
+            w = nw;
+            h = nh;
+        }
+    }
+
+    color bilinear(int level_index, double u, double v) const
+    {
+        const level &l = levels[level_index];
+        return bilinear_filter(l.width, l.height, u, v, [&](int x, int y, float *rgb)
+                               { decode_texel(storage, texel(l, x, y), rgb); });
+    }
+};
+
+#endif
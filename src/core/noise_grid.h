@@ -0,0 +1,92 @@
+#ifndef NOISE_GRID_H
+#define NOISE_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+// A scalar field baked onto a regular grid over a box and reconstructed by trilinear
+// interpolation: eight loads and seven lerps per lookup, whatever the field cost to evaluate.
+// Detail finer than the grid spacing is lost, so the spacing has to resolve the field's
+// highest frequency (a Perlin lattice cell wants about eight samples across).
+class noise_grid
+{
+public:
+    // Grids above this many samples are refused rather than built.
+    static constexpr size_t max_samples = size_t(1) << 26;
+
+    noise_grid() {}
+
+    // Samples `field(point3)` over `bounds` every `spacing` units along each axis.
+    template <typename Field>
+    noise_grid(const aabb &bounds, double spacing, Field &&field)
+    {
+        if (!(spacing > 0))
+            return;
+
+        origin = point3(bounds.x.min, bounds.y.min, bounds.z.min);
+        inv_spacing = 1.0 / spacing;
+        size_t total = 1;
+        const interval *axes[3] = {&bounds.x, &bounds.y, &bounds.z};
+        for (int a = 0; a < 3; a++)
+        {
+            double cells = std::max(std::ceil(axes[a]->size() * inv_spacing), 1.0);
+            if (cells + 1 > double(max_samples))
+                return;
+            n[a] = int(cells) + 1;
+            total *= size_t(n[a]);
+            if (total > max_samples)
+                return;
+        }
+
+        values.resize(total);
+        for (int z = 0; z < n[2]; z++)
+            for (int y = 0; y < n[1]; y++)
+                for (int x = 0; x < n[0]; x++)
+                    values[index(x, y, z)] = float(field(origin + spacing * vec3(x, y, z)));
+    }
+
+    bool empty() const { return values.empty(); }
+    size_t memory_bytes() const { return values.capacity() * sizeof(float); }
+
+    // The baked value at `p`, or false if `p` lies outside the grid.
+    bool sample(const point3 &p, double &value) const
+    {
+        if (values.empty())
+            return false;
+
+        double gx = (p.x() - origin.x()) * inv_spacing;
+        double gy = (p.y() - origin.y()) * inv_spacing;
+        double gz = (p.z() - origin.z()) * inv_spacing;
+        if (!(gx >= 0 && gy >= 0 && gz >= 0 && gx <= n[0] - 1 && gy <= n[1] - 1 && gz <= n[2] - 1))
+            return false;
+
+        // The far faces belong to the last cell.
+        int x = std::min(int(gx), n[0] - 2), y = std::min(int(gy), n[1] - 2), z = std::min(int(gz), n[2] - 2);
+        float fx = float(gx - x), fy = float(gy - y), fz = float(gz - z);
+
+        const float *c = &values[index(x, y, z)];
+        size_t dy = size_t(n[0]), dz = size_t(n[0]) * n[1];
+        float x00 = c[0] + fx * (c[1] - c[0]);
+        float x10 = c[dy] + fx * (c[dy + 1] - c[dy]);
+        float x01 = c[dz] + fx * (c[dz + 1] - c[dz]);
+        float x11 = c[dz + dy] + fx * (c[dz + dy + 1] - c[dz + dy]);
+        float y0 = x00 + fy * (x10 - x00);
+        float y1 = x01 + fy * (x11 - x01);
+        value = y0 + fz * (y1 - y0);
+        return true;
+    }
+
+private:
+    point3 origin;
+    double inv_spacing = 0;
+    int n[3] = {0, 0, 0}; // Samples along each axis, at least two
+    std::vector<float> values;
+
+    size_t index(int x, int y, int z) const { return (size_t(z) * n[1] + y) * n[0] + x; }
+};
+
+#endif
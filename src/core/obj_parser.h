@@ -1,125 +1,555 @@
 #ifndef OBJ_PARSER_H
 #define OBJ_PARSER_H
 
-#include <fstream>
+#include <cstdint>
+#include <cstring>
 #include <string>
-#include <sstream>
+#include <unordered_map>
+#include <thread>
+#include <vector>
 
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
-#include "triangle.h"
+#include "mapped_file.h"
+#include "triangle_mesh.h"
 
+// Wavefront OBJ loader. Reads `v`, `vt`, `f` and `usemtl` records and ignores everything else. The file
+// is memory-mapped, split into newline-aligned chunks that are parsed on separate threads with
+// hand-written number scanning, and the per-chunk results are stitched together in file order.
 class obj_parser {
 public:
+    using material_lookup = triangle_mesh::material_lookup;
+
     obj_parser() = default;
 
-    bool load(const std::string& path)
+    // Loads `path` using `num_threads` parser threads (0: one per hardware thread).
+    bool load(const std::string& path, int num_threads = 0)
     {
-        std::vector<point3> temp_vertices;
-        std::vector<std::vector<int>> temp_faces;
-        std::vector<std::vector<int>> temp_face_tex_coords;
-        std::vector<point2> temp_tex_coords;
+        clear();
 
-        std::ifstream file(path);
-        if (!file.is_open())
+        mapped_file file;
+        if (!file.open(path))
         {
             std::cerr << "Failed to open file: " << path << "\n";
             return false;
         }
 
-        std::string line;
+        const char* data = file.data();
+        size_t size = file.size();
+
+        // Small files aren't worth a thread each; keep chunks at least a megabyte.
+        const size_t min_chunk_bytes = size_t(1) << 20;
+        if (num_threads <= 0)
+            num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+        size_t num_chunks = std::max<size_t>(1, std::min<size_t>(num_threads, size / min_chunk_bytes));
+
+        // Chunk boundaries, each moved forward to the start of a line.
+        std::vector<size_t> bounds(num_chunks + 1, size);
+        bounds[0] = 0;
+        for (size_t i = 1; i < num_chunks; i++)
+        {
+            size_t pos = std::max(bounds[i - 1], i * (size / num_chunks));
+            auto newline = static_cast<const char*>(pos < size ? std::memchr(data + pos, '\n', size - pos) : nullptr);
+            bounds[i] = newline ? size_t(newline - data) + 1 : size;
+        }
+
+        std::vector<obj_chunk> chunks(num_chunks);
+        if (num_chunks == 1)
+        {
+            parse_chunk(data, data + size, chunks[0]);
+        }
+        else
+        {
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < num_chunks; i++)
+                threads.emplace_back([&, i]() { parse_chunk(data + bounds[i], data + bounds[i + 1], chunks[i]); });
+            for (auto& thread : threads)
+                thread.join();
+        }
+
+        return merge_chunks(path, chunks);
+    }
+
+    size_t vertex_count() const { return positions.size() / 3; }
+    size_t tex_coord_count() const { return tex_coords.size() / 2; }
+    size_t face_count() const { return face_starts.empty() ? 0 : face_starts.size() - 1; }
+
+    // Largest number of bytes held at once in the import buffers (per-chunk parse results,
+    // the merged arrays and the triangulated mesh arrays) since the last load().
+    size_t peak_bytes() const { return tally.peak; }
+
+    // Material names from `usemtl` records. Slot 0 ("") covers faces before the first one.
+    const std::vector<std::string>& material_names() const { return names; }
+
+    // Triangulates the loaded faces (fans for n-gons) into a single mesh primitive. Each
+    // `usemtl` name is resolved through `lookup` when given; faces without a material, or
+    // whose name the lookup doesn't resolve, use `mat`. The loaded data is moved into the
+    // mesh, so the parser is empty afterwards.
+    shared_ptr<triangle_mesh> make_mesh(shared_ptr<material> mat, const material_lookup& lookup = nullptr)
+    {
+        size_t num_faces = face_count();
+        size_t num_triangles = 0;
+        bool has_tex_indices = false;
+        for (size_t f = 0; f < num_faces; f++)
+        {
+            auto corners = face_starts[f + 1] - face_starts[f];
+            num_triangles += corners >= 3 ? corners - 2 : 0;
+        }
+        for (int tex_index : tex_indices)
+            has_tex_indices |= tex_index >= 0;
+
+        std::vector<uint32_t> triangle_indices;
+        std::vector<uint32_t> triangle_uv_indices;
+        triangle_indices.reserve(3 * num_triangles);
+        if (has_tex_indices)
+            triangle_uv_indices.reserve(3 * num_triangles);
+        tally.add(bytes(triangle_indices) + bytes(triangle_uv_indices));
 
-        while (std::getline(file, line))
+        for (size_t f = 0; f < num_faces; f++)
         {
-            if (line.size() >= 2 && line.substr(0, 2) == "v ")
+            uint32_t first = face_starts[f];
+            for (uint32_t k = first + 1; k + 1 < face_starts[f + 1]; k++)
             {
-                double x, y, z;
-                std::istringstream iss(line.substr(2));
-                if(iss >> x >> y >> z)
+                for (uint32_t corner : {first, k, k + 1})
                 {
-                    temp_vertices.push_back(point3(x, y, z));
+                    triangle_indices.push_back(uint32_t(indices[corner]));
+                    if (has_tex_indices)
+                        triangle_uv_indices.push_back(tex_indices[corner] < 0 ? triangle_mesh::no_uv
+                                                                              : uint32_t(tex_indices[corner]));
                 }
             }
-            else if (line.size() >= 2 && line.substr(0, 2) == "vt ")
+        }
+
+        // Per-triangle material slots, only needed when the faces use more than one.
+        std::vector<uint32_t> triangle_material_ids;
+        if (material_runs.size() > 1)
+        {
+            triangle_material_ids.reserve(num_triangles);
+            tally.add(bytes(triangle_material_ids));
+            size_t run = 0;
+            for (size_t f = 0; f < num_faces; f++)
+            {
+                while (run + 1 < material_runs.size() && material_runs[run + 1].first_face <= f)
+                    run++;
+                auto corners = face_starts[f + 1] - face_starts[f];
+                for (uint32_t k = 2; k < corners; k++)
+                    triangle_material_ids.push_back(material_runs[run].slot);
+            }
+        }
+        uint32_t only_slot = material_runs.size() == 1 ? material_runs[0].slot : 0;
+
+        release(face_starts);
+        release(indices);
+        release(tex_indices);
+        if (!has_tex_indices)
+            release(tex_coords);
+
+        // With a single material the mesh needs only that one slot.
+        std::vector<std::string> slot_names = names;
+        if (triangle_material_ids.empty())
+            slot_names.assign(1, names.empty() ? std::string() : names[only_slot]);
+        auto slot_materials = triangle_mesh::resolve_materials(slot_names, mat, lookup);
+
+        auto mesh = make_shared<triangle_mesh>(std::move(positions), std::move(triangle_indices),
+                                               std::move(tex_coords), std::move(triangle_uv_indices),
+                                               std::move(triangle_material_ids), std::move(slot_materials),
+                                               std::move(slot_names));
+        positions.clear();
+        tex_coords.clear();
+        material_runs.clear();
+        tally.current = 0;
+        return mesh;
+    }
+
+    hittable_list parse(shared_ptr<material> mat)
+    {
+        return hittable_list(make_mesh(mat));
+    }
+
+private:
+    // Parse output of one chunk. Negative (relative) OBJ indices can only be resolved once the
+    // number of vertices in earlier chunks is known, so they are stored chunk-local and their
+    // positions recorded for fixup.
+    struct obj_chunk
+    {
+        std::vector<float> positions;
+        std::vector<float> tex_coords;
+        std::vector<uint32_t> face_sizes;
+        std::vector<int> indices;      // Zero-based vertex index per face corner
+        std::vector<int> tex_indices;  // Zero-based texture coordinate index, or -1
+        std::vector<size_t> relative_indices;
+        std::vector<size_t> relative_tex_indices;
+        std::vector<std::pair<uint32_t, std::string>> material_changes; // (chunk face index, name)
+        size_t line_count = 0;
+        size_t bad_line = 0;           // First malformed line (1-based within the chunk), or 0
+
+        size_t memory_bytes() const
+        {
+            return bytes(positions) + bytes(tex_coords) + bytes(face_sizes) + bytes(indices) +
+                   bytes(tex_indices) + bytes(relative_indices) + bytes(relative_tex_indices);
+        }
+    };
+
+    struct byte_tally
+    {
+        size_t current = 0;
+        size_t peak = 0;
+
+        void add(size_t n)
+        {
+            current += n;
+            peak = std::max(peak, current);
+        }
+        void remove(size_t n) { current -= std::min(current, n); }
+    };
+
+    std::vector<float> positions;       // xyz per vertex
+    std::vector<float> tex_coords;      // uv per texture vertex
+    std::vector<uint32_t> face_starts;  // First corner of each face, then one past the last
+    std::vector<int> indices;           // Zero-based vertex index per face corner
+    std::vector<int> tex_indices;       // Zero-based texture coordinate index per corner, or -1
+    byte_tally tally;
+
+    // Faces from `first_face` up to the next run's use material slot `slot`.
+    struct material_run
+    {
+        size_t first_face;
+        uint32_t slot;
+    };
+    std::vector<material_run> material_runs;
+    std::vector<std::string> names;
+
+    template <typename T>
+    static size_t bytes(const std::vector<T>& values) { return values.capacity() * sizeof(T); }
+
+    void clear()
+    {
+        for (auto* values : {&positions, &tex_coords})
+            std::vector<float>().swap(*values);
+        for (auto* values : {&indices, &tex_indices})
+            std::vector<int>().swap(*values);
+        std::vector<uint32_t>().swap(face_starts);
+        material_runs.clear();
+        names.clear();
+        tally = byte_tally();
+    }
+
+    template <typename T>
+    void release(std::vector<T>& values)
+    {
+        tally.remove(bytes(values));
+        std::vector<T>().swap(values);
+    }
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+    static const char* skip_spaces(const char* p, const char* end)
+    {
+        while (p < end && is_space(*p))
+            p++;
+        return p;
+    }
+
+    // Scans a decimal integer. Returns the position after it, or nullptr if there is none.
+    static const char* scan_int(const char* p, const char* end, int& value)
+    {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+        if (p == end || !is_digit(*p))
+            return nullptr;
+
+        int64_t result = 0;
+        while (p < end && is_digit(*p))
+        {
+            result = result * 10 + (*p++ - '0');
+            if (result > INT32_MAX)
+                return nullptr;
+        }
+        value = int(negative ? -result : result);
+        return p;
+    }
+
+    // Scans a floating point number. Plain decimals with up to 19 significant digits and a
+    // small exponent, which is nearly everything exporters write, are converted exactly with
+    // one multiply or divide by a power of ten; anything else goes through strtod.
+    static const char* scan_double(const char* p, const char* end, double& value)
+    {
+        static const double powers_of_ten[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+        const char* start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        bool any_digits = false;
+
+        for (; p < end && is_digit(*p); p++, any_digits = true)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + uint64_t(*p - '0');
+                digits += mantissa != 0;
+            }
+            else
             {
-                double u, v;
-                std::istringstream iss(line.substr(2));
-                if(iss >> u >> v)
+                exponent++;
+            }
+        }
+        if (p < end && *p == '.')
+        {
+            for (p++; p < end && is_digit(*p); p++, any_digits = true)
+            {
+                if (digits < 19)
                 {
-                    temp_tex_coords.push_back(point2(u, v));
+                    mantissa = mantissa * 10 + uint64_t(*p - '0');
+                    digits += mantissa != 0;
+                    exponent--;
                 }
             }
-            else if (line.size() >= 2 && line.substr(0, 2) == "f ")
-            {
-                std::vector<int> face;
-                std::vector<int> face_tex_coords;
-                std::istringstream iss(line.substr(2));
+        }
+        if (any_digits && p < end && (*p == 'e' || *p == 'E'))
+        {
+            int exp_value;
+            const char* exp_end = scan_int(p + 1, end, exp_value);
+            if (!exp_end)
+                return scan_double_slow(start, end, value);
+            exponent += exp_value;
+            p = exp_end;
+        }
+
+        if (!any_digits || digits >= 19 || mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22)
+            return scan_double_slow(start, end, value);
+
+        double result = double(mantissa);
+        result = exponent < 0 ? result / powers_of_ten[-exponent] : result * powers_of_ten[exponent];
+        value = negative ? -result : result;
+        return p;
+    }
+
+    static const char* scan_double_slow(const char* p, const char* end, double& value)
+    {
+        // The mapping isn't NUL-terminated, so hand strtod a bounded copy of the token.
+        char token[64];
+        size_t length = 0;
+        while (p + length < end && length < sizeof(token) - 1 && !is_space(p[length]) && p[length] != '\n')
+            length++;
+        std::memcpy(token, p, length);
+        token[length] = '\0';
+
+        char* token_end;
+        value = std::strtod(token, &token_end);
+        if (token_end == token)
+            return nullptr;
+        return p + (token_end - token);
+    }
+
+    static void parse_chunk(const char* p, const char* end, obj_chunk& chunk)
+    {
+        while (p < end)
+        {
+            chunk.line_count++;
+            auto newline = static_cast<const char*>(std::memchr(p, '\n', size_t(end - p)));
+            const char* line_end = newline ? newline : end;
+            if (!parse_line(skip_spaces(p, line_end), line_end, chunk) && chunk.bad_line == 0)
+                chunk.bad_line = chunk.line_count;
+            p = line_end + 1;
+        }
+    }
+
+    // Parses one record. Returns false for a malformed v/vt/f record.
+    static bool parse_line(const char* p, const char* end, obj_chunk& chunk)
+    {
+        if (end - p > 7 && std::memcmp(p, "usemtl", 6) == 0 && is_space(p[6]))
+        {
+            const char* name = skip_spaces(p + 7, end);
+            const char* name_end = end;
+            while (name_end > name && is_space(name_end[-1]))
+                name_end--;
+            chunk.material_changes.emplace_back(uint32_t(chunk.face_sizes.size()), std::string(name, name_end));
+            return true;
+        }
+
+        if (end - p < 2 || (!is_space(p[1]) && !(p[0] == 'v' && p[1] == 't')))
+            return true;
 
-                std::string token;
-                while (iss >> token)
+        if (p[0] == 'v' && is_space(p[1]))
+        {
+            double xyz[3];
+            p += 2;
+            for (double& c : xyz)
+                if (!(p = scan_double(skip_spaces(p, end), end, c)))
+                    return false;
+            chunk.positions.insert(chunk.positions.end(), {float(xyz[0]), float(xyz[1]), float(xyz[2])});
+            return true;
+        }
+
+        if (p[0] == 'v' && p[1] == 't' && end - p > 2 && is_space(p[2]))
+        {
+            // `vt u [v [w]]`: v defaults to 0, and w is ignored.
+            double uv[2] = {0, 0};
+            if (!(p = scan_double(skip_spaces(p + 3, end), end, uv[0])))
+                return false;
+            p = skip_spaces(p, end);
+            if (p < end && !scan_double(p, end, uv[1]))
+                return false;
+            chunk.tex_coords.insert(chunk.tex_coords.end(), {float(uv[0]), float(uv[1])});
+            return true;
+        }
+
+        if (p[0] == 'f')
+        {
+            // Corners are v, v/vt, v//vn or v/vt/vn.
+            uint32_t corners = 0;
+            p = skip_spaces(p + 1, end);
+            while (p < end)
+            {
+                int index, tex_index = 0, normal_index;
+                if (!(p = scan_int(p, end, index)) || index == 0)
+                    return false;
+                if (p < end && *p == '/')
                 {
-                    size_t first_slash = token.find('/');
-                    size_t second_slash = token.find('/', first_slash + 1);
-                    int vertex_idx = std::stoi(token.substr(0, first_slash));
-
-                    int tex_idx = -1;
-                    if (first_slash != std::string::npos && second_slash != first_slash + 1)
-                    {
-                        size_t tex_start = first_slash + 1;
-                        size_t tex_end = (second_slash == std::string::npos) ? token.size() : second_slash;
-                        tex_idx = std::stoi(token.substr(tex_start, tex_end - tex_start));
-                    }
-                    face.push_back(vertex_idx - 1);
-                    face_tex_coords.push_back(tex_idx - 1);
+                    p++;
+                    if (p < end && *p != '/' && !(p = scan_int(p, end, tex_index)))
+                        return false;
+                    if (p < end && *p == '/' && !(p = scan_int(p + 1, end, normal_index)))
+                        return false;
                 }
-                temp_faces.push_back(face);
-                temp_face_tex_coords.push_back(face_tex_coords);
+
+                add_index(index, chunk.positions.size() / 3, chunk.indices, chunk.relative_indices);
+                if (tex_index == 0)
+                    chunk.tex_indices.push_back(-1);
+                else
+                    add_index(tex_index, chunk.tex_coords.size() / 2, chunk.tex_indices, chunk.relative_tex_indices);
+
+                corners++;
+                p = skip_spaces(p, end);
             }
+            chunk.face_sizes.push_back(corners);
+            return true;
         }
 
-        vertices = temp_vertices;
-        faces = temp_faces;
-        tex_coords = temp_tex_coords;
-        face_tex_coords = temp_face_tex_coords;
-
         return true;
     }
 
-    hittable_list parse(shared_ptr<material> mat)
+    static void add_index(int index, size_t local_count, std::vector<int>& indices, std::vector<size_t>& relative)
+    {
+        if (index > 0)
+        {
+            indices.push_back(index - 1);
+        }
+        else
+        {
+            relative.push_back(indices.size());
+            indices.push_back(int(local_count) + index);
+        }
+    }
+
+    bool merge_chunks(const std::string& path, std::vector<obj_chunk>& chunks)
     {
-        hittable_list triangles;
-        for (int i = 0; i < faces.size(); i++)
+        size_t num_vertices = 0, num_tex_coords = 0, num_faces = 0, num_corners = 0, num_lines = 0;
+        for (auto& chunk : chunks)
         {
-            if (faces[i].size() == 3)
+            tally.add(chunk.memory_bytes());
+            if (chunk.bad_line != 0)
             {
-                // Check if face_tex_coords[i] contains -1, if so, pass default tex_coords (point2(0, 0))
-                point2 t1 = face_tex_coords[i][0] < 0 ? point2(0, 0) : tex_coords[face_tex_coords[i][0]];
-                point2 t2 = face_tex_coords[i][1] < 0 ? point2(0, 0) : tex_coords[face_tex_coords[i][1]];
-                point2 t3 = face_tex_coords[i][2] < 0 ? point2(0, 0) : tex_coords[face_tex_coords[i][2]];
+                std::cerr << "Malformed record in " << path << " at line " << num_lines + chunk.bad_line << "\n";
+                return false;
+            }
+            num_lines += chunk.line_count;
+
+            // Rebase chunk-local relative indices onto the global arrays.
+            for (auto i : chunk.relative_indices)
+                chunk.indices[i] += int(num_vertices);
+            for (auto i : chunk.relative_tex_indices)
+                chunk.tex_indices[i] += int(num_tex_coords);
+
+            num_vertices += chunk.positions.size() / 3;
+            num_tex_coords += chunk.tex_coords.size() / 2;
+            num_faces += chunk.face_sizes.size();
+            num_corners += chunk.indices.size();
+        }
 
-                triangles.add(make_shared<triangle>(vertices[faces[i][0]], vertices[faces[i][1]], vertices[faces[i][2]], t1, t2, t3, mat));
+        for (const auto& chunk : chunks)
+        {
+            for (size_t corner = 0; corner < chunk.indices.size(); corner++)
+            {
+                int index = chunk.indices[corner];
+                int tex_index = chunk.tex_indices[corner];
+                if (index < 0 || size_t(index) >= num_vertices || tex_index < -1 || tex_index >= int(num_tex_coords))
+                {
+                    std::cerr << "Face index out of range in " << path << "\n";
+                    return false;
+                }
             }
-            else if (faces[i].size() == 4)
+        }
+
+        // A single chunk is moved as is; otherwise the chunks are appended one by one and
+        // freed as soon as they are copied, so at most one chunk is held twice.
+        if (chunks.size() == 1)
+        {
+            auto& chunk = chunks[0];
+            positions = std::move(chunk.positions);
+            tex_coords = std::move(chunk.tex_coords);
+            indices = std::move(chunk.indices);
+            tex_indices = std::move(chunk.tex_indices);
+        }
+        else
+        {
+            positions.reserve(3 * num_vertices);
+            tex_coords.reserve(2 * num_tex_coords);
+            indices.reserve(num_corners);
+            tex_indices.reserve(num_corners);
+            tally.add(bytes(positions) + bytes(tex_coords) + bytes(indices) + bytes(tex_indices));
+        }
+
+        // Material slots, with slot 0 for faces before any `usemtl`.
+        std::unordered_map<std::string, uint32_t> slot_of_name;
+        names.assign(1, std::string());
+        material_runs.push_back({0, 0});
+
+        face_starts.reserve(num_faces + 1);
+        tally.add(bytes(face_starts));
+        face_starts.push_back(0);
+        for (auto& chunk : chunks)
+        {
+            size_t chunk_first_face = face_starts.size() - 1;
+            for (const auto& change : chunk.material_changes)
             {
-                point2 t1 = face_tex_coords[i][0] < 0 ? point2(0, 0) : tex_coords[face_tex_coords[i][0]];
-                point2 t2 = face_tex_coords[i][1] < 0 ? point2(0, 0) : tex_coords[face_tex_coords[i][1]];
-                point2 t3 = face_tex_coords[i][2] < 0 ? point2(0, 0) : tex_coords[face_tex_coords[i][2]];
-                point2 t4 = face_tex_coords[i][3] < 0 ? point2(0, 0) : tex_coords[face_tex_coords[i][3]];
-                
-                triangles.add(make_shared<triangle>(vertices[faces[i][0]], vertices[faces[i][1]], vertices[faces[i][2]], t1, t2, t3, mat));
-                triangles.add(make_shared<triangle>(vertices[faces[i][0]], vertices[faces[i][2]], vertices[faces[i][3]], t1, t3, t4, mat));
+                auto found = slot_of_name.emplace(change.second, uint32_t(names.size()));
+                if (found.second)
+                    names.push_back(change.second);
+
+                size_t first_face = chunk_first_face + change.first;
+                if (material_runs.back().first_face == first_face)
+                    material_runs.back().slot = found.first->second;
+                else if (material_runs.back().slot != found.first->second)
+                    material_runs.push_back({first_face, found.first->second});
             }
 
+            for (auto corners : chunk.face_sizes)
+                face_starts.push_back(face_starts.back() + corners);
+
+            if (chunks.size() > 1)
+            {
+                positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+                tex_coords.insert(tex_coords.end(), chunk.tex_coords.begin(), chunk.tex_coords.end());
+                indices.insert(indices.end(), chunk.indices.begin(), chunk.indices.end());
+                tex_indices.insert(tex_indices.end(), chunk.tex_indices.begin(), chunk.tex_indices.end());
+            }
+            tally.remove(chunk.memory_bytes());
+            chunk = obj_chunk();
         }
-        return triangles;
-    }
 
-private:
-    std::vector<point3> vertices;
-    std::vector<std::vector<int>> faces;
-    std::vector<point2> tex_coords;
-    std::vector<std::vector<int>> face_tex_coords;
+        return true;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,228 @@
+#ifndef ORIENTED_BOX_H
+#define ORIENTED_BOX_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+
+// A rectangular box with its own orientation and position, intersected with one slab test in
+// the box's frame. This replaces the six-quad `box()` wrapped in `rotate_y` and `translate`,
+// which costs six plane tests, three virtual layers and two ray transforms per box.
+class oriented_box : public hittable
+{
+public:
+    // Box spanning corners `a` and `b` in its local frame, rotated by `angle` degrees about the
+    // Y axis and then moved by `offset`. Equivalent to
+    // translate(rotate_y(box(a, b, mat), angle), offset).
+    oriented_box(const point3 &a, const point3 &b, double angle, const vec3 &offset, shared_ptr<material> mat)
+        : mat(material_table::global().add(mat))
+    {
+        auto radians = degrees_to_radians(angle);
+        auto sin_theta = std::sin(radians);
+        auto cos_theta = std::cos(radians);
+
+        // Images of the local axes under rotate_y's object-to-world rotation.
+        axis[0] = vec3(cos_theta, 0, -sin_theta);
+        axis[1] = vec3(0, 1, 0);
+        axis[2] = vec3(sin_theta, 0, cos_theta);
+
+        auto local_center = 0.5 * (a + b);
+        center = local_center.x() * axis[0] + local_center.y() * axis[1] + local_center.z() * axis[2] + offset;
+        for (int i = 0; i < 3; i++)
+            half_size[i] = 0.5 * std::fabs(b[i] - a[i]);
+
+        init();
+    }
+
+    // Axis-aligned box spanning corners `a` and `b`.
+    oriented_box(const point3 &a, const point3 &b, shared_ptr<material> mat)
+        : oriented_box(a, b, 0, vec3(0, 0, 0), mat) {}
+
+    // Box with half extents `half_size` along the orthonormal axes `u`, `v` and `u` x `v`.
+    oriented_box(const point3 &center, const vec3 &half_size, const vec3 &u, const vec3 &v, shared_ptr<material> mat)
+        : center(center), half_size(half_size), mat(material_table::global().add(mat))
+    {
+        axis[0] = unit_vector(u);
+        axis[1] = unit_vector(v);
+        axis[2] = cross(axis[0], axis[1]);
+        init();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        int near_face, far_face;
+        double t_near, t_far;
+        if (!slab_hit(r, t_near, t_far, near_face, far_face))
+            return false;
+
+        // From outside the box the entry face is hit; from inside, the exit face.
+        double t = t_near;
+        int face = near_face;
+        if (!ray_t.surrounds(t))
+        {
+            t = t_far;
+            face = far_face;
+            if (!ray_t.surrounds(t))
+                return false;
+        }
+
+        rec.t = t;
+        rec.prim = this;
+        rec.prim_id = face;
+        return true;
+    }
+
+    void surface(const ray &r, hit_record &rec) const override
+    {
+        // Faces are numbered 2 * axis + (0 for the -axis side, 1 for the +axis side). UVs are
+        // the other two local coordinates, mapped to [0,1] across the face.
+        int face_axis = rec.prim_id / 2;
+        double sign = (rec.prim_id & 1) ? 1.0 : -1.0;
+
+        rec.p = r.at(rec.t);
+        vec3 local = rec.p - center;
+        int u_axis = (face_axis + 1) % 3;
+        int v_axis = (face_axis + 2) % 3;
+        rec.u = face_coordinate(dot(local, axis[u_axis]), u_axis);
+        rec.v = face_coordinate(dot(local, axis[v_axis]), v_axis);
+        rec.uv_density = 1 / (2 * std::sqrt(half_size[u_axis] * half_size[v_axis]));
+        rec.mat = mat;
+        rec.set_face_normal(r, sign * axis[face_axis]);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    shared_ptr<hittable> transformed_copy(const rigid_transform &to_world) const override
+    {
+        return make_shared<oriented_box>(to_world.point(center), half_size, to_world.vector(axis[0]),
+                                         to_world.vector(axis[1]), material_table::global().owner(mat));
+    }
+
+    double pdf_value(const point3 &origin, const vec3 &direction) const override
+    {
+        // random() picks a face with probability proportional to its area and then a uniform
+        // point on it, so the density is the sum over the faces the direction crosses of
+        // distance^2 / (cosine * total area). A line crosses a convex box at most twice.
+        int near_face, far_face;
+        double t_near, t_far;
+        if (!slab_hit(ray(origin, direction), t_near, t_far, near_face, far_face))
+            return 0.0;
+
+        double length_squared = direction.length_squared();
+        double length = std::sqrt(length_squared);
+        double pdf = 0.0;
+        auto add_face = [&](double t, int face)
+        {
+            if (t <= 0.001)
+                return;
+            auto cosine = std::fabs(dot(direction, axis[face / 2])) / length;
+            pdf += t * t * length_squared / (cosine * area);
+        };
+        add_face(t_near, near_face);
+        add_face(t_far, far_face);
+        return pdf;
+    }
+
+    vec3 random(const point3 &origin) const override
+    {
+        // Pick a face axis by the area of its two faces, then a side and a point on it.
+        double pick = random_double() * area;
+        int face_axis = 0;
+        while (face_axis < 2 && pick >= face_area_sum[face_axis])
+            face_axis++;
+
+        int u_axis = (face_axis + 1) % 3;
+        int v_axis = (face_axis + 2) % 3;
+        double sign = random_double() < 0.5 ? -1.0 : 1.0;
+        auto p = center + sign * half_size[face_axis] * axis[face_axis] +
+                 random_double(-1, 1) * half_size[u_axis] * axis[u_axis] +
+                 random_double(-1, 1) * half_size[v_axis] * axis[v_axis];
+        return p - origin;
+    }
+
+    double surface_area() const override { return area; }
+    material_id surface_material() const override { return mat; }
+
+private:
+    point3 center;
+    vec3 half_size;  // Half extents along each local axis
+    vec3 axis[3];    // Orthonormal local axes in world space
+    material_id mat;
+    aabb bbox;
+    double area;                // Total surface area
+    double face_area_sum[3];    // Running sum of the areas of the face pairs, for random()
+
+    void init()
+    {
+        bbox = aabb::empty;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            point3 p = center;
+            for (int i = 0; i < 3; i++)
+                p += ((corner >> i) & 1 ? 1.0 : -1.0) * half_size[i] * axis[i];
+            bbox = aabb(bbox, aabb(p, p));
+        }
+
+        area = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            area += 2 * (2 * half_size[(i + 1) % 3]) * (2 * half_size[(i + 2) % 3]);
+            face_area_sum[i] = area;
+        }
+    }
+
+    double face_coordinate(double x, int i) const
+    {
+        return half_size[i] > 0 ? 0.5 * (x / half_size[i] + 1.0) : 0.5;
+    }
+
+    // Intersects the ray's line with the box. Returns the parametric entry and exit distances
+    // and the faces they lie on.
+    bool slab_hit(const ray &r, double &t_near, double &t_far, int &near_face, int &far_face) const
+    {
+        vec3 oc = r.origin() - center;
+        t_near = -infinity;
+        t_far = infinity;
+        near_face = far_face = 0;
+
+        for (int i = 0; i < 3; i++)
+        {
+            double o = dot(oc, axis[i]);
+            double d = dot(r.direction(), axis[i]);
+
+            if (std::fabs(d) < 1e-12)
+            {
+                // Parallel to this slab: inside it or no hit at all.
+                if (std::fabs(o) > half_size[i])
+                    return false;
+                continue;
+            }
+
+            double inv_d = 1.0 / d;
+            double t0 = (-half_size[i] - o) * inv_d;
+            double t1 = (half_size[i] - o) * inv_d;
+            int face0 = 2 * i, face1 = 2 * i + 1;
+            if (t0 > t1)
+            {
+                std::swap(t0, t1);
+                std::swap(face0, face1);
+            }
+
+            if (t0 > t_near)
+            {
+                t_near = t0;
+                near_face = face0;
+            }
+            if (t1 < t_far)
+            {
+                t_far = t1;
+                far_face = face1;
+            }
+            if (t_near > t_far)
+                return false;
+        }
+
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef PATH_GUIDING_H
+#define PATH_GUIDING_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+// Adds `value` to `target` without a lock.
+inline void atomic_add(std::atomic<float> &target, float value)
+{
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+    {
+    }
+}
+
+// Directions as points of the unit square, by the cylindrical equal-area map: x is
+// (cos theta + 1) / 2 with theta measured from +z, and y is phi / 2pi. Equal areas of the square
+// cover equal solid angles, so a density over the square is 4 pi times the one over directions.
+inline vec2 direction_to_square(const vec3 &unit)
+{
+    double x = std::fmin(std::fmax(0.5 * (unit.z() + 1), 0.0), 1.0);
+    double phi = fast_atan2(unit.y(), unit.x());
+    double y = (phi < 0 ? phi + 2 * pi : phi) / (2 * pi);
+    return vec2(x, std::fmin(y, 1.0));
+}
+
+inline vec3 square_to_direction(const vec2 &p)
+{
+    double cos_theta = 2 * p.x() - 1;
+    double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+    double sin_phi, cos_phi;
+    fast_sin_cos(2 * pi * p.y(), sin_phi, cos_phi);
+    return vec3(cos_phi * sin_theta, sin_phi * sin_theta, cos_theta);
+}
+
+// A distribution over the unit square as a quadtree: each node holds the energy recorded in each
+// of its four quadrants, and the quadrants with enough of it are split into child nodes. Samples
+// walk down from the root picking quadrants in proportion to their energy, and are uniform within
+// the leaf cell they end in.
+//
+// record() may run on any number of threads at once, adding to the sums with atomic updates; the
+// tree's shape only changes in refined(), between passes.
+class direction_tree
+{
+public:
+    direction_tree() : nodes(1) {}
+
+    double total() const
+    {
+        const node &root = nodes[0];
+        double sum = 0;
+        for (const auto &s : root.sum)
+            sum += s.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Adds `value` at `p` to every quadrant on the way down to its leaf.
+    void record(vec2 p, float value)
+    {
+        uint32_t index = 0;
+        while (true)
+        {
+            int q = quadrant(p);
+            node &n = nodes[index];
+            atomic_add(n.sum[q], value);
+            if (n.child[q] == 0)
+                return;
+            index = n.child[q];
+        }
+    }
+
+    // A point of the unit square, and its density in `pdf`.
+    vec2 sample(double &pdf) const
+    {
+        double x0 = 0, y0 = 0, size = 1;
+        double numerator = 1, denominator = 1;
+        // One uniform number picks the quadrant at every level: what is left of it within the
+        // chosen quadrant's share is again uniform. The deep levels of a tree have few bits to
+        // spare, but those are the levels of concentrated energy, where the picks take few.
+        double u = random_double();
+        uint32_t index = 0;
+        while (true)
+        {
+            const node &n = nodes[index];
+            float sums[4];
+            double node_total = 0;
+            for (int q = 0; q < 4; q++)
+                node_total += sums[q] = n.sum[q].load(std::memory_order_relaxed);
+
+            int q = 0;
+            if (node_total > 0)
+            {
+                double r = u * node_total;
+                while (q < 3 && (r >= sums[q] || sums[q] <= 0))
+                    r -= sums[q++];
+                u = std::fmin(std::fmax(r / sums[q], 0.0), 1.0);
+                numerator *= 4 * sums[q];
+                denominator *= node_total;
+            }
+            else
+            {
+                q = std::min(int(u * 4), 3);
+                u = u * 4 - q;
+            }
+
+            size *= 0.5;
+            x0 += (q & 1) * size;
+            y0 += (q >> 1) * size;
+            if (n.child[q] == 0)
+            {
+                pdf = numerator / denominator;
+                return vec2(x0 + random_double() * size, y0 + random_double() * size);
+            }
+            index = n.child[q];
+        }
+    }
+
+    // Density of sample() at `p`, over the unit square.
+    double pdf(vec2 p) const
+    {
+        // The product of each level's 4 sum[q] / total, with a single division at the end.
+        double numerator = 1, denominator = 1;
+        uint32_t index = 0;
+        while (true)
+        {
+            const node &n = nodes[index];
+            float sums[4];
+            double node_total = 0;
+            for (int q = 0; q < 4; q++)
+                node_total += sums[q] = n.sum[q].load(std::memory_order_relaxed);
+
+            int q = quadrant(p);
+            if (node_total > 0)
+            {
+                numerator *= 4 * sums[q];
+                denominator *= node_total;
+            }
+            if (n.child[q] == 0 || numerator == 0)
+                return numerator / denominator;
+            index = n.child[q];
+        }
+    }
+
+    // An empty tree for the next pass, shaped by this one's energy: every quadrant holding more
+    // than `split_fraction` of the total is split (a quadrant this tree hasn't split yet is taken
+    // to spread its energy evenly) down to `max_depth` levels, and every other quadrant is left
+    // whole, so a subtree whose energy dried up collapses.
+    direction_tree refined(double split_fraction, int max_depth) const
+    {
+        direction_tree out;
+        double node_total = total();
+        if (node_total > 0)
+        {
+            float energy[4];
+            for (int q = 0; q < 4; q++)
+                energy[q] = nodes[0].sum[q].load(std::memory_order_relaxed);
+            out.refine_node(*this, &nodes[0], 0, energy, split_fraction * node_total, 1, max_depth);
+        }
+        return out;
+    }
+
+private:
+    struct node
+    {
+        std::atomic<float> sum[4];
+        uint32_t child[4] = {0, 0, 0, 0}; // 0 for none: the root is never a child
+
+        node()
+        {
+            for (auto &s : sum)
+                s.store(0, std::memory_order_relaxed);
+        }
+        node(const node &other) { *this = other; }
+        node &operator=(const node &other)
+        {
+            for (int q = 0; q < 4; q++)
+            {
+                sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                child[q] = other.child[q];
+            }
+            return *this;
+        }
+    };
+
+    std::vector<node> nodes; // Root first
+
+    // Quadrant of `p` (bit 0: right half, bit 1: top half), with `p` rescaled to that quadrant.
+    static int quadrant(vec2 &p)
+    {
+        double x = 2 * p[0], y = 2 * p[1];
+        int right = x >= 1, top = y >= 1;
+        p[0] = x - right;
+        p[1] = y - top;
+        return right | top << 1;
+    }
+
+    // Splits node `index` of this tree where `energy` is high: the sums of `source_node`, the
+    // matching node of `source`, or an even share of an unsplit quadrant's when that is null.
+    void refine_node(const direction_tree &source, const node *source_node, uint32_t index, const float energy[4],
+                     double threshold, int depth, int max_depth)
+    {
+        if (depth >= max_depth)
+            return;
+        for (int q = 0; q < 4; q++)
+        {
+            if (!(energy[q] > threshold))
+                continue;
+
+            const node *source_child =
+                source_node && source_node->child[q] != 0 ? &source.nodes[source_node->child[q]] : nullptr;
+            float child_energy[4];
+            for (int c = 0; c < 4; c++)
+                child_energy[c] = source_child ? source_child->sum[c].load(std::memory_order_relaxed) : energy[q] / 4;
+
+            auto child = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[index].child[q] = child;
+            refine_node(source, source_child, child, child_energy, threshold, depth + 1, max_depth);
+        }
+    }
+};
+
+// Learned incident light for path guiding (Mueller et al., "Practical Path Guiding"): a binary
+// tree over space, splitting its box in half along x, y, z in turn, with a direction_tree of
+// incident radiance at each leaf.
+//
+// Learning runs over passes of increasing sample count. During a pass each leaf samples from the
+// distribution learned by the last pass while recording into a second tree; refine() then makes
+// the recorded tree the one sampled next, and splits space and directions where enough was
+// recorded. Recording needs no locks: lookups only read the tree's shape, and records add to
+// atomic sums.
+class path_guide
+{
+public:
+    // One leaf's directional distributions.
+    class region
+    {
+    public:
+        // Whether anything has been learned here to sample from.
+        bool trained() const { return sampling_total > 0; }
+
+        // A unit direction drawn from the learned distribution, and its solid angle density in
+        // `pdf` (what pdf() would return for it).
+        vec3 sample(double &pdf) const
+        {
+            vec3 direction = square_to_direction(sampling.sample(pdf));
+            pdf /= 4 * pi;
+            return direction;
+        }
+
+        // Solid angle density of sample() drawing `direction` (any length).
+        double pdf(const vec3 &direction) const
+        {
+            return sampling.pdf(direction_to_square(unit_vector(direction))) / (4 * pi);
+        }
+
+        // Adds an estimate of the radiance arriving along `direction` (any length). Estimates of
+        // zero still count toward splitting the region.
+        void record(const vec3 &direction, double radiance)
+        {
+            records.fetch_add(1, std::memory_order_relaxed);
+            if (radiance > 0 && std::isfinite(radiance))
+                building.record(direction_to_square(unit_vector(direction)), float(radiance));
+        }
+
+    private:
+        friend class path_guide;
+
+        direction_tree sampling;             // Learned by the last pass, sampled in this one
+        direction_tree building;             // Recorded into during this pass
+        double sampling_total = 0;
+        std::atomic<uint32_t> records{0};    // This pass's
+
+        std::unique_ptr<region> clone() const
+        {
+            auto copy = std::make_unique<region>();
+            copy->sampling = sampling;
+            copy->building = building;
+            copy->sampling_total = sampling_total;
+            copy->records.store(records.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+            return copy;
+        }
+    };
+
+    // Guides paths through `bounds` (a world's bounding box). Points outside it fall into the
+    // nearest leaf; a box that isn't finite is never split.
+    explicit path_guide(const aabb &bounds) : box(bounds), nodes(1)
+    {
+        splittable = true;
+        for (int axis = 0; axis < 3; axis++)
+            splittable = splittable && std::isfinite(box.axis_interval(axis).min) &&
+                         std::isfinite(box.axis_interval(axis).max) && box.axis_interval(axis).size() >= 0;
+        regions.push_back(std::make_unique<region>());
+    }
+
+    region &region_at(const point3 &p)
+    {
+        int index = 0;
+        int depth = 0;
+        double low[3] = {box.x.min, box.y.min, box.z.min};
+        double high[3] = {box.x.max, box.y.max, box.z.max};
+        while (nodes[index].region < 0)
+        {
+            int axis = depth++ % 3;
+            double mid = 0.5 * (low[axis] + high[axis]);
+            bool upper = p[axis] >= mid;
+            (upper ? low : high)[axis] = mid;
+            index = nodes[index].child[upper];
+        }
+        return *regions[nodes[index].region];
+    }
+
+    size_t region_count() const { return regions.size(); }
+
+    // Ends learning pass number `pass` (0 for the first). Not thread-safe: call it between passes.
+    void refine(int pass)
+    {
+        // Split space where this pass recorded enough, guessing that each half gets half the
+        // records. Passes double in samples, so the threshold grows with sqrt(2^pass) to keep
+        // leaves gaining samples as they shrink.
+        const double split_records = 4000 * std::sqrt(std::pow(2.0, pass));
+        if (splittable)
+            split(0, 0, split_records);
+
+        for (auto &r : regions)
+        {
+            direction_tree next = r->building.refined(0.01, 20);
+            r->sampling = std::move(r->building);
+            r->sampling_total = r->sampling.total();
+            r->building = std::move(next);
+            r->records.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct node
+    {
+        int child[2] = {-1, -1};
+        int region = 0; // Index into `regions` for a leaf, -1 otherwise
+    };
+
+    aabb box;
+    bool splittable;
+    std::vector<node> nodes; // Root first
+    std::vector<std::unique_ptr<region>> regions;
+
+    void split(int index, int depth, double threshold)
+    {
+        if (nodes[index].region >= 0)
+        {
+            region &r = *regions[nodes[index].region];
+            if (depth >= 60 || r.records.load(std::memory_order_relaxed) <= threshold)
+                return;
+
+            // The children start from copies of this leaf's trees; the left one reuses its slot.
+            int left = int(nodes.size()), right = left + 1;
+            nodes.resize(nodes.size() + 2);
+            nodes[left].region = nodes[index].region;
+            nodes[right].region = int(regions.size());
+            regions.push_back(r.clone());
+            r.records.store(r.records.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+            nodes[index].region = -1;
+            nodes[index].child[0] = left;
+            nodes[index].child[1] = right;
+        }
+        // By index: split() grows `nodes`.
+        int left = nodes[index].child[0], right = nodes[index].child[1];
+        split(left, depth + 1, threshold);
+        split(right, depth + 1, threshold);
+    }
+};
+
+#endif
@@ -1,46 +1,51 @@
 #ifndef PDF_H
 #define PDF_H
 
+#include "environment_light.h"
 #include "hittable_list.h"
 #include "onb.h"
 
-class pdf
-{
-public:
-    virtual ~pdf() {}
+// Sampling distributions over directions. Each is a small value type with
+//     double value(const vec3& direction) const;
+//     vec3 generate() const;
+// and none of them allocate, so they can live on the stack of a path vertex.
 
-    virtual double value(const vec3& direction) const = 0;
-    virtual vec3 generate() const = 0;
-};
+// Multiple importance sampling weight of a sample drawn with density `pdf` when another
+// strategy could have drawn it with density `other_pdf`; the weights of the two sum to 1.
+inline double power_heuristic(double pdf, double other_pdf)
+{
+    double a = pdf * pdf, b = other_pdf * other_pdf;
+    return a + b > 0 ? a / (a + b) : 0.0;
+}
 
-class sphere_pdf : public pdf
+class sphere_pdf
 {
 public:
     sphere_pdf() {}
 
-    double value(const vec3& direction) const override
+    double value(const vec3& direction) const
     {
         return 1 / (4 * pi);
     }
 
-    vec3 generate() const override
+    vec3 generate() const
     {
         return random_unit_vector();
     }
 };
 
-class cosine_pdf : public pdf
+class cosine_pdf
 {
 public:
     cosine_pdf(const vec3& w) : uvw(w) {}
 
-    double value(const vec3& direction) const override
+    double value(const vec3& direction) const
     {
         auto cos_theta = dot(unit_vector(direction), uvw.w());
         return std::fmax(0, cos_theta / pi);
     }
 
-    vec3 generate() const override
+    vec3 generate() const
     {
         return uvw.transform(random_cos_direction());
     }
@@ -49,17 +54,17 @@ private:
     onb uvw;
 };
 
-class ggx_pdf : public pdf
+// GGX visible normal sampling. Unlike the others this works in the local space of a shading
+// frame whose z axis is the normal; `wi_local` is the unit direction toward the viewer there,
+// and directions passed to or returned from it are local too.
+class ggx_pdf
 {
 public:
-    ggx_pdf(const vec3& normal, const vec3& view_dir, double alpha_x, double alpha_y) 
-        : uvw(normal), alpha_x(alpha_x), alpha_y(alpha_y)
-    {
-        // Transform view direction to local space (aligned with normal)
-        wi_local = uvw.local(-view_dir);  // Negate because view_dir points toward surface
-    }
+    ggx_pdf(const vec3& wi_local, double alpha_x, double alpha_y)
+        : wi_local(wi_local), alpha_x(alpha_x), alpha_y(alpha_y)
+    {}
 
-    vec3 generate() const override
+    vec3 generate() const
     {
         double r1 = random_double();
         double r2 = random_double();
@@ -68,28 +73,25 @@ public:
 
         double wi_dot_h = dot(wi_local, h_local);
 
-        vec3 wo_local = 2.0 * wi_dot_h * h_local - wi_local;
-
-        vec3 wo = uvw.world(wo_local);
-
-        return wo;
+        return 2.0 * wi_dot_h * h_local - wi_local;
     }
 
-    double value(const vec3& direction) const override
+    double value(const vec3& direction) const
     {
-        vec3 wo_local = uvw.local(unit_vector(direction));
+        vec3 wo_local = unit_vector(direction);
 
         vec3 h_local = unit_vector(wo_local + wi_local);
 
         double wi_dot_h = dot(wi_local, h_local);
+        if (wi_local.z() <= 0.0 || h_local.z() <= 0.0 || wi_dot_h <= 0.0)
+            return 0.0;
 
+        // Visible normals have density G1(wi) (wi.h) D(h) / wi.z, and reflecting about h
+        // divides that by 4 (wo.h), which equals wi.h.
         double D = ggx_D(h_local, alpha_x, alpha_y);
         double G = smith_G1(wi_local, alpha_x, alpha_y);
-        double DV = D * G;
 
-        double pdf_value = DV / (4.0 * wi_dot_h * wi_dot_h);
-
-        return std::max(0.0, pdf_value);
+        return D * G / (4.0 * wi_local.z());
     }
     
     // GGX normal distribution function
@@ -125,7 +127,6 @@ public:
     }
 
 private:
-    onb uvw;
     vec3 wi_local;  // Incoming direction in local space
     double alpha_x;
     double alpha_y;
@@ -144,9 +145,10 @@ private:
         
         // Section 4.2: parameterization of the projected area
         double r = std::sqrt(r1);
-        double phi = 2.0 * pi * r2;
-        double t1 = r * std::cos(phi);
-        double t2 = r * std::sin(phi);
+        double sin_phi, cos_phi;
+        fast_sin_cos(2.0 * pi * r2, sin_phi, cos_phi);
+        double t1 = r * cos_phi;
+        double t2 = r * sin_phi;
         double s = 0.5 * (1.0 + Vh.z());
         t2 = (1.0 - s) * std::sqrt(std::max(0.0, 1.0 - t1*t1)) + s * t2;
         
@@ -160,19 +162,19 @@ private:
 
 };
 
-class hittable_pdf : public pdf
+class hittable_pdf
 {
 public:
     hittable_pdf(const hittable& object, const point3& origin)
     : object(object), origin(origin)
     {}
 
-    double value(const vec3& direction) const override 
+    double value(const vec3& direction) const 
     {
         return object.pdf_value(origin, direction);
     }
 
-    vec3 generate() const override
+    vec3 generate() const
     {
        return object.random(origin);
     }
@@ -182,29 +184,62 @@ private:
     point3 origin;
 };
 
-class mixture_pdf : public pdf
+// Directions toward the scene's light sources: the light list, the environment, or an even mix
+// of the two when there are both. Either may be null.
+class light_pdf
 {
 public:
-    mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1)
+    light_pdf(const hittable *lights, const environment_light *environment, const point3 &origin)
+        : lights(lights), environment(environment), origin(origin),
+          environment_share(!environment ? 0.0 : lights ? 0.5 : 1.0)
+    {}
+
+    double value(const vec3 &direction) const
+    {
+        double pdf = 0;
+        if (lights)
+            pdf += (1 - environment_share) * lights->pdf_value(origin, direction);
+        if (environment)
+            pdf += environment_share * environment->pdf(direction);
+        return pdf;
+    }
+
+    vec3 generate() const
     {
-        p[0] = p0;
-        p[1] = p1;
+        if (environment && random_double() < environment_share)
+            return environment->sample();
+        return lights->random(origin);
     }
 
-    double value(const vec3& direction) const override
+private:
+    const hittable *lights;
+    const environment_light *environment;
+    point3 origin;
+    double environment_share; // Chance of sampling the environment
+};
+
+// An even mix of two distributions, which it refers to rather than copies.
+template <typename Pdf0, typename Pdf1>
+class mixture_pdf
+{
+public:
+    mixture_pdf(const Pdf0& p0, const Pdf1& p1) : p0(p0), p1(p1) {}
+
+    double value(const vec3& direction) const
     {
-        return 0.5 * p[0]->value(direction) + 0.5 * p[1]->value(direction);
+        return 0.5 * p0.value(direction) + 0.5 * p1.value(direction);
     }
 
-    vec3 generate() const override {
+    vec3 generate() const {
         if (random_double() < 0.5)
-            return p[0]->generate();
+            return p0.generate();
         else
-            return p[1]->generate();
+            return p1.generate();
     }
 
 private:
-    shared_ptr<pdf> p[2];
+    const Pdf0& p0;
+    const Pdf1& p1;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,8 @@
 #ifndef PERLIN_H
 #define PERLIN_H
 
+#include <sstream>
+
 #include "rtweekend.h"
 
 class perlin
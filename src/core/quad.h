@@ -8,7 +8,7 @@
 class quad : public hittable {
 public:
     quad(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat)
-      : Q(Q), u(u), v(v), mat(mat)
+      : Q(Q), u(u), v(v), mat(material_table::global().add(mat))
     {
         auto n = cross(u, v);
         normal = unit_vector(n);
@@ -29,6 +29,11 @@ public:
 
     aabb bounding_box() const override { return bbox; }
 
+    shared_ptr<hittable> transformed_copy(const rigid_transform &to_world) const override
+    {
+        return make_shared<quad>(to_world.point(Q), to_world.vector(u), to_world.vector(v), material_table::global().owner(mat));
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override 
     {
         auto denom = dot(normal, r.direction());
@@ -52,21 +57,29 @@ public:
             return false;
 
         rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
+        rec.prim = this;
 
         return true;
     }
 
+    void surface(const ray& r, hit_record& rec) const override
+    {
+        rec.p = r.at(rec.t);
+        rec.u = rec.b0;
+        rec.v = rec.b1;
+        rec.uv_density = 1 / std::sqrt(area); // The unit uv square covers the whole quad
+        rec.mat = mat;
+        rec.set_face_normal(r, normal);
+    }
+
     virtual bool is_interior(double a, double b, hit_record& rec) const {
         interval unit_interval = interval(0, 1);
 
         if (!unit_interval.contains(a) || !unit_interval.contains(b))
             return false;
 
-        rec.u = a;
-        rec.v = b;
+        rec.b0 = a;
+        rec.b1 = b;
         return true;
     }
 
@@ -77,7 +90,7 @@ public:
             return 0.0;
 
         auto distance_squared = rec.t * rec.t * direction.length_squared();
-        auto cosine = std::fabs(dot(direction, rec.normal)) / direction.length();
+        auto cosine = std::fabs(dot(direction, normal)) / direction.length();
 
         return distance_squared / (cosine * area);
     }
@@ -87,17 +100,22 @@ public:
         return p - origin;
     }
 
+    double surface_area() const override { return area; }
+    material_id surface_material() const override { return mat; }
+
 private:
     point3 Q;
     vec3 u, v;
     vec3 w;
-    shared_ptr<material> mat;
+    material_id mat;
     aabb bbox;
     vec3 normal;
     double D;
     double area;
 };
 
+// Box as a list of six independent quads. For solid boxes, oriented_box (oriented_box.h) is
+// cheaper to intersect and carries its own rotation and offset.
 inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat)
 {
     auto sides = make_shared<hittable_list>();
@@ -2,6 +2,7 @@
 #define RAY_H
 
 #include "vec3.h"
+#include "vec3f.h"
 
 class ray
 {
@@ -9,7 +10,9 @@ public:
   ray() {}
 
   ray(const point3 &origin, const vec3 &direction, double time)
-      : orig(origin), dir(direction), tm(time) {}
+      : orig(origin), dir(direction), tm(time),
+        orig_g(origin),
+        inv_dir_g(geom_real(1.0 / direction[0]), geom_real(1.0 / direction[1]), geom_real(1.0 / direction[2])) {}
 
   ray(const point3 &origin, const vec3 &direction)
       : ray(origin, direction, 0) {}
@@ -19,15 +22,35 @@ public:
 
   double time() const { return tm; }
 
+  // Origin and reciprocal direction in geometry precision, computed once per ray for the
+  // BVH slab tests and mesh kernels.
+  const geom_vec3 &origin_g() const { return orig_g; }
+  const geom_vec3 &inv_direction_g() const { return inv_dir_g; }
+
   point3 at(double t) const
   {
     return orig + t * dir;
   }
 
+  // Ray cone for texture filtering: the cone's width at the origin and its spread angle in
+  // radians, so it is about `width + spread * distance` wide after travelling `distance`.
+  void set_cone(double width, double spread)
+  {
+    cone_w = width;
+    cone_s = spread;
+  }
+
+  double cone_spread() const { return cone_s; }
+  double cone_width_at(double t) const { return cone_w + cone_s * t * dir.length(); }
+
 private:
   point3 orig;
   vec3 dir;
   double tm;
+  geom_vec3 orig_g;
+  geom_vec3 inv_dir_g;
+  double cone_w = 0;
+  double cone_s = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -12,90 +12,144 @@
 #include "../external/stb_image.h"
 
 #include <cstdlib>
+#include <filesystem>
 #include <iostream>
+#include <limits>
+#include <string>
+
+#include "mapped_file.h"
+#include "texel_format.h"
 
 class rtw_image
 {
 public:
     rtw_image() {}
 
-    rtw_image(const char *image_filename)
+    // Loads the image keeping only `format` texels: 8-bit sources stay 3 bytes per texel as
+    // sRGB, and HDR sources are decoded straight to half or float. If the image was not found
+    // (see find()) or not loaded successfully, width() and height() will return 0.
+    rtw_image(const char *image_filename, texel_format format = texel_format::srgb8) : storage(format)
     {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+        auto path = find(image_filename);
+        if (path.empty() || !load(path))
+            std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+    }
+
+    // Decodes an image file already read into memory.
+    rtw_image(const unsigned char *bytes, size_t size, texel_format format = texel_format::srgb8) : storage(format)
+    {
+        load_from_memory(bytes, size);
+    }
 
+    rtw_image(const rtw_image &) = delete;
+    rtw_image &operator=(const rtw_image &) = delete;
+
+    ~rtw_image() { STBI_FREE(texels); }
+
+    // Path of the image file, or an empty string if there is none. If the RTW_IMAGES environment
+    // variable is defined, looks only in that directory for the image file. Otherwise searches
+    // for the specified image file first from the current directory, then in the images/
+    // subdirectory, then the _parent's_ images/ subdirectory, and then _that_ parent, on so on,
+    // for six levels up.
+    static std::string find(const char *image_filename)
+    {
         auto filename = std::string(image_filename);
         auto imagedir = getenv("RTW_IMAGES");
+        if (imagedir)
+        {
+            auto path = std::string(imagedir) + "/" + filename;
+            return std::filesystem::is_regular_file(path) ? path : std::string();
+        }
 
         // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename))
-            return;
-        if (load(filename))
-            return;
-        if (load("images/" + filename))
-            return;
-        if (load("../images/" + filename))
-            return;
-        if (load("../../images/" + filename))
-            return;
-        if (load("../../../images/" + filename))
-            return;
-        if (load("../../../../images/" + filename))
-            return;
-        if (load("../../../../../images/" + filename))
-            return;
-        if (load("../../../../../../images/" + filename))
-            return;
-
-        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+        std::string prefix;
+        if (std::filesystem::is_regular_file(filename))
+            return filename;
+        for (int up = 0; up <= 6; up++, prefix += "../")
+        {
+            auto path = prefix + "images/" + filename;
+            if (std::filesystem::is_regular_file(path))
+                return path;
+        }
+        return std::string();
     }
 
-    ~rtw_image()
+    bool load(const std::string &filename)
     {
-        delete[] bdata;
-        STBI_FREE(fdata);
+        mapped_file file;
+        return file.open(filename) &&
+               load_from_memory(reinterpret_cast<const unsigned char *>(file.data()), file.size());
     }
 
-    bool load(const std::string &filename)
+    bool load_from_memory(const unsigned char *bytes, size_t size)
     {
-        auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+        STBI_FREE(texels);
+        texels = nullptr;
+        if (size == 0 || size > size_t(std::numeric_limits<int>::max()))
+            return false;
+
+        auto length = int(size);
+        auto n = channels; // Dummy out parameter: original components per pixel
+        if (storage == texel_format::srgb8)
+        {
+            // stb_image hands back an 8-bit file's own (sRGB) bytes, so nothing is converted.
+            texels = stbi_load_from_memory(bytes, length, &image_width, &image_height, &n, channels);
+            return texels != nullptr;
+        }
+
+        float *fdata = stbi_is_hdr_from_memory(bytes, length)
+                           ? stbi_loadf_from_memory(bytes, length, &image_width, &image_height, &n, channels)
+                           : load_srgb_as_linear(bytes, length);
         if (fdata == nullptr)
             return false;
 
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
-        return true;
+        if (storage == texel_format::float32)
+        {
+            texels = reinterpret_cast<unsigned char *>(fdata);
+            return true;
+        }
+
+        convert_to_half(fdata);
+        STBI_FREE(fdata);
+        return texels != nullptr;
     }
 
-    int width() const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width() const { return (texels == nullptr) ? 0 : image_width; }
+    int height() const { return (texels == nullptr) ? 0 : image_height; }
+    texel_format format() const { return storage; }
+    size_t memory_bytes() const { return texels ? size_t(image_width) * image_height * texel_bytes(storage) : 0; }
+
+    // Tightly packed rows of `format()` texels; null if the image didn't load.
+    const unsigned char *data() const { return texels; }
 
     const unsigned char *pixel_data(int x, int y) const
     {
-        // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
-        // data, returns magenta.
-        static unsigned char magneta[] = {255, 0, 255};
-        if (bdata == nullptr)
-            return magneta;
+        // Return the address of the texel at x,y, in `format()`. If there is no image data,
+        // returns magenta.
+        static const float magenta_float[] = {1, 0, 1};
+        static const uint16_t magenta_half[] = {0x3c00, 0, 0x3c00};
+        static const unsigned char magenta_srgb8[] = {255, 0, 255};
+        if (texels == nullptr)
+        {
+            if (storage == texel_format::float32)
+                return reinterpret_cast<const unsigned char *>(magenta_float);
+            if (storage == texel_format::half)
+                return reinterpret_cast<const unsigned char *>(magenta_half);
+            return magenta_srgb8;
+        }
 
         x = clamp(x, 0, image_width);
         y = clamp(y, 0, image_height);
 
-        return bdata + y * bytes_per_scanline + x * bytes_per_pixel;
+        return texels + (size_t(y) * image_width + x) * texel_bytes(storage);
     }
 
 private:
-    const int bytes_per_pixel = 3;
-    float *fdata = nullptr;         // Linear floating point pixel data
-    unsigned char *bdata = nullptr; // Linear 8-bit pixel data
-    int image_width = 0;            // Loaded image width
-    int image_height = 0;           // Loaded image height
-    int bytes_per_scanline = 0;
+    static constexpr int channels = 3;
+    texel_format storage = texel_format::srgb8;
+    unsigned char *texels = nullptr; // Pixel data in `storage` format, from STBI_MALLOC
+    int image_width = 0;             // Loaded image width
+    int image_height = 0;            // Loaded image height
 
     static int clamp(int x, int low, int high)
     {
@@ -107,30 +161,32 @@ private:
         return high - 1;
     }
 
-    static unsigned char float_to_byte(float value)
+    float *load_srgb_as_linear(const unsigned char *encoded, int length)
     {
-        if (value <= 0.0)
-            return 0;
-        if (1.0 <= value)
-            return 255;
-        return static_cast<unsigned char>(256.0 * value);
+        // Decodes an 8-bit file with the same sRGB curve the srgb8 format uses (stb_image's own
+        // float conversion assumes a plain 2.2 gamma), so all formats agree.
+        auto n = channels;
+        unsigned char *bytes = stbi_load_from_memory(encoded, length, &image_width, &image_height, &n, channels);
+        if (bytes == nullptr)
+            return nullptr;
+
+        size_t count = size_t(image_width) * image_height * channels;
+        auto *fdata = static_cast<float *>(STBI_MALLOC(count * sizeof(float)));
+        if (fdata != nullptr)
+            for (size_t i = 0; i < count; i++)
+                fdata[i] = srgb8_to_linear(bytes[i]);
+        STBI_FREE(bytes);
+        return fdata;
     }
 
-    void convert_to_bytes()
+    void convert_to_half(const float *fdata)
     {
-        // Convert the linear floating point pixel data to bytes, storing the resulting byte
-        // data in the `bdata` member.
-
-        int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
-
-        // Iterate through all pixel components, converting from [0.0, 1.0] float values to
-        // unsigned [0, 255] byte values.
-
-        auto *bptr = bdata;
-        auto *fptr = fdata;
-        for (auto i = 0; i < total_bytes; i++, fptr++, bptr++)
-            *bptr = float_to_byte(*fptr);
+        // Convert the linear floating point pixel data to halves, storing the result in the
+        // `texels` member.
+        size_t count = size_t(image_width) * image_height * channels;
+        texels = static_cast<unsigned char *>(STBI_MALLOC(count * sizeof(uint16_t)));
+        if (texels != nullptr)
+            ::convert_to_half(fdata, reinterpret_cast<uint16_t *>(texels), count);
     }
 };
 
@@ -35,9 +35,9 @@ inline double random_double()
 
 inline double random_double(double min, double max)
 {
-    thread_local static std::mt19937 generator(std::random_device{}());
-    thread_local static std::uniform_real_distribution<double> distribution(min, max);
-    return distribution(generator);
+    // Returns a random real in [min,max). Scales the shared [0,1) stream rather than keeping
+    // a distribution per call site, whose bounds would be frozen at the first call.
+    return min + (max - min) * random_double();
 }
 
 inline int random_int(int min, int max)
@@ -53,15 +53,17 @@ inline int random_int(int min, int max)
 #include "ray.h"
 #include "vec3.h"
 #include "vec2.h"
+#include "fast_math.h"
 
 inline vec3 random_cos_direction()
 {
     auto r1 = random_double();
     auto r2 = random_double();
 
-    auto phi = 2*pi*r1;
-    auto x = std::cos(phi) * std::sqrt(r2);
-    auto y = std::sin(phi) * std::sqrt(r2);
+    double sin_phi, cos_phi;
+    fast_sin_cos(2*pi*r1, sin_phi, cos_phi);
+    auto x = cos_phi * std::sqrt(r2);
+    auto y = sin_phi * std::sqrt(r2);
     auto z = std::sqrt(1-r2);
 
     return vec3(x, y, z);
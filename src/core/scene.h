@@ -0,0 +1,106 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "light_sampler.h"
+
+// A world, the objects to sample as lights, and the camera to render them with.
+//
+// Objects are added freely, in any nesting of lists and transforms. `commit()` then compiles
+// the world for rendering, and `render()` commits first if the world or the lights changed since
+// (or were never committed), so a scene never ends up intersecting a plain list of objects one
+// by one or sampling stale lights.
+class scene
+{
+public:
+    hittable_list world;
+    hittable_list lights;
+    camera cam;
+    light_selection light_selection_mode = light_selection::tree; // Read by commit()
+
+    // Compiles `world` and `lights`:
+    //  - nested hittable_lists are spliced into their parents;
+    //  - each chain of `translate`/`rotate_y` wrappers collapses into one rigid transform;
+    //  - primitives that can bake that transform (quads, triangles, boxes, spheres that are
+    //    only moved) are replaced by world-space copies, and everything else gets a single
+    //    `transformed` wrapper;
+    //  - the world's objects are put in a BVH, and the lights in a light_sampler.
+    // Objects added after a commit are compiled by the next one.
+    void commit()
+    {
+        hittable_list flat_world;
+        for (const auto &object : flatten(world))
+            flat_world.add(object);
+
+        world = hittable_list();
+        if (flat_world.objects.size() == 1)
+            world.add(flat_world.objects[0]);
+        else if (!flat_world.objects.empty())
+            world.add(make_shared<bvh_node>(flat_world));
+
+        hittable_list flat_lights;
+        for (const auto &object : flatten(lights))
+            flat_lights.add(object);
+        lights = flat_lights;
+        sampler = make_shared<light_sampler>(lights, light_selection_mode);
+
+        committed = true;
+        committed_world = world.objects;
+        committed_lights = lights.objects;
+    }
+
+    void render()
+    {
+        // Adding to either list or replacing it changes its top-level objects.
+        if (!committed || world.objects != committed_world || lights.objects != committed_lights)
+            commit();
+        cam.render(world, *sampler);
+    }
+
+    // What the camera samples lights from, as of the last commit.
+    const light_sampler &light_set() const { return *sampler; }
+
+private:
+    bool committed = false;
+    std::vector<shared_ptr<hittable>> committed_world;  // `world.objects` after the last commit
+    std::vector<shared_ptr<hittable>> committed_lights; // `lights.objects` after the last commit
+    shared_ptr<light_sampler> sampler = make_shared<light_sampler>();
+
+    static std::vector<shared_ptr<hittable>> flatten(const hittable_list &list)
+    {
+        std::vector<shared_ptr<hittable>> out;
+        for (const auto &object : list.objects)
+            flatten(object, rigid_transform(), out);
+        return out;
+    }
+
+    static void flatten(const shared_ptr<hittable> &object, const rigid_transform &to_world,
+                        std::vector<shared_ptr<hittable>> &out)
+    {
+        if (auto list = std::dynamic_pointer_cast<hittable_list>(object))
+        {
+            for (const auto &child : list->objects)
+                flatten(child, to_world, out);
+        }
+        else if (auto wrapper = std::dynamic_pointer_cast<translate>(object))
+            flatten(wrapper->child(), to_world * wrapper->to_world(), out);
+        else if (auto wrapper = std::dynamic_pointer_cast<rotate_y>(object))
+            flatten(wrapper->child(), to_world * wrapper->to_world(), out);
+        else if (auto wrapper = std::dynamic_pointer_cast<transformed>(object))
+            flatten(wrapper->child(), to_world * wrapper->to_world(), out);
+        else if (to_world.is_identity())
+            out.push_back(object);
+        else if (auto baked = object->transformed_copy(to_world))
+            out.push_back(baked);
+        else
+            out.push_back(make_shared<transformed>(object, to_world));
+    }
+};
+
+#endif
@@ -0,0 +1,665 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mesh_cache.h"
+#include "oriented_box.h"
+#include "quad.h"
+#include "scene.h"
+#include "sphere.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
+
+// Loads a text scene file. Each line holds one statement; `#` starts a comment. Names must be
+// defined before they are used, and relative paths are taken from the scene file's directory.
+//
+//   camera [width N] [aspect A] [spp N] [depth N] [vfov DEG] [background R G B]
+//          [lookfrom X Y Z] [lookat X Y Z] [up X Y Z] [defocus ANGLE FOCUS_DIST]
+//          [guiding PASSES]                      (path guiding; see camera::guiding_passes)
+//
+//   environment PATH [SCALE]                     (latitude-longitude image, sampled as a light;
+//                                                 HDR files keep their range)
+//
+//   texture_cache MEGABYTES                      (stream image textures; see texture_cache)
+//
+//   texture NAME solid R G B
+//   texture NAME checker SCALE EVEN ODD          (EVEN, ODD: texture name or R G B)
+//   texture NAME image PATH [srgb8|half|float]  (texel storage; default srgb8)
+//   texture NAME noise SCALE [R G B] [bake SAMPLES X0 Y0 Z0 X1 Y1 Z1]
+//   texture NAME turbulence SCALE [R G B] [bake SAMPLES X0 Y0 Z0 X1 Y1 Z1]
+//                                                (bake: see noise_texture::bake)
+//
+//   material NAME lambertian ALBEDO              (ALBEDO: texture name or R G B)
+//   material NAME metal R G B FUZZ
+//   material NAME dielectric INDEX
+//   material NAME glossy R G B ROUGHNESS [METALLIC]
+//   material NAME light EMIT                     (EMIT: texture name or R G B)
+//   material NAME isotropic ALBEDO
+//   material NAME iridescent BASE STRENGTH
+//
+//   sphere X Y Z RADIUS MATERIAL
+//   moving_sphere X0 Y0 Z0 X1 Y1 Z1 RADIUS MATERIAL
+//   quad QX QY QZ UX UY UZ VX VY VZ MATERIAL
+//   box AX AY AZ BX BY BZ MATERIAL [rotate_y DEG] [translate X Y Z]
+//   mesh PATH MATERIAL [rotate_y DEG] [translate X Y Z]
+//
+// A primitive prefixed with `light` is added to the world and to the light list; one prefixed
+// with `sample` is only added to the light list. MATERIAL may be `none` on `sample` shapes only,
+// which are never hit. Mesh materials named by the OBJ file's `usemtl` records are looked up among
+// the scene's materials, with MATERIAL used for the rest.
+//
+// Image textures and meshes are independent of each other, so they are all loaded in parallel
+// (images by the texture_registry, meshes and their BVH builds on a thread pool) before
+// anything else is built. Startup then takes about as long as the largest asset rather than the
+// sum of all of them.
+class scene_file
+{
+public:
+    // Adds the contents of `path` to `target`, using `num_threads` loader threads (0: one per
+    // hardware thread). Reports the first error to std::cerr as `file:line: message` and
+    // returns false.
+    static bool load(const std::string &path, scene &target, int num_threads = 0)
+    {
+        scene_file file(path);
+        return file.read() && file.load_assets(num_threads) && file.build(target);
+    }
+
+private:
+    struct statement
+    {
+        int line;
+        std::vector<std::string> tokens;
+    };
+
+    std::string path;
+    std::filesystem::path directory;
+    std::vector<statement> statements;
+
+    // Assets loaded on the pool, keyed by their resolved paths (see image_key).
+    std::unordered_map<std::string, std::shared_future<shared_ptr<texture>>> images;
+    std::unordered_map<std::string, std::shared_future<shared_ptr<triangle_mesh>>> meshes;
+
+    shared_ptr<texture_cache> cache; // Set by a `texture_cache` statement
+
+    std::unordered_map<std::string, shared_ptr<texture>> textures;
+    std::unordered_map<std::string, shared_ptr<material>> materials;
+
+    // Cursor over the statement being built.
+    const statement *current = nullptr;
+    size_t next = 0;
+
+    explicit scene_file(const std::string &path)
+        : path(path), directory(std::filesystem::path(path).parent_path()) {}
+
+    bool read()
+    {
+        std::ifstream in(path);
+        if (!in.is_open())
+        {
+            std::cerr << "Failed to open scene file: " << path << "\n";
+            return false;
+        }
+
+        std::string text;
+        for (int line = 1; std::getline(in, text); line++)
+        {
+            auto comment = text.find('#');
+            if (comment != std::string::npos)
+                text.erase(comment);
+
+            statement s{line, {}};
+            std::istringstream words(text);
+            for (std::string word; words >> word;)
+                s.tokens.push_back(word);
+            if (!s.tokens.empty())
+                statements.push_back(std::move(s));
+        }
+        return true;
+    }
+
+    std::string resolve_path(const std::string &relative) const
+    {
+        std::filesystem::path p(relative);
+        if (p.is_absolute())
+            return relative;
+        // Image textures fall back to rtw_image's own search of the images/ directories.
+        auto local = directory / p;
+        return std::filesystem::exists(local) ? local.string() : relative;
+    }
+
+    // The same file may be loaded in several texel formats. Streamed images always use the
+    // texture cache's sRGB8 tiles.
+    std::string image_key(const std::string &file, texel_format format) const
+    {
+        return cache ? file : file + "#" + std::to_string(int(format));
+    }
+
+    // Starts every image and mesh load on the pool and waits for all of them.
+    bool load_assets(int num_threads)
+    {
+        for (const auto &s : statements)
+        {
+            current = &s;
+            next = 1;
+            double megabytes;
+            if (s.tokens[0] == "texture_cache" && !cache)
+            {
+                if (!read_number(megabytes))
+                    return false;
+                cache = make_shared<texture_cache>(size_t(std::max(megabytes, 0.0) * 1024 * 1024));
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            thread_pool pool(num_threads);
+            for (const auto &s : statements)
+            {
+                const auto &t = s.tokens;
+                texel_format format = texel_format::srgb8;
+                if (t.size() >= 4 && t[0] == "texture" && t[2] == "image" &&
+                    (t.size() < 5 || parse_texel_format(t[4], format)))
+                {
+                    auto file = resolve_path(t[3]);
+                    auto key = image_key(file, format);
+                    if (images.count(key))
+                        continue;
+                    if (cache)
+                    {
+                        images[key] = pool.submit([file, cache = cache]() -> shared_ptr<texture>
+                                                  {
+                                                      // Solid cyan like image_texture when the file can't be read.
+                                                      auto img = cache->add(file);
+                                                      if (!img)
+                                                          return make_shared<solid_color>(0, 1, 1);
+                                                      return make_shared<cached_image_texture>(cache, img);
+                                                  })
+                                          .share();
+                    }
+                    else
+                    {
+                        // The registry decodes on its own threads, alongside the meshes here.
+                        auto image = texture_registry::global().load(file, format);
+                        images[key] = std::async(std::launch::deferred, [image]() -> shared_ptr<texture>
+                                                 {
+                                                     image.wait();
+                                                     return make_shared<image_texture>(image);
+                                                 })
+                                          .share();
+                    }
+                }
+
+                size_t first = (t[0] == "light" || t[0] == "sample") ? 1 : 0;
+                if (t.size() >= first + 2 && t[first] == "mesh")
+                {
+                    auto file = resolve_path(t[first + 1]);
+                    if (!meshes.count(file))
+                        meshes[file] = pool.submit([file]() { return load_obj_mesh(file, nullptr); }).share();
+                }
+            }
+        }
+
+        for (const auto &[key, image] : images)
+            image.wait();
+
+        size_t triangles = 0;
+        for (const auto &[file, mesh] : meshes)
+        {
+            if (!mesh.get())
+            {
+                std::cerr << path << ": could not load mesh " << file << "\n";
+                return false;
+            }
+            triangles += mesh.get()->triangle_count();
+        }
+
+        if (!images.empty() || !meshes.empty())
+        {
+            auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+            std::clog << "Loaded " << images.size() << " images and " << meshes.size() << " meshes (" << triangles
+                      << " triangles) in " << elapsed.count() << " ms";
+            if (cache && !images.empty())
+                std::clog << ", images streamed through a " << std::lround(cache->stats().budget_bytes / (1024.0 * 1024.0))
+                          << " MB texture cache";
+            std::clog << "\n";
+        }
+        return true;
+    }
+
+    bool build(scene &target)
+    {
+        for (const auto &s : statements)
+        {
+            current = &s;
+            next = 1;
+            const auto &keyword = s.tokens[0];
+
+            bool ok;
+            if (keyword == "camera")
+                ok = parse_camera(target.cam);
+            else if (keyword == "environment")
+                ok = parse_environment(target.cam);
+            else if (keyword == "texture")
+                ok = parse_texture();
+            else if (keyword == "material")
+                ok = parse_material();
+            else if (keyword == "texture_cache")
+            {
+                next = s.tokens.size(); // Read by load_assets
+                ok = true;
+            }
+            else
+            {
+                bool add_to_world = keyword != "sample";
+                bool add_to_lights = keyword == "light" || keyword == "sample";
+                if (!add_to_lights)
+                    next = 0;
+
+                shared_ptr<hittable> object;
+                ok = parse_primitive(object, !add_to_world);
+                if (ok && add_to_world)
+                    target.world.add(object);
+                if (ok && add_to_lights)
+                    target.lights.add(object);
+            }
+
+            if (!ok)
+                return false;
+            if (next != s.tokens.size())
+                return error("unexpected '" + s.tokens[next] + "'");
+        }
+        return true;
+    }
+
+    bool parse_camera(camera &cam)
+    {
+        while (next < current->tokens.size())
+        {
+            const auto &key = current->tokens[next++];
+            bool ok;
+            if (key == "width")
+                ok = read_int(cam.width);
+            else if (key == "aspect")
+                ok = read_number(cam.ar);
+            else if (key == "spp")
+                ok = read_int(cam.samples_per_pixel);
+            else if (key == "depth")
+                ok = read_int(cam.max_depth);
+            else if (key == "vfov")
+                ok = read_number(cam.vfov);
+            else if (key == "background")
+                ok = read_vec3(cam.background);
+            else if (key == "lookfrom")
+                ok = read_vec3(cam.lookfrom);
+            else if (key == "lookat")
+                ok = read_vec3(cam.lookat);
+            else if (key == "up")
+                ok = read_vec3(cam.vup);
+            else if (key == "defocus")
+                ok = read_number(cam.defocus_angle) && read_number(cam.focus_dist);
+            else if (key == "guiding")
+                ok = read_int(cam.guiding_passes);
+            else
+                return error("unknown camera setting '" + key + "'");
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
+    bool parse_environment(camera &cam)
+    {
+        std::string file;
+        double scale = 1;
+        if (!read_word(file))
+            return false;
+        if (next < current->tokens.size() && !read_number(scale))
+            return false;
+
+        rtw_image image(resolve_path(file).c_str(), texel_format::float32);
+        if (image.width() == 0)
+            return error("could not load environment '" + file + "'");
+        cam.environment = make_shared<environment_light>(image, scale);
+        return true;
+    }
+
+    bool parse_texture()
+    {
+        std::string name, kind;
+        if (!read_word(name) || !read_word(kind))
+            return false;
+
+        shared_ptr<texture> tex;
+        if (kind == "solid")
+        {
+            color c;
+            if (!read_vec3(c))
+                return false;
+            tex = make_shared<solid_color>(c);
+        }
+        else if (kind == "checker")
+        {
+            double scale;
+            shared_ptr<texture> even, odd;
+            if (!read_number(scale) || !read_texture(even) || !read_texture(odd))
+                return false;
+            tex = make_shared<checker_texture>(scale, even, odd);
+        }
+        else if (kind == "image")
+        {
+            std::string file, format_name;
+            texel_format format = texel_format::srgb8;
+            if (!read_word(file))
+                return false;
+            if (next < current->tokens.size())
+            {
+                if (!read_word(format_name))
+                    return false;
+                if (!parse_texel_format(format_name, format))
+                    return error("unknown texel format '" + format_name + "'");
+            }
+            tex = images.at(image_key(resolve_path(file), format)).get();
+        }
+        else if (kind == "noise" || kind == "turbulence")
+        {
+            double scale;
+            color c(1, 1, 1);
+            if (!read_number(scale) ||
+                (next < current->tokens.size() && current->tokens[next] != "bake" && !read_vec3(c)))
+                return false;
+
+            double samples_per_cell = 0;
+            point3 bake_min, bake_max;
+            if (next < current->tokens.size() && current->tokens[next] == "bake")
+            {
+                next++;
+                if (!read_number(samples_per_cell) || !read_vec3(bake_min) || !read_vec3(bake_max))
+                    return false;
+            }
+
+            bool baked = true;
+            aabb region(bake_min, bake_max);
+            if (kind == "noise")
+            {
+                auto noise = make_shared<noise_texture>(scale, c);
+                if (samples_per_cell > 0)
+                    baked = noise->bake(region, samples_per_cell);
+                tex = noise;
+            }
+            else
+            {
+                auto turbulence = make_shared<turb_noise_texture>(scale, c);
+                if (samples_per_cell > 0)
+                    baked = turbulence->bake(region, samples_per_cell);
+                tex = turbulence;
+            }
+            if (!baked)
+                return error("noise grid too large to bake");
+        }
+        else
+            return error("unknown texture type '" + kind + "'");
+
+        textures[name] = tex;
+        return true;
+    }
+
+    bool parse_material()
+    {
+        std::string name, kind;
+        if (!read_word(name) || !read_word(kind))
+            return false;
+
+        shared_ptr<material> mat;
+        if (kind == "lambertian" || kind == "light" || kind == "isotropic")
+        {
+            shared_ptr<texture> tex;
+            if (!read_texture(tex))
+                return false;
+            if (kind == "lambertian")
+                mat = make_shared<lambertian>(tex);
+            else if (kind == "light")
+                mat = make_shared<diffuse_light>(tex);
+            else
+                mat = make_shared<isotropic>(tex);
+        }
+        else if (kind == "metal")
+        {
+            color albedo;
+            double fuzz;
+            if (!read_vec3(albedo) || !read_number(fuzz))
+                return false;
+            mat = make_shared<metal>(albedo, fuzz);
+        }
+        else if (kind == "dielectric")
+        {
+            double index;
+            if (!read_number(index))
+                return false;
+            mat = make_shared<dielectric>(index);
+        }
+        else if (kind == "glossy")
+        {
+            color albedo;
+            double roughness, metallic = 0.0;
+            if (!read_vec3(albedo) || !read_number(roughness) ||
+                (next < current->tokens.size() && !read_number(metallic)))
+                return false;
+            mat = make_shared<glossy>(albedo, roughness, metallic);
+        }
+        else if (kind == "iridescent")
+        {
+            shared_ptr<material> base;
+            double strength;
+            if (!read_material(base) || !read_number(strength))
+                return false;
+            mat = make_shared<iridescent>(base, strength);
+        }
+        else
+            return error("unknown material type '" + kind + "'");
+
+        materials[name] = mat;
+        return true;
+    }
+
+    // `sample_only` for a `sample` shape, which alone may have material `none`.
+    bool parse_primitive(shared_ptr<hittable> &object, bool sample_only)
+    {
+        std::string kind;
+        if (!read_word(kind))
+            return false;
+
+        shared_ptr<material> mat;
+        if (kind == "sphere")
+        {
+            point3 center;
+            double radius;
+            if (!read_vec3(center) || !read_number(radius) || !read_material(mat, sample_only))
+                return false;
+            object = make_shared<sphere>(center, radius, mat);
+        }
+        else if (kind == "moving_sphere")
+        {
+            point3 center1, center2;
+            double radius;
+            if (!read_vec3(center1) || !read_vec3(center2) || !read_number(radius) || !read_material(mat, sample_only))
+                return false;
+            object = make_shared<sphere>(center1, center2, radius, mat);
+        }
+        else if (kind == "quad")
+        {
+            point3 q;
+            vec3 u, v;
+            if (!read_vec3(q) || !read_vec3(u) || !read_vec3(v) || !read_material(mat, sample_only))
+                return false;
+            object = make_shared<quad>(q, u, v, mat);
+        }
+        else if (kind == "box")
+        {
+            point3 a, b;
+            double angle;
+            vec3 offset;
+            if (!read_vec3(a) || !read_vec3(b) || !read_material(mat, sample_only) || !read_placement(angle, offset))
+                return false;
+            object = make_shared<oriented_box>(a, b, angle, offset, mat);
+        }
+        else if (kind == "mesh")
+        {
+            std::string file;
+            double angle;
+            vec3 offset;
+            if (!read_word(file) || !read_material(mat, sample_only) || !read_placement(angle, offset))
+                return false;
+
+            // Each instance views the loaded arrays with its own material binding.
+            auto loaded = meshes.at(resolve_path(file)).get();
+            auto slot_materials = triangle_mesh::resolve_materials(
+                loaded->material_names(), mat,
+                [this](const std::string &name) -> shared_ptr<material>
+                {
+                    auto found = materials.find(name);
+                    return found == materials.end() ? nullptr : found->second;
+                });
+            object = make_shared<triangle_mesh>(loaded->data(), std::move(slot_materials), loaded->material_names(),
+                                                loaded);
+            if (angle != 0)
+                object = make_shared<rotate_y>(object, angle);
+            if (offset.length_squared() > 0)
+                object = make_shared<translate>(object, offset);
+        }
+        else
+            return error("unknown statement '" + kind + "'");
+
+        return true;
+    }
+
+    // Optional `rotate_y DEG` and `translate X Y Z` after a primitive.
+    bool read_placement(double &angle, vec3 &offset)
+    {
+        angle = 0;
+        offset = vec3(0, 0, 0);
+        while (next < current->tokens.size())
+        {
+            const auto &key = current->tokens[next];
+            if (key == "rotate_y")
+            {
+                next++;
+                if (!read_number(angle))
+                    return false;
+            }
+            else if (key == "translate")
+            {
+                next++;
+                if (!read_vec3(offset))
+                    return false;
+            }
+            else
+                break;
+        }
+        return true;
+    }
+
+    bool error(const std::string &message) const
+    {
+        std::cerr << path << ":" << current->line << ": " << message << "\n";
+        return false;
+    }
+
+    bool read_word(std::string &word)
+    {
+        if (next >= current->tokens.size())
+            return error("missing argument to '" + current->tokens[0] + "'");
+        word = current->tokens[next++];
+        return true;
+    }
+
+    bool read_number(double &value)
+    {
+        std::string word;
+        if (!read_word(word))
+            return false;
+        char *end;
+        value = std::strtod(word.c_str(), &end);
+        if (end == word.c_str() || *end != '\0')
+            return error("expected a number, found '" + word + "'");
+        return true;
+    }
+
+    bool read_int(int &value)
+    {
+        double number;
+        if (!read_number(number))
+            return false;
+        value = int(number);
+        if (value != number)
+            return error("expected an integer, found '" + current->tokens[next - 1] + "'");
+        return true;
+    }
+
+    bool read_vec3(vec3 &value)
+    {
+        double x, y, z;
+        if (!read_number(x) || !read_number(y) || !read_number(z))
+            return false;
+        value = vec3(x, y, z);
+        return true;
+    }
+
+    // A texture name, or three numbers for a solid color.
+    bool read_texture(shared_ptr<texture> &tex)
+    {
+        if (next < current->tokens.size())
+        {
+            auto found = textures.find(current->tokens[next]);
+            if (found != textures.end())
+            {
+                next++;
+                tex = found->second;
+                return true;
+            }
+        }
+
+        color c;
+        if (!read_vec3(c))
+            return false;
+        tex = make_shared<solid_color>(c);
+        return true;
+    }
+
+    // `allow_none` lets the name `none` read as a null material.
+    bool read_material(shared_ptr<material> &mat, bool allow_none = false)
+    {
+        std::string name;
+        if (!read_word(name))
+            return false;
+        if (name == "none")
+        {
+            if (!allow_none)
+                return error("material 'none' is only allowed on 'sample' shapes");
+            mat = nullptr;
+            return true;
+        }
+        auto found = materials.find(name);
+        if (found == materials.end())
+            return error("unknown material '" + name + "'");
+        mat = found->second;
+        return true;
+    }
+};
+
+#endif
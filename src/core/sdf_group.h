@@ -44,6 +44,7 @@ public:
                 rec.set_face_normal(r, outward_normal);
                 closest_sphere->get_sphere_uv(outward_normal, rec.u, rec.v);
                 rec.mat = closest_sphere->get_material();
+                rec.prim = nullptr;
                 return true;
             }
 
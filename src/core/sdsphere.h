@@ -9,7 +9,7 @@
 class sdsphere : public hittable {
 public:
     sdsphere(const point3 &center, double radius, shared_ptr<material> mat)
-        : center(center), radius(std::fmax(0, radius)), mat(mat)
+        : center(center), radius(std::fmax(0, radius)), mat(material_table::global().add(mat))
     {
         auto rvec = vec3(radius, radius, radius);
         bbox = aabb(center - rvec, center + rvec);
@@ -32,6 +32,7 @@ public:
                 rec.set_face_normal(r, outward_normal);
                 get_sphere_uv(outward_normal, rec.u, rec.v);
                 rec.mat = mat;
+                rec.prim = nullptr;
                 return true;
             }
 
@@ -49,7 +50,7 @@ public:
         return (p - center).length() - radius;
     }
 
-    shared_ptr<material> get_material() 
+    material_id get_material() const
     {
         return mat;
     }
@@ -67,8 +68,8 @@ public:
         //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
         //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
         //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
-        auto theta = std::acos(-p.y());
-        auto phi = std::atan2(p.z(), -p.x()) + pi;
+        auto theta = fast_acos(-p.y());
+        auto phi = fast_atan2(p.z(), -p.x()) + pi;
     
         u = phi / (2 * pi);
         v = theta / pi;
@@ -78,7 +79,7 @@ public:
 private:
     point3 center;
     double radius;
-    shared_ptr<material> mat;
+    material_id mat;
     aabb bbox;
     double e = 0.001;
 
@@ -0,0 +1,495 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Thin SIMD layer for the intersection and shading kernels.
+//
+//   vfloat<N> / vbool<N>  N-wide float lanes and lane masks. N = 4 maps to SSE and N = 8 to
+//                         AVX when the compiler targets them; otherwise a scalar loop is used,
+//                         so every kernel written against these types builds everywhere.
+//   vec3_packet<N>        Structure-of-arrays bundle of N 3-vectors (x, y and z lanes).
+//   simd_vec3             A single 3-vector held in one 4-lane register (w lane unused).
+//
+// Kernels should prefer `simd_width`, the widest width the target supports natively.
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define RT_SIMD_SSE 1
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define RT_SIMD_AVX 1
+#endif
+
+#include "vec3.h"
+
+// Generic (scalar) lanes -------------------------------------------------------------------------
+
+template <int N>
+struct vbool
+{
+    bool m[N];
+
+    bool operator[](int i) const { return m[i]; }
+};
+
+template <int N>
+struct vfloat
+{
+    float v[N];
+
+    vfloat() {}
+    vfloat(float x)
+    {
+        for (int i = 0; i < N; i++)
+            v[i] = x;
+    }
+
+    static vfloat load(const float *p)
+    {
+        vfloat r;
+        for (int i = 0; i < N; i++)
+            r.v[i] = p[i];
+        return r;
+    }
+
+    void store(float *p) const
+    {
+        for (int i = 0; i < N; i++)
+            p[i] = v[i];
+    }
+
+    float operator[](int i) const { return v[i]; }
+    float &operator[](int i) { return v[i]; }
+};
+
+#define RT_SIMD_SCALAR_BINARY(op)                                         \
+    template <int N>                                                      \
+    inline vfloat<N> operator op(const vfloat<N> &a, const vfloat<N> &b) \
+    {                                                                     \
+        vfloat<N> r;                                                      \
+        for (int i = 0; i < N; i++)                                       \
+            r.v[i] = a.v[i] op b.v[i];                                    \
+        return r;                                                         \
+    }
+RT_SIMD_SCALAR_BINARY(+)
+RT_SIMD_SCALAR_BINARY(-)
+RT_SIMD_SCALAR_BINARY(*)
+RT_SIMD_SCALAR_BINARY(/)
+#undef RT_SIMD_SCALAR_BINARY
+
+#define RT_SIMD_SCALAR_COMPARE(op)                                        \
+    template <int N>                                                      \
+    inline vbool<N> operator op(const vfloat<N> &a, const vfloat<N> &b)  \
+    {                                                                     \
+        vbool<N> r;                                                       \
+        for (int i = 0; i < N; i++)                                       \
+            r.m[i] = a.v[i] op b.v[i];                                    \
+        return r;                                                         \
+    }
+RT_SIMD_SCALAR_COMPARE(<)
+RT_SIMD_SCALAR_COMPARE(>)
+RT_SIMD_SCALAR_COMPARE(<=)
+RT_SIMD_SCALAR_COMPARE(>=)
+#undef RT_SIMD_SCALAR_COMPARE
+
+template <int N>
+inline vbool<N> operator&(const vbool<N> &a, const vbool<N> &b)
+{
+    vbool<N> r;
+    for (int i = 0; i < N; i++)
+        r.m[i] = a.m[i] && b.m[i];
+    return r;
+}
+
+template <int N>
+inline vbool<N> operator|(const vbool<N> &a, const vbool<N> &b)
+{
+    vbool<N> r;
+    for (int i = 0; i < N; i++)
+        r.m[i] = a.m[i] || b.m[i];
+    return r;
+}
+
+template <int N>
+inline int movemask(const vbool<N> &a)
+{
+    int bits = 0;
+    for (int i = 0; i < N; i++)
+        bits |= int(a.m[i]) << i;
+    return bits;
+}
+
+template <int N>
+inline vfloat<N> select(const vbool<N> &mask, const vfloat<N> &a, const vfloat<N> &b)
+{
+    vfloat<N> r;
+    for (int i = 0; i < N; i++)
+        r.v[i] = mask.m[i] ? a.v[i] : b.v[i];
+    return r;
+}
+
+template <int N>
+inline vfloat<N> min(const vfloat<N> &a, const vfloat<N> &b)
+{
+    vfloat<N> r;
+    for (int i = 0; i < N; i++)
+        r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+    return r;
+}
+
+template <int N>
+inline vfloat<N> max(const vfloat<N> &a, const vfloat<N> &b)
+{
+    vfloat<N> r;
+    for (int i = 0; i < N; i++)
+        r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+    return r;
+}
+
+template <int N>
+inline vfloat<N> sqrt(const vfloat<N> &a)
+{
+    vfloat<N> r;
+    for (int i = 0; i < N; i++)
+        r.v[i] = std::sqrt(a.v[i]);
+    return r;
+}
+
+template <int N>
+inline vfloat<N> floor(const vfloat<N> &a)
+{
+    vfloat<N> r;
+    for (int i = 0; i < N; i++)
+        r.v[i] = std::floor(a.v[i]);
+    return r;
+}
+
+// Splits positive normal `a` into a mantissa in [0.5, 1), returned, and a power of two, as
+// std::frexp does. Zero, negative, denormal and non-finite lanes give meaningless results.
+template <int N>
+inline vfloat<N> frexp(const vfloat<N> &a, vfloat<N> &exponent)
+{
+    vfloat<N> r;
+    for (int i = 0; i < N; i++)
+    {
+        int e;
+        r.v[i] = std::frexp(a.v[i], &e);
+        exponent.v[i] = float(e);
+    }
+    return r;
+}
+
+// SSE: 4 lanes -----------------------------------------------------------------------------------
+
+#ifdef RT_SIMD_SSE
+
+template <>
+struct vbool<4>
+{
+    __m128 m;
+
+    vbool() {}
+    vbool(__m128 m) : m(m) {}
+
+    bool operator[](int i) const { return (_mm_movemask_ps(m) >> i) & 1; }
+};
+
+template <>
+struct vfloat<4>
+{
+    __m128 v;
+
+    vfloat() {}
+    vfloat(__m128 v) : v(v) {}
+    vfloat(float x) : v(_mm_set1_ps(x)) {}
+
+    static vfloat load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+
+    float operator[](int i) const
+    {
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, v);
+        return lanes[i];
+    }
+};
+
+inline vfloat<4> operator+(const vfloat<4> &a, const vfloat<4> &b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat<4> operator-(const vfloat<4> &a, const vfloat<4> &b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat<4> operator*(const vfloat<4> &a, const vfloat<4> &b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat<4> operator/(const vfloat<4> &a, const vfloat<4> &b) { return _mm_div_ps(a.v, b.v); }
+
+inline vbool<4> operator<(const vfloat<4> &a, const vfloat<4> &b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vbool<4> operator>(const vfloat<4> &a, const vfloat<4> &b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vbool<4> operator<=(const vfloat<4> &a, const vfloat<4> &b) { return _mm_cmple_ps(a.v, b.v); }
+inline vbool<4> operator>=(const vfloat<4> &a, const vfloat<4> &b) { return _mm_cmpge_ps(a.v, b.v); }
+
+inline vbool<4> operator&(const vbool<4> &a, const vbool<4> &b) { return _mm_and_ps(a.m, b.m); }
+inline vbool<4> operator|(const vbool<4> &a, const vbool<4> &b) { return _mm_or_ps(a.m, b.m); }
+inline int movemask(const vbool<4> &a) { return _mm_movemask_ps(a.m); }
+
+inline vfloat<4> select(const vbool<4> &mask, const vfloat<4> &a, const vfloat<4> &b)
+{
+    return _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v));
+}
+
+inline vfloat<4> min(const vfloat<4> &a, const vfloat<4> &b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat<4> max(const vfloat<4> &a, const vfloat<4> &b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat<4> sqrt(const vfloat<4> &a) { return _mm_sqrt_ps(a.v); }
+
+inline vfloat<4> floor(const vfloat<4> &a)
+{
+#ifdef __SSE4_1__
+    return _mm_floor_ps(a.v);
+#else
+    // Truncate, then step down where that rounded a negative value up. Lanes must fit an int.
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1.0f)));
+#endif
+}
+
+inline __m128 frexp_sse(__m128 a, __m128 &exponent)
+{
+    __m128i bits = _mm_castps_si128(a);
+    __m128i biased = _mm_srli_epi32(bits, 23); // Sign bit is clear for positive lanes
+    exponent = _mm_cvtepi32_ps(_mm_sub_epi32(biased, _mm_set1_epi32(126)));
+    __m128i mantissa = _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x807fffff)), _mm_set1_epi32(0x3f000000));
+    return _mm_castsi128_ps(mantissa);
+}
+
+inline vfloat<4> frexp(const vfloat<4> &a, vfloat<4> &exponent) { return frexp_sse(a.v, exponent.v); }
+
+#endif
+
+// AVX: 8 lanes -----------------------------------------------------------------------------------
+
+#ifdef RT_SIMD_AVX
+
+template <>
+struct vbool<8>
+{
+    __m256 m;
+
+    vbool() {}
+    vbool(__m256 m) : m(m) {}
+
+    bool operator[](int i) const { return (_mm256_movemask_ps(m) >> i) & 1; }
+};
+
+template <>
+struct vfloat<8>
+{
+    __m256 v;
+
+    vfloat() {}
+    vfloat(__m256 v) : v(v) {}
+    vfloat(float x) : v(_mm256_set1_ps(x)) {}
+
+    static vfloat load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    float operator[](int i) const
+    {
+        alignas(32) float lanes[8];
+        _mm256_store_ps(lanes, v);
+        return lanes[i];
+    }
+};
+
+inline vfloat<8> operator+(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat<8> operator-(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat<8> operator*(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat<8> operator/(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_div_ps(a.v, b.v); }
+
+inline vbool<8> operator<(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vbool<8> operator>(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vbool<8> operator<=(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vbool<8> operator>=(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+
+inline vbool<8> operator&(const vbool<8> &a, const vbool<8> &b) { return _mm256_and_ps(a.m, b.m); }
+inline vbool<8> operator|(const vbool<8> &a, const vbool<8> &b) { return _mm256_or_ps(a.m, b.m); }
+inline int movemask(const vbool<8> &a) { return _mm256_movemask_ps(a.m); }
+
+inline vfloat<8> select(const vbool<8> &mask, const vfloat<8> &a, const vfloat<8> &b)
+{
+    return _mm256_blendv_ps(b.v, a.v, mask.m);
+}
+
+inline vfloat<8> min(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat<8> max(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat<8> sqrt(const vfloat<8> &a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat<8> floor(const vfloat<8> &a) { return _mm256_floor_ps(a.v); }
+
+inline vfloat<8> frexp(const vfloat<8> &a, vfloat<8> &exponent)
+{
+    // Without AVX2's 8-lane integer ops, each half goes through the SSE version.
+    __m128 e_low, e_high;
+    __m128 low = frexp_sse(_mm256_castps256_ps128(a.v), e_low);
+    __m128 high = frexp_sse(_mm256_extractf128_ps(a.v, 1), e_high);
+    exponent.v = _mm256_insertf128_ps(_mm256_castps128_ps256(e_low), e_high, 1);
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1);
+}
+
+constexpr int simd_width = 8;
+#else
+constexpr int simd_width = 4;
+#endif
+
+template <int N>
+inline bool any(const vbool<N> &a) { return movemask(a) != 0; }
+
+template <int N>
+inline bool none(const vbool<N> &a) { return movemask(a) == 0; }
+
+// SoA packet of N 3-vectors ----------------------------------------------------------------------
+
+template <int N>
+struct vec3_packet
+{
+    vfloat<N> x, y, z;
+
+    vec3_packet() {}
+    vec3_packet(const vfloat<N> &x, const vfloat<N> &y, const vfloat<N> &z) : x(x), y(y), z(z) {}
+
+    // Broadcast one vector to every lane.
+    explicit vec3_packet(const vec3 &v) : x(float(v.x())), y(float(v.y())), z(float(v.z())) {}
+
+    // Load lanes [0, N) from separate x, y and z arrays.
+    static vec3_packet load(const float *xs, const float *ys, const float *zs)
+    {
+        return vec3_packet(vfloat<N>::load(xs), vfloat<N>::load(ys), vfloat<N>::load(zs));
+    }
+
+    void store(float *xs, float *ys, float *zs) const
+    {
+        x.store(xs);
+        y.store(ys);
+        z.store(zs);
+    }
+
+    vec3 lane(int i) const { return vec3(x[i], y[i], z[i]); }
+};
+
+template <int N>
+inline vec3_packet<N> operator+(const vec3_packet<N> &a, const vec3_packet<N> &b)
+{
+    return vec3_packet<N>(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+template <int N>
+inline vec3_packet<N> operator-(const vec3_packet<N> &a, const vec3_packet<N> &b)
+{
+    return vec3_packet<N>(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+template <int N>
+inline vec3_packet<N> operator*(const vfloat<N> &t, const vec3_packet<N> &a)
+{
+    return vec3_packet<N>(t * a.x, t * a.y, t * a.z);
+}
+
+template <int N>
+inline vfloat<N> dot(const vec3_packet<N> &a, const vec3_packet<N> &b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+template <int N>
+inline vec3_packet<N> cross(const vec3_packet<N> &a, const vec3_packet<N> &b)
+{
+    return vec3_packet<N>(a.y * b.z - a.z * b.y,
+                          a.z * b.x - a.x * b.z,
+                          a.x * b.y - a.y * b.x);
+}
+
+template <int N>
+inline vec3_packet<N> unit_vector(const vec3_packet<N> &a)
+{
+    return (vfloat<N>(1.0f) / sqrt(dot(a, a))) * a;
+}
+
+// AoS 3-vector in a single register --------------------------------------------------------------
+
+#ifdef RT_SIMD_SSE
+
+class simd_vec3
+{
+public:
+    __m128 v;
+
+    simd_vec3() : v(_mm_setzero_ps()) {}
+    simd_vec3(__m128 v) : v(v) {}
+    simd_vec3(float x, float y, float z) : v(_mm_set_ps(0, z, y, x)) {}
+    explicit simd_vec3(const vec3 &u) : simd_vec3(float(u.x()), float(u.y()), float(u.z())) {}
+
+    float x() const { return _mm_cvtss_f32(v); }
+    float y() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))); }
+    float z() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))); }
+
+    vec3 to_vec3() const { return vec3(x(), y(), z()); }
+};
+
+inline simd_vec3 operator+(const simd_vec3 &a, const simd_vec3 &b) { return _mm_add_ps(a.v, b.v); }
+inline simd_vec3 operator-(const simd_vec3 &a, const simd_vec3 &b) { return _mm_sub_ps(a.v, b.v); }
+inline simd_vec3 operator*(float t, const simd_vec3 &a) { return _mm_mul_ps(_mm_set1_ps(t), a.v); }
+
+inline float dot(const simd_vec3 &a, const simd_vec3 &b)
+{
+    // The w lanes are zero, so a full horizontal sum of the product is the 3-component dot.
+    __m128 m = _mm_mul_ps(a.v, b.v);
+    __m128 s = _mm_add_ps(m, _mm_movehl_ps(m, m));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(s);
+}
+
+inline simd_vec3 cross(const simd_vec3 &a, const simd_vec3 &b)
+{
+    __m128 a_yzx = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a.v, b_yzx), _mm_mul_ps(a_yzx, b.v));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+inline simd_vec3 unit_vector(const simd_vec3 &a)
+{
+    return _mm_div_ps(a.v, _mm_sqrt_ps(_mm_set1_ps(dot(a, a))));
+}
+
+#else
+
+class simd_vec3
+{
+public:
+    float e[3];
+
+    simd_vec3() : e{0, 0, 0} {}
+    simd_vec3(float x, float y, float z) : e{x, y, z} {}
+    explicit simd_vec3(const vec3 &u) : simd_vec3(float(u.x()), float(u.y()), float(u.z())) {}
+
+    float x() const { return e[0]; }
+    float y() const { return e[1]; }
+    float z() const { return e[2]; }
+
+    vec3 to_vec3() const { return vec3(e[0], e[1], e[2]); }
+};
+
+inline simd_vec3 operator+(const simd_vec3 &a, const simd_vec3 &b) { return simd_vec3(a.e[0] + b.e[0], a.e[1] + b.e[1], a.e[2] + b.e[2]); }
+inline simd_vec3 operator-(const simd_vec3 &a, const simd_vec3 &b) { return simd_vec3(a.e[0] - b.e[0], a.e[1] - b.e[1], a.e[2] - b.e[2]); }
+inline simd_vec3 operator*(float t, const simd_vec3 &a) { return simd_vec3(t * a.e[0], t * a.e[1], t * a.e[2]); }
+inline float dot(const simd_vec3 &a, const simd_vec3 &b) { return a.e[0] * b.e[0] + a.e[1] * b.e[1] + a.e[2] * b.e[2]; }
+
+inline simd_vec3 cross(const simd_vec3 &a, const simd_vec3 &b)
+{
+    return simd_vec3(a.e[1] * b.e[2] - a.e[2] * b.e[1],
+                     a.e[2] * b.e[0] - a.e[0] * b.e[2],
+                     a.e[0] * b.e[1] - a.e[1] * b.e[0]);
+}
+
+inline simd_vec3 unit_vector(const simd_vec3 &a) { return (1.0f / std::sqrt(dot(a, a))) * a; }
+
+#endif
+
+#endif
@@ -9,7 +9,7 @@ class sphere : public hittable
 public:
     // Stationary Sphere
     sphere(const point3 &static_center, double radius, shared_ptr<material> mat)
-        : center(static_center, vec3(0, 0, 0)), radius(std::fmax(0, radius)), mat(mat)
+        : center(static_center, vec3(0, 0, 0)), radius(std::fmax(0, radius)), mat(material_table::global().add(mat))
     {
         auto rvec = vec3(radius, radius, radius);
         bbox = aabb(static_center - rvec, static_center + rvec);
@@ -18,7 +18,7 @@ public:
     // Moving Sphere
     sphere(const point3 &center1, const point3 &center2, double radius,
            shared_ptr<material> mat)
-        : center(center1, center2 - center1), radius(std::fmax(0, radius)), mat(mat)
+        : center(center1, center2 - center1), radius(std::fmax(0, radius)), mat(material_table::global().add(mat))
     {
         auto rvec = vec3(radius, radius, radius);
         aabb box1(center.at(0) - rvec, center.at(0) + rvec);
@@ -51,17 +51,39 @@ public:
         }
 
         rec.t = root;
+        rec.prim = this;
+
+        return true;
+    }
+
+    void surface(const ray &r, hit_record &rec) const override
+    {
+        point3 current_center = center.at(r.time());
         rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - current_center) / radius;
         rec.set_face_normal(r, outward_normal);
         get_sphere_uv(outward_normal, rec.u, rec.v);
+        // u wraps once around the equator (2 pi r) and v runs pole to pole (pi r).
+        rec.uv_density = 1 / (pi * radius * std::sqrt(2.0));
         rec.mat = mat;
-
-        return true;
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(double time) const override
+    {
+        auto rvec = vec3(radius, radius, radius);
+        return aabb(center.at(time) - rvec, center.at(time) + rvec);
+    }
+
+    shared_ptr<hittable> transformed_copy(const rigid_transform &to_world) const override
+    {
+        // Rotating a sphere turns its texture mapping, which the sphere has no frame for.
+        if (to_world.has_rotation())
+            return nullptr;
+        return make_shared<sphere>(to_world.point(center.at(0)), to_world.point(center.at(1)), radius, material_table::global().owner(mat));
+    }
+
     double pdf_value(const point3& origin, const vec3& direction) const override 
     {
         hit_record rec;
@@ -82,10 +104,13 @@ public:
         return uvw.transform(random_to_sphere(radius, distance_squared));
     }
 
+    double surface_area() const override { return 4 * pi * radius * radius; }
+    material_id surface_material() const override { return mat; }
+
 private:
     ray center;
     double radius;
-    shared_ptr<material> mat;
+    material_id mat;
     aabb bbox;
 
     static void get_sphere_uv(const point3 &p, double &u, double &v)
@@ -96,8 +121,8 @@ private:
         //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
         //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
         //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
-        auto theta = std::acos(-p.y());
-        auto phi = std::atan2(p.z(), -p.x()) + pi;
+        auto theta = fast_acos(-p.y());
+        auto phi = fast_atan2(p.z(), -p.x()) + pi;
 
         u = phi / (2 * pi);
         v = theta / pi;
@@ -109,9 +134,10 @@ private:
         auto r2 = random_double();
         auto z = 1 + r2*(std::sqrt(1-radius*radius/distance_squared) - 1);
 
-        auto phi = 2*pi*r1;
-        auto x = std::cos(phi) * std::sqrt(1-z*z);
-        auto y = std::sin(phi) * std::sqrt(1-z*z);
+        double sin_phi, cos_phi;
+        fast_sin_cos(2*pi*r1, sin_phi, cos_phi);
+        auto x = cos_phi * std::sqrt(1-z*z);
+        auto y = sin_phi * std::sqrt(1-z*z);
 
         return vec3(x, y, z);
     }
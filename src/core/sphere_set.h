@@ -0,0 +1,252 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include <cstdint>
+#include <vector>
+
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "simd.h"
+
+// A large collection of (optionally moving) spheres stored as one primitive. Centers, radii,
+// motion vectors and material ids are kept in structure-of-arrays form in BVH leaf order, and
+// each leaf holds up to `simd_width` spheres that are intersected in a single batch. This is
+// the way to build particle-style scenes: a sphere costs 32 bytes here instead of a
+// heap-allocated `sphere` behind a shared_ptr and a virtual call.
+//
+// Call build() after the last add() and before rendering.
+class sphere_set : public hittable
+{
+public:
+    sphere_set() {}
+
+    // Stationary sphere
+    void add(const point3 &center, double radius, shared_ptr<material> mat)
+    {
+        add(center, center, radius, mat);
+    }
+
+    // Moving sphere, at `center1` at time 0 and `center2` at time 1
+    void add(const point3 &center1, const point3 &center2, double radius, shared_ptr<material> mat)
+    {
+        if (built)
+            trim_padding();
+
+        auto motion = center2 - center1;
+        cx.push_back(float(center1.x()));
+        cy.push_back(float(center1.y()));
+        cz.push_back(float(center1.z()));
+        mx.push_back(float(motion.x()));
+        my.push_back(float(motion.y()));
+        mz.push_back(float(motion.z()));
+        radii.push_back(float(std::fmax(0, radius)));
+        mat_ids.push_back(material_table::global().add(mat));
+        sphere_count++;
+        built = false;
+    }
+
+    size_t size() const { return sphere_count; }
+
+    void build()
+    {
+        // Build the leaf hierarchy, then permute the arrays into leaf order and pad them so a
+        // full-width load from the last leaf stays in bounds. Moving spheres are bounded per key:
+        // leaves keep their bounds at both ends of the shutter interval.
+        size_t count = size();
+        std::vector<aabb> start_boxes(count), end_boxes(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            auto r = vec3(radii[i], radii[i], radii[i]);
+            point3 c0(cx[i], cy[i], cz[i]);
+            point3 c1 = c0 + vec3(mx[i], my[i], mz[i]);
+            start_boxes[i] = aabb(c0 - r, c0 + r);
+            end_boxes[i] = aabb(c1 - r, c1 + r);
+        }
+
+        bvh.build(start_boxes, end_boxes, simd_width);
+
+        const auto &order = bvh.order();
+        permute(cx, order);
+        permute(cy, order);
+        permute(cz, order);
+        permute(mx, order);
+        permute(my, order);
+        permute(mz, order);
+        permute(radii, order);
+        permute(mat_ids, order);
+
+        bbox = bvh.bounds();
+        built = true;
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        if (!built)
+            return false;
+
+        constexpr int N = simd_width;
+
+        const point3 &o = r.origin();
+        const vec3 &d = r.direction();
+        const double a = d.length_squared();
+        const float time = float(r.time());
+
+        const vec3_packet<N> origin(o);
+        const vec3_packet<N> dir(d);
+        const vfloat<N> a_n = float(a);
+        const vfloat<N> time_n(time);
+        const vfloat<N> lane_index = lane_indices<N>();
+
+        return bvh.traverse(r, ray_t, [&](uint32_t first, uint32_t count, interval &t_range)
+        {
+            // Batch test in single precision to find candidate lanes, then confirm each
+            // candidate in double precision so results match the scalar `sphere`.
+            auto center = vec3_packet<N>::load(&cx[first], &cy[first], &cz[first]) +
+                          time_n * vec3_packet<N>::load(&mx[first], &my[first], &mz[first]);
+            auto radius = vfloat<N>::load(&radii[first]);
+
+            auto oc = center - origin;
+            auto h = dot(dir, oc);
+            auto c = dot(oc, oc) - radius * radius;
+            auto discriminant = h * h - a_n * c;
+
+            // The float tests are loosened by a relative slack; the double check is exact.
+            auto slack = vfloat<N>(1e-3f) * (vfloat<N>(float(t_range.max)) + vfloat<N>(1.0f));
+            auto sqrtd = sqrt(max(discriminant, vfloat<N>(0.0f)));
+            auto t_far = (h + sqrtd) / a_n;
+            auto t_near = (h - sqrtd) / a_n;
+
+            auto candidates = (lane_index < vfloat<N>(float(count))) &
+                              (discriminant >= vfloat<N>(-1e-3f) * h * h) &
+                              (t_far >= vfloat<N>(float(t_range.min)) - slack) &
+                              (t_near <= vfloat<N>(float(t_range.max)) + slack);
+
+            int mask = movemask(candidates);
+            bool hit_leaf = false;
+            while (mask)
+            {
+                int lane = lowest_bit(mask);
+                mask &= mask - 1;
+
+                double root;
+                if (exact_hit(first + lane, r, a, t_range, root))
+                {
+                    t_range.max = root;
+                    rec.t = root;
+                    rec.prim = this;
+                    rec.prim_id = int(first + lane);
+                    hit_leaf = true;
+                }
+            }
+            return hit_leaf;
+        });
+    }
+
+    void surface(const ray &r, hit_record &rec) const override
+    {
+        size_t i = size_t(rec.prim_id);
+        point3 current_center = center_at(i, r.time());
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - current_center) / double(radii[i]);
+        rec.set_face_normal(r, outward_normal);
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = mat_ids[i];
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb bounding_box_at(double time) const override { return bvh.bounds_at(time); }
+
+    size_t memory_bytes() const
+    {
+        size_t floats = cx.capacity() + cy.capacity() + cz.capacity() + mx.capacity() +
+                        my.capacity() + mz.capacity() + radii.capacity();
+        return floats * sizeof(float) + mat_ids.capacity() * sizeof(material_id) + bvh.memory_bytes();
+    }
+
+private:
+    std::vector<float> cx, cy, cz;  // Centers at time 0
+    std::vector<float> mx, my, mz;  // Motion over the shutter interval (center1 - center0)
+    std::vector<float> radii;
+    std::vector<material_id> mat_ids;
+    size_t sphere_count = 0;
+    flat_bvh bvh;
+    aabb bbox;
+    bool built = false;
+
+    void trim_padding()
+    {
+        for (auto *values : {&cx, &cy, &cz, &mx, &my, &mz, &radii})
+            values->resize(sphere_count);
+        mat_ids.resize(sphere_count);
+    }
+
+    point3 center_at(size_t i, double time) const
+    {
+        return point3(cx[i], cy[i], cz[i]) + time * vec3(mx[i], my[i], mz[i]);
+    }
+
+    bool exact_hit(size_t i, const ray &r, double a, const interval &ray_t, double &root) const
+    {
+        // Same quadratic as sphere::hit.
+        vec3 oc = center_at(i, r.time()) - r.origin();
+        double radius = radii[i];
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius * radius;
+
+        auto discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+
+        root = (h - sqrtd) / a;
+        if (!ray_t.surrounds(root))
+        {
+            root = (h + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+        return true;
+    }
+
+    template <int N>
+    static vfloat<N> lane_indices()
+    {
+        float lanes[N];
+        for (int i = 0; i < N; i++)
+            lanes[i] = float(i);
+        return vfloat<N>::load(lanes);
+    }
+
+    static int lowest_bit(int mask)
+    {
+        int bit = 0;
+        while (!(mask & (1 << bit)))
+            bit++;
+        return bit;
+    }
+
+    template <typename T>
+    static void permute(std::vector<T> &values, const std::vector<uint32_t> &order)
+    {
+        std::vector<T> sorted;
+        sorted.reserve(order.size() + simd_width);
+        for (auto index : order)
+            sorted.push_back(values[index]);
+        sorted.resize(order.size() + simd_width, T());
+        values.swap(sorted);
+    }
+
+    static void get_sphere_uv(const point3 &p, double &u, double &v)
+    {
+        // See sphere::get_sphere_uv.
+        auto theta = fast_acos(-p.y());
+        auto phi = fast_atan2(p.z(), -p.x()) + pi;
+
+        u = phi / (2 * pi);
+        v = theta / pi;
+    }
+};
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef TEXEL_FORMAT_H
+#define TEXEL_FORMAT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// How an image stores its RGB texels.
+//
+//   srgb8    3 bytes, sRGB encoded. Enough for any 8-bit source, and the encoding spends its
+//            precision on dark values where linear bytes band visibly.
+//   half     6 bytes, linear 16-bit floats, for HDR sources that don't need full precision.
+//   float32  12 bytes, linear 32-bit floats.
+enum class texel_format
+{
+    srgb8,
+    half,
+    float32
+};
+
+inline size_t texel_bytes(texel_format format)
+{
+    switch (format)
+    {
+    case texel_format::half:
+        return 3 * sizeof(uint16_t);
+    case texel_format::float32:
+        return 3 * sizeof(float);
+    default:
+        return 3;
+    }
+}
+
+// Accepts the names used in scene files: `srgb8`, `half` and `float`.
+inline bool parse_texel_format(const std::string &name, texel_format &format)
+{
+    if (name == "srgb8")
+        format = texel_format::srgb8;
+    else if (name == "half")
+        format = texel_format::half;
+    else if (name == "float")
+        format = texel_format::float32;
+    else
+        return false;
+    return true;
+}
+
+// sRGB transfer function ------------------------------------------------------------------------
+
+inline float srgb8_to_linear(unsigned char value)
+{
+    static const auto table = []
+    {
+        std::vector<float> t(256);
+        for (int i = 0; i < 256; i++)
+        {
+            double s = i / 255.0;
+            t[i] = float(s <= 0.04045 ? s / 12.92 : std::pow((s + 0.055) / 1.055, 2.4));
+        }
+        return t;
+    }();
+    return table[value];
+}
+
+// Nearest sRGB byte to a linear value, read from a table over [0,1] in steps of 1/65535 that
+// is built from the midpoints between the decoded bytes. The steps are 20 times finer than the
+// closest pair of bytes, and decoding then re-encoding a byte gives it back exactly.
+inline unsigned char linear_to_srgb8(float value)
+{
+    static const auto table = []
+    {
+        std::vector<float> midpoints(255);
+        for (int i = 0; i < 255; i++)
+            midpoints[i] = 0.5f * (srgb8_to_linear(static_cast<unsigned char>(i)) +
+                                   srgb8_to_linear(static_cast<unsigned char>(i + 1)));
+
+        std::vector<unsigned char> t(65536);
+        for (int i = 0; i < 65536; i++)
+            t[i] = static_cast<unsigned char>(
+                std::upper_bound(midpoints.begin(), midpoints.end(), i / 65535.0f) - midpoints.begin());
+        return t;
+    }();
+    if (!(value > 0)) // Also maps NaN to 0
+        return 0;
+    if (value >= 1)
+        return 255;
+    return table[int(value * 65535.0f + 0.5f)];
+}
+
+// IEEE half precision ---------------------------------------------------------------------------
+
+inline uint16_t float_to_half(float value)
+{
+#if defined(__F16C__)
+    return static_cast<uint16_t>(_cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT));
+#else
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+
+    if (magnitude >= 0x47800000) // Too large for a half, infinite or NaN
+        return uint16_t(sign | (magnitude > 0x7f800000 ? 0x7e00 : 0x7c00));
+    if (magnitude < 0x38800000) // Subnormal as a half: count units of 2^-24
+    {
+        float f;
+        std::memcpy(&f, &magnitude, sizeof(f));
+        return uint16_t(sign | uint32_t(std::lrint(f * 16777216.0f)));
+    }
+
+    // Rebias the exponent and round the mantissa to nearest even; a carry out of the mantissa
+    // correctly bumps the exponent, up to infinity.
+    uint32_t h = magnitude - 0x38000000;
+    h += 0x0fff + ((h >> 13) & 1);
+    return uint16_t(sign | (h >> 13));
+#endif
+}
+
+inline float half_to_float(uint16_t value)
+{
+#if defined(__F16C__)
+    return _cvtsh_ss(value);
+#else
+    uint32_t sign = uint32_t(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+
+    uint32_t bits;
+    if (exponent == 0)
+    {
+        float f = mantissa * (1.0f / 16777216.0f);
+        std::memcpy(&bits, &f, sizeof(bits));
+        bits |= sign;
+    }
+    else if (exponent == 31)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+#endif
+}
+
+// Converts `count` floats to halves, split across the hardware threads when there are enough of
+// them to be worth it. With F16C each thread converts eight values per instruction.
+inline void convert_to_half(const float *in, uint16_t *out, size_t count)
+{
+    auto convert = [](const float *in, uint16_t *out, size_t count)
+    {
+        size_t i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), h);
+        }
+#endif
+        for (; i < count; i++)
+            out[i] = float_to_half(in[i]);
+    };
+
+    const size_t min_per_thread = size_t(1) << 18;
+    size_t num_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                          std::max<size_t>(1, count / min_per_thread));
+    if (num_threads <= 1)
+    {
+        convert(in, out, count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    size_t chunk = (count + num_threads - 1) / num_threads;
+    for (size_t begin = 0; begin < count; begin += chunk)
+        threads.emplace_back(convert, in + begin, out + begin, std::min(chunk, count - begin));
+    for (auto &t : threads)
+        t.join();
+}
+
+// Per-texel access ------------------------------------------------------------------------------
+
+// Linear RGB of the texel stored at `p`.
+inline void decode_texel(texel_format format, const unsigned char *p, float rgb[3])
+{
+    switch (format)
+    {
+    case texel_format::srgb8:
+        for (int k = 0; k < 3; k++)
+            rgb[k] = srgb8_to_linear(p[k]);
+        break;
+    case texel_format::half:
+        for (int k = 0; k < 3; k++)
+        {
+            uint16_t h;
+            std::memcpy(&h, p + k * sizeof(h), sizeof(h));
+            rgb[k] = half_to_float(h);
+        }
+        break;
+    case texel_format::float32:
+        std::memcpy(rgb, p, 3 * sizeof(float));
+        break;
+    default:
+        rgb[0] = rgb[1] = rgb[2] = 0;
+        break;
+    }
+}
+
+inline void encode_texel(texel_format format, const float rgb[3], unsigned char *p)
+{
+    switch (format)
+    {
+    case texel_format::srgb8:
+        for (int k = 0; k < 3; k++)
+            p[k] = linear_to_srgb8(rgb[k]);
+        break;
+    case texel_format::half:
+        for (int k = 0; k < 3; k++)
+        {
+            uint16_t h = float_to_half(rgb[k]);
+            std::memcpy(p + k * sizeof(h), &h, sizeof(h));
+        }
+        break;
+    case texel_format::float32:
+        std::memcpy(p, rgb, 3 * sizeof(float));
+        break;
+    }
+}
+
+#endif
@@ -1,9 +1,14 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include "mipmap.h"
+#include "noise_grid.h"
 #include "perlin.h"
 #include "rtweekend.h"
 #include "rtw_stb_image.h"
+#include "texture_registry.h"
+
+class texture_program;
 
 class texture
 {
@@ -11,6 +16,13 @@ public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3 &p) const = 0;
+
+    // Value averaged over a footprint `width` texture units across around (u, v), as given by
+    // hit_record::uv_footprint. Only textures that can prefilter override this.
+    virtual color value_filtered(double u, double v, double width, const point3 &p) const
+    {
+        return value(u, v, p);
+    }
 };
 
 class solid_color : public texture
@@ -26,6 +38,8 @@ public:
     }
 
 private:
+    friend class texture_program;
+
     color albedo;
 };
 
@@ -49,37 +63,64 @@ public:
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);
     }
 
+    color value_filtered(double u, double v, double width, const point3 &p) const override
+    {
+        auto xInteger = int(std::floor(inv_scale * p.x()));
+        auto yInteger = int(std::floor(inv_scale * p.y()));
+        auto zInteger = int(std::floor(inv_scale * p.z()));
+
+        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+        return isEven ? even->value_filtered(u, v, width, p) : odd->value_filtered(u, v, width, p);
+    }
+
 private:
+    friend class texture_program;
+
     double inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
 };
 
+// Image texture sampled through a mip chain built when the image is loaded. The decoded image
+// itself is only kept as the chain's first level.
 class image_texture : public texture
 {
 public:
-    image_texture(const char *filename) : image(filename) {}
+    // Shares the decoded image with every other texture made from the same file; decoding
+    // happens in the background and the first lookup waits for it (see texture_registry).
+    image_texture(const char *filename, texel_format format = texel_format::srgb8)
+        : image_texture(texture_registry::global().load(filename, format)) {}
 
-    color value(double u, double v, const point3 &p) const override
+    explicit image_texture(texture_registry::handle image) : image(std::move(image)) {}
+
+    color value(double u, double v, const point3 &p) const override { return value_filtered(u, v, 0, p); }
+
+    color value_filtered(double u, double v, double width, const point3 &p) const override
+    {
+        return sample(image.get().get(), u, v, width);
+    }
+
+    // Lookup on a decoded image, or solid cyan as a debugging aid if there is none.
+    static color sample(const mipmap *levels, double u, double v, double width)
     {
-        // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0)
+        if (!levels || levels->empty())
             return color(0, 1, 1);
 
         // Clamp input texture coordinates to [0,1] x [1,0]
         u = interval(0, 1).clamp(u);
         v = 1.0 - interval(0, 1).clamp(v); // Flip V to image coordinates
 
-        auto i = int(u * image.width());
-        auto j = int(v * image.height());
-        auto pixel = image.pixel_data(i, j);
-
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+        return levels->sample(u, v, width);
     }
 
+    // Size of the shared image, which only counts once however many textures use it.
+    size_t memory_bytes() const { return image.get() ? image.get()->memory_bytes() : 0; }
+
 private:
-    rtw_image image;
+    friend class texture_program;
+
+    texture_registry::handle image;
 };
 
 class noise_texture : public texture
@@ -87,9 +128,21 @@ class noise_texture : public texture
 public:
     noise_texture(double scale,  const color& c = color(1,1,1)) : scale(scale), color_mult(c) {}
 
+    // Bakes the noise over `region` with `samples_per_cell` grid samples across each lattice
+    // cell; lookups inside the region then read the grid (see noise_grid). Returns false if
+    // the grid would be too large.
+    bool bake(const aabb &region, double samples_per_cell)
+    {
+        baked = noise_grid(region, 1.0 / (scale * samples_per_cell), [this](const point3 &p)
+                           { return noise.noise(scale * p); });
+        return !baked.empty();
+    }
+
     color value(double u, double v, const point3 &p) const override
     {
-        double noise_val = noise.noise(scale * p);
+        double noise_val;
+        if (!baked.sample(p, noise_val))
+            noise_val = noise.noise(scale * p);
         double brightened = 0.4 + 0.7 * noise_val;  // Remap from [0,1] to [0.3, 1.0]
         return color_mult * brightened;
     }
@@ -98,6 +151,7 @@ private:
     perlin noise;
     double scale;
     color color_mult;
+    noise_grid baked;
 };
 
 class turb_noise_texture : public texture
@@ -105,15 +159,27 @@ class turb_noise_texture : public texture
 public:
     turb_noise_texture(double scale,  const color& c = color(1,1,1)) : scale(scale), color_mult(c) {}
 
+    // As noise_texture::bake. The samples are spaced for the first octave, so the finer octaves
+    // are smoothed out.
+    bool bake(const aabb &region, double samples_per_cell)
+    {
+        baked = noise_grid(region, 1.0 / samples_per_cell, [this](const point3 &p) { return noise.turb(p, 6); });
+        return !baked.empty();
+    }
+
     color value(double u, double v, const point3 &p) const override
     {
-        return color_mult * noise.turb(p, 6);
+        double turbulence;
+        if (!baked.sample(p, turbulence))
+            turbulence = noise.turb(p, 6);
+        return color_mult * turbulence;
     }
 
 private:
     perlin noise;
     double scale;
     color color_mult;
+    noise_grid baked;
 };
 
 class debug_lattice_texture : public texture
@@ -0,0 +1,474 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "mapped_file.h"
+#include "mipmap.h"
+#include "rtw_stb_image.h"
+#include "texture.h"
+
+// Header of a `.rttex` file: an image's mip chain cut into square sRGB8 tiles. The level table
+// follows the header, then the tiles of each level in turn, row by row. Edge tiles are padded
+// to full size so every tile sits at a fixed offset.
+struct tiled_texture_header
+{
+    static constexpr char expected_magic[8] = {'R', 'T', 'T', 'E', 'X', '\0', '\0', '\0'};
+    static constexpr uint32_t current_version = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t tile_size;
+    uint32_t level_count;
+    uint32_t reserved;
+    uint64_t source_bytes;
+    int64_t source_mtime;
+};
+
+// Out-of-core image textures. Each image is converted once into a tiled mip file next to it
+// (`<path>.rttex`, or in the temp directory when the image's own can't be written); tiles are
+// then read on demand into a fixed pool of slots sized by a byte budget, and the pool evicts
+// with the clock approximation of LRU when it is full. Only the tiles that rays actually
+// touch, at the mip levels their footprints select, are ever resident.
+//
+// Lookups that hit are lock-free. A slot's key names the tile it holds and is cleared while
+// the slot is being refilled, so a reader checks the key before and after copying a texel
+// and falls back to the miss path if the slot changed under it. Slots are never freed while
+// the cache lives, so a reader can't touch released memory. A miss only takes the lock to
+// claim a slot; the tile is read from disk outside it, so misses don't queue behind each
+// other's I/O.
+class texture_cache
+{
+public:
+    static constexpr int tile_size = 64;
+    static constexpr size_t tile_bytes = 3 * tile_size * tile_size;
+
+    struct statistics
+    {
+        uint64_t lookups = 0;   // Texel fetches
+        uint64_t misses = 0;    // Tiles read from disk
+        uint64_t evictions = 0;
+        size_t resident_bytes = 0;
+        size_t budget_bytes = 0;
+
+        double hit_rate() const { return lookups ? 1.0 - double(misses) / lookups : 1.0; }
+    };
+
+    // One registered image.
+    class image
+    {
+    public:
+        int width() const { return levels[0].width; }
+        int height() const { return levels[0].height; }
+
+    private:
+        friend class texture_cache;
+
+        struct level
+        {
+            int width, height;
+            int tiles_x;
+            uint32_t first_tile;
+        };
+
+        std::vector<level> levels;
+        uint32_t first_key = 0;                             // Cache-wide key of tile 0, minus one
+        std::unique_ptr<std::atomic<int32_t>[]> tile_slots; // Slot holding each tile, -1, or loading
+        random_access_file file;
+        uint64_t data_offset = 0;
+    };
+
+    // Keeps at most `budget_bytes` of tiles resident (but at least a few hundred tiles, so
+    // concurrent filtered lookups can't evict each other's footprints).
+    explicit texture_cache(size_t budget_bytes)
+        : slot_count(std::max<size_t>(budget_bytes / tile_bytes, 256)),
+          slots(new slot[slot_count]),
+          slot_data(new std::atomic<unsigned char>[slot_count * tile_bytes]()) {}
+
+    texture_cache(const texture_cache &) = delete;
+    texture_cache &operator=(const texture_cache &) = delete;
+
+    // Registers the image at `path`, converting it to a tiled file first if there is no
+    // up-to-date one. Safe to call from several threads. Returns null if the image can't be
+    // read.
+    const image *add(const std::string &path)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = by_path.find(path);
+            if (found != by_path.end())
+                return found->second;
+        }
+
+        // Conversion is the expensive part and needs no shared state, so it runs unlocked.
+        auto entry = std::make_unique<image>();
+        if (!open_tiled(path, *entry))
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = by_path.find(path);
+        if (found != by_path.end())
+            return found->second;
+
+        const auto &last = entry->levels.back();
+        uint32_t tile_count = last.first_tile + uint32_t(last.tiles_x) * tiles_along(last.height);
+        entry->first_key = next_key;
+        next_key += tile_count;
+        entry->tile_slots.reset(new std::atomic<int32_t>[tile_count]);
+        for (uint32_t t = 0; t < tile_count; t++)
+            entry->tile_slots[t].store(-1, std::memory_order_relaxed);
+
+        const image *result = entry.get();
+        images.push_back(std::move(entry));
+        by_path[path] = result;
+        return result;
+    }
+
+    // Trilinear lookup at (u, v) in [0,1]^2 (v pointing down the image) for a footprint
+    // `width` texture units wide; see mipmap::sample.
+    color sample(const image &img, double u, double v, double width)
+    {
+        double lod = mip_lod(width, img.width(), img.height(), int(img.levels.size()));
+        int fine = int(lod);
+        double blend = lod - fine;
+        color c = bilinear(img, fine, u, v);
+        int fetches = 4;
+        if (blend > 0 && fine + 1 < int(img.levels.size()))
+        {
+            c = (1 - blend) * c + blend * bilinear(img, fine + 1, u, v);
+            fetches = 8;
+        }
+        shard_for_this_thread(lookup_counts).value.fetch_add(fetches, std::memory_order_relaxed);
+        return c;
+    }
+
+    statistics stats() const
+    {
+        statistics s;
+        for (const auto &shard : lookup_counts)
+            s.lookups += shard.value.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex);
+        s.misses = misses;
+        s.evictions = evictions;
+        s.resident_bytes = resident_slots * tile_bytes;
+        s.budget_bytes = slot_count * tile_bytes;
+        return s;
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<uint32_t> key{0};       // Cache-wide key of the tile held, 0 while empty or filling
+        std::atomic<uint8_t> referenced{0}; // Clock bit, set by hits
+        std::atomic<bool> filling{false};   // Claimed by a miss whose read is in flight
+        image *owner = nullptr;             // Guarded by `mutex`
+        uint32_t tile = 0;
+    };
+
+    static constexpr int32_t loading = -2; // In tile_slots: a miss is reading the tile
+
+    // Lookup counters, spread over cache lines so threads don't contend on one.
+    struct alignas(64) counter
+    {
+        std::atomic<uint64_t> value{0};
+    };
+    static constexpr int counter_shards = 16;
+
+    const size_t slot_count;
+    std::unique_ptr<slot[]> slots;
+    std::unique_ptr<std::atomic<unsigned char>[]> slot_data;
+    counter lookup_counts[counter_shards];
+
+    mutable std::mutex mutex; // Guards everything below and the miss path
+    std::vector<std::unique_ptr<image>> images;
+    std::unordered_map<std::string, const image *> by_path;
+    uint32_t next_key = 1;
+    size_t clock_hand = 0;
+    size_t resident_slots = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    static uint32_t tiles_along(int texels) { return uint32_t((texels + tile_size - 1) / tile_size); }
+
+    static counter &shard_for_this_thread(counter *shards)
+    {
+        thread_local size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % counter_shards;
+        return shards[index];
+    }
+
+    color bilinear(const image &img, int level, double u, double v)
+    {
+        const auto &l = img.levels[level];
+        return bilinear_filter(l.width, l.height, u, v, [&](int x, int y, float *rgb)
+                               {
+                                   unsigned char srgb[3];
+                                   fetch(img, level, x, y, srgb);
+                                   decode_texel(texel_format::srgb8, srgb, rgb);
+                               });
+    }
+
+    void fetch(const image &img, int level, int x, int y, unsigned char *out)
+    {
+        const auto &l = img.levels[level];
+        uint32_t tile = l.first_tile + uint32_t(y / tile_size) * l.tiles_x + uint32_t(x / tile_size);
+        uint32_t key = img.first_key + tile;
+        size_t offset = 3 * (size_t(y % tile_size) * tile_size + size_t(x % tile_size));
+
+        while (true)
+        {
+            int32_t s = img.tile_slots[tile].load(std::memory_order_acquire);
+            if (s >= 0)
+            {
+                slot &held = slots[s];
+                if (held.key.load(std::memory_order_acquire) == key)
+                {
+                    const std::atomic<unsigned char> *texel = &slot_data[size_t(s) * tile_bytes + offset];
+                    for (int k = 0; k < 3; k++)
+                        out[k] = texel[k].load(std::memory_order_relaxed);
+
+                    // Valid only if the slot still holds the tile after the copy.
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (held.key.load(std::memory_order_relaxed) == key)
+                    {
+                        if (!held.referenced.load(std::memory_order_relaxed))
+                            held.referenced.store(1, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+            }
+            load_tile(const_cast<image &>(img), tile);
+        }
+    }
+
+    // Miss path: reads `tile` into a free or evicted slot. Returns early, for the caller to
+    // look again, if the tile turns up or another thread is already reading it.
+    void load_tile(image &img, uint32_t tile)
+    {
+        size_t victim;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            // Another thread may have loaded it in the meantime, or be loading it now.
+            int32_t current = img.tile_slots[tile].load(std::memory_order_relaxed);
+            if (current >= 0 && slots[current].key.load(std::memory_order_relaxed) == img.first_key + tile)
+                return;
+            if (current == loading)
+            {
+                lock.unlock();
+                std::this_thread::yield();
+                return;
+            }
+
+            // Slots being filled are passed over; there are far more slots than threads.
+            while (true)
+            {
+                victim = clock_hand;
+                clock_hand = (clock_hand + 1) % slot_count;
+                slot &candidate = slots[victim];
+                if (candidate.filling.load(std::memory_order_acquire))
+                    continue;
+                if (!candidate.owner)
+                {
+                    resident_slots++;
+                    break;
+                }
+                if (!candidate.referenced.load(std::memory_order_relaxed))
+                {
+                    candidate.owner->tile_slots[candidate.tile].store(-1, std::memory_order_relaxed);
+                    evictions++;
+                    break;
+                }
+                candidate.referenced.store(0, std::memory_order_relaxed);
+            }
+
+            // Seqlock-style refill: clearing the key first means readers that see the old key
+            // before and after their copy can't have read a byte written below.
+            slot &target = slots[victim];
+            target.key.store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            target.filling.store(true, std::memory_order_relaxed);
+            target.owner = &img;
+            target.tile = tile;
+            img.tile_slots[tile].store(loading, std::memory_order_relaxed);
+            misses++;
+        }
+
+        unsigned char buffer[tile_bytes];
+        if (!img.file.read(img.data_offset + uint64_t(tile) * tile_bytes, buffer, tile_bytes))
+            std::memset(buffer, 0, tile_bytes);
+
+        slot &target = slots[victim];
+        std::atomic<unsigned char> *data = &slot_data[victim * tile_bytes];
+        for (size_t i = 0; i < tile_bytes; i++)
+            data[i].store(buffer[i], std::memory_order_relaxed);
+        target.referenced.store(1, std::memory_order_relaxed);
+        target.key.store(img.first_key + tile, std::memory_order_release);
+        img.tile_slots[tile].store(int32_t(victim), std::memory_order_release);
+        target.filling.store(false, std::memory_order_release);
+    }
+
+    // Opens the tiled file for `path`, writing it first if it is missing or stale: next to the
+    // image, or in the temp directory if the image's directory is read-only.
+    static bool open_tiled(const std::string &path, image &img)
+    {
+        uint64_t source_bytes;
+        int64_t source_mtime;
+        if (!file_stamp(path, source_bytes, source_mtime))
+        {
+            std::cerr << "ERROR: Could not load image file '" << path << "'.\n";
+            return false;
+        }
+
+        std::vector<std::string> tiled_paths = {path + ".rttex"};
+        std::error_code error;
+        auto temp_directory = std::filesystem::temp_directory_path(error);
+        if (!error)
+        {
+            // Named by the image's absolute path, so images with the same file name don't share.
+            auto absolute = std::filesystem::absolute(path, error).string();
+            auto name = std::filesystem::path(path).filename().string() + "." +
+                        std::to_string(std::hash<std::string>()(error ? path : absolute)) + ".rttex";
+            tiled_paths.push_back((temp_directory / name).string());
+        }
+
+        for (const auto &tiled_path : tiled_paths)
+            if (read_tiled(tiled_path, source_bytes, source_mtime, img))
+                return true;
+
+        mipmap chain{rtw_image(path.c_str(), texel_format::srgb8)};
+        if (chain.empty())
+            return false;
+        for (const auto &tiled_path : tiled_paths)
+            if (write_tiled(tiled_path, chain, source_bytes, source_mtime) &&
+                read_tiled(tiled_path, source_bytes, source_mtime, img))
+                return true;
+
+        std::cerr << "Could not write tiled texture " << tiled_paths[0] << " or a temporary copy\n";
+        return false;
+    }
+
+    static bool read_tiled(const std::string &tiled_path, uint64_t source_bytes, int64_t source_mtime, image &img)
+    {
+        std::ifstream in(tiled_path, std::ios::binary);
+        if (!in.is_open())
+            return false;
+
+        tiled_texture_header header;
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, tiled_texture_header::expected_magic, sizeof(header.magic)) != 0 ||
+            header.version != tiled_texture_header::current_version || header.tile_size != uint32_t(tile_size) ||
+            header.source_bytes != source_bytes || header.source_mtime != source_mtime ||
+            header.level_count == 0 || header.level_count > 32)
+            return false;
+
+        img.levels.clear();
+        uint32_t first_tile = 0;
+        for (uint32_t i = 0; i < header.level_count; i++)
+        {
+            int32_t size[2];
+            if (!in.read(reinterpret_cast<char *>(size), sizeof(size)) || size[0] <= 0 || size[1] <= 0)
+                return false;
+            image::level l{size[0], size[1], int(tiles_along(size[0])), first_tile};
+            first_tile += uint32_t(l.tiles_x) * tiles_along(l.height);
+            img.levels.push_back(l);
+        }
+        img.data_offset = uint64_t(in.tellg());
+
+        std::error_code error;
+        auto file_bytes = std::filesystem::file_size(tiled_path, error);
+        return !error && file_bytes == img.data_offset + uint64_t(first_tile) * tile_bytes && img.file.open(tiled_path);
+    }
+
+    static bool write_tiled(const std::string &tiled_path, const mipmap &chain, uint64_t source_bytes,
+                            int64_t source_mtime)
+    {
+        tiled_texture_header header = {};
+        std::memcpy(header.magic, tiled_texture_header::expected_magic, sizeof(header.magic));
+        header.version = tiled_texture_header::current_version;
+        header.tile_size = tile_size;
+        header.level_count = uint32_t(chain.level_count());
+        header.source_bytes = source_bytes;
+        header.source_mtime = source_mtime;
+
+        // A temporary name of its own, so concurrent writers don't write into each other's.
+        std::string temp_path = tiled_path + "." + std::to_string(std::random_device()()) + ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            if (!out.is_open())
+                return false;
+
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            for (int i = 0; i < chain.level_count(); i++)
+            {
+                int32_t size[2] = {chain.level_width(i), chain.level_height(i)};
+                out.write(reinterpret_cast<const char *>(size), sizeof(size));
+            }
+
+            std::vector<unsigned char> tile(tile_bytes);
+            for (int i = 0; i < chain.level_count(); i++)
+            {
+                int w = chain.level_width(i), h = chain.level_height(i);
+                const unsigned char *texels = chain.level_data(i);
+                for (int ty = 0; ty < h; ty += tile_size)
+                {
+                    for (int tx = 0; tx < w; tx += tile_size)
+                    {
+                        std::fill(tile.begin(), tile.end(), 0);
+                        int rows = std::min(tile_size, h - ty), cols = std::min(tile_size, w - tx);
+                        for (int y = 0; y < rows; y++)
+                            std::copy_n(texels + 3 * (size_t(ty + y) * w + tx), 3 * cols, &tile[3 * size_t(y) * tile_size]);
+                        out.write(reinterpret_cast<const char *>(tile.data()), std::streamsize(tile.size()));
+                    }
+                }
+            }
+            if (!out)
+                return false;
+        }
+
+        std::error_code error;
+        std::filesystem::rename(temp_path, tiled_path, error);
+        if (error)
+        {
+            std::filesystem::remove(temp_path, error);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Image texture read through a texture_cache instead of being held in memory.
+class cached_image_texture : public texture
+{
+public:
+    cached_image_texture(shared_ptr<texture_cache> cache, const texture_cache::image *img)
+        : cache(std::move(cache)), img(img) {}
+
+    color value(double u, double v, const point3 &p) const override { return value_filtered(u, v, 0, p); }
+
+    color value_filtered(double u, double v, double width, const point3 &p) const override
+    {
+        // Same addressing as image_texture.
+        u = interval(0, 1).clamp(u);
+        v = 1.0 - interval(0, 1).clamp(v);
+        return cache->sample(*img, u, v, width);
+    }
+
+private:
+    shared_ptr<texture_cache> cache;
+    const texture_cache::image *img;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef TEXTURE_PROGRAM_H
+#define TEXTURE_PROGRAM_H
+
+#include <cstdint>
+#include <vector>
+
+#include "rtweekend.h"
+#include "texture.h"
+
+// A texture tree compiled into a flat array of nodes, which is what materials evaluate:
+//  - solid colors fold into constants, and a checker whose two sides fold to the same constant
+//    folds with them, so a plain color is held inline with no node array at all;
+//  - checkers become nodes that jump to one child by index;
+//  - image textures sample their decoded mip chain directly;
+//  - any other texture (noise, the texture cache, ...) stays a leaf behind a virtual call.
+// Evaluation walks from the root to a leaf in one loop: a checker only ever picks one child,
+// so no stack is needed.
+//
+// Textures are compiled as they are when the program is built; the program keeps the tree
+// alive for its leaves. An image texture's decode is waited for at compile time.
+class texture_program
+{
+public:
+    explicit texture_program(const color &c) : constant_value(c) {}
+
+    explicit texture_program(shared_ptr<texture> root) : source(std::move(root))
+    {
+        uint32_t index = compile(source.get());
+        if (nodes[index].code == op::constant)
+        {
+            constant_value = nodes[index].value;
+            nodes.clear();
+            nodes.shrink_to_fit();
+        }
+    }
+
+    bool is_constant() const { return nodes.empty(); }
+
+    // Same result as the source texture's value_filtered().
+    color evaluate(double u, double v, double width, const point3 &p) const
+    {
+        if (nodes.empty())
+            return constant_value;
+
+        const node *n = &nodes[0];
+        while (true)
+        {
+            switch (n->code)
+            {
+            case op::constant:
+                return n->value;
+            case op::checker:
+            {
+                auto xInteger = int(std::floor(n->inv_scale * p.x()));
+                auto yInteger = int(std::floor(n->inv_scale * p.y()));
+                auto zInteger = int(std::floor(n->inv_scale * p.z()));
+                bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+                n = &nodes[isEven ? n->even : n->odd];
+                break;
+            }
+            case op::image:
+                return image_texture::sample(n->image, u, v, width);
+            case op::leaf:
+                return n->leaf->value_filtered(u, v, width, p);
+            }
+        }
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Rough mean color over the texture's uv square: exact for a constant, otherwise the mean
+    // of a grid of lookups at the origin. Meant for weighting lights, not for shading.
+    color average() const
+    {
+        if (nodes.empty())
+            return constant_value;
+
+        const int n = 8;
+        color sum(0, 0, 0);
+        for (int i = 0; i < n; i++)
+            for (int j = 0; j < n; j++)
+                sum += evaluate((i + 0.5) / n, (j + 0.5) / n, 1.0 / n, point3(0, 0, 0));
+        return sum / (n * n);
+    }
+
+private:
+    enum class op : uint8_t
+    {
+        constant,
+        checker,
+        image,
+        leaf
+    };
+
+    struct node
+    {
+        op code;
+        uint32_t even = 0, odd = 0; // Children of a checker
+        double inv_scale = 0;
+        color value;                  // Constant
+        const mipmap *image = nullptr;
+        const texture *leaf = nullptr;
+    };
+
+    color constant_value;
+    std::vector<node> nodes; // Root first; empty when the program is constant
+    shared_ptr<texture> source;
+
+    // Appends the nodes for `tex` (children after their parent) and returns its index.
+    uint32_t compile(const texture *tex)
+    {
+        auto index = uint32_t(nodes.size());
+        nodes.push_back(node());
+
+        if (auto solid = dynamic_cast<const solid_color *>(tex))
+        {
+            nodes[index].code = op::constant;
+            nodes[index].value = solid->albedo;
+        }
+        else if (auto checker = dynamic_cast<const checker_texture *>(tex))
+        {
+            uint32_t even = compile(checker->even.get());
+            uint32_t odd = compile(checker->odd.get());
+            if (nodes[even].code == op::constant && nodes[odd].code == op::constant &&
+                same(nodes[even].value, nodes[odd].value))
+            {
+                nodes[index].code = op::constant;
+                nodes[index].value = nodes[even].value;
+                nodes.resize(index + 1);
+            }
+            else
+            {
+                nodes[index].code = op::checker;
+                nodes[index].inv_scale = checker->inv_scale;
+                nodes[index].even = even;
+                nodes[index].odd = odd;
+            }
+        }
+        else if (auto image = dynamic_cast<const image_texture *>(tex))
+        {
+            nodes[index].code = op::image;
+            nodes[index].image = image->image.get().get();
+        }
+        else
+        {
+            nodes[index].code = op::leaf;
+            nodes[index].leaf = tex;
+        }
+        return index;
+    }
+
+    static bool same(const color &a, const color &b) { return a.x() == b.x() && a.y() == b.y() && a.z() == b.z(); }
+};
+
+#endif
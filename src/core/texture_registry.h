@@ -0,0 +1,195 @@
+#ifndef TEXTURE_REGISTRY_H
+#define TEXTURE_REGISTRY_H
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+#include "rtweekend.h"
+#include "mapped_file.h"
+#include "mipmap.h"
+#include "rtw_stb_image.h"
+#include "texel_format.h"
+#include "thread_pool.h"
+
+// Process-wide cache of decoded images. Every request for the same file (by resolved path) and
+// texel format gets the same handle, and files with identical contents under different paths
+// end up sharing one decoded copy as well. Decoding runs on the registry's own threads, so
+// `load` returns at once and a batch of requests decodes in parallel; a handle only blocks when
+// its image is first needed.
+//
+// Images stay loaded for the life of the process.
+class texture_registry
+{
+public:
+    // The decoded image, or null if the file couldn't be found or decoded.
+    using handle = std::shared_future<shared_ptr<const mipmap>>;
+
+    struct statistics
+    {
+        size_t requests = 0;
+        size_t decoded = 0;          // Files actually decoded
+        size_t shared_by_path = 0;   // Requests answered with an existing handle
+        size_t shared_by_content = 0; // Decoded files that turned out to duplicate another one
+    };
+
+    static texture_registry &global()
+    {
+        static texture_registry registry;
+        return registry;
+    }
+
+    // Starts `num_threads` decoding threads (0: one per hardware thread).
+    explicit texture_registry(int num_threads = 0) : pool(num_threads) {}
+
+    texture_registry(const texture_registry &) = delete;
+    texture_registry &operator=(const texture_registry &) = delete;
+
+    // Requests `filename`, found as rtw_image::find does, with texels stored in `format`.
+    handle load(const std::string &filename, texel_format format = texel_format::srgb8)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counts.requests++;
+
+        // Remember where each name was found, so the image directories are searched once.
+        auto found = resolved_names.find(filename);
+        if (found == resolved_names.end())
+        {
+            auto path = rtw_image::find(filename.c_str());
+            std::error_code error;
+            if (!path.empty())
+                path = std::filesystem::weakly_canonical(path, error).string();
+            found = resolved_names.emplace(filename, path).first;
+        }
+        const auto &path = found->second;
+        if (path.empty())
+        {
+            std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+            std::promise<shared_ptr<const mipmap>> missing;
+            missing.set_value(nullptr);
+            return missing.get_future().share();
+        }
+
+        auto key = path + "#" + std::to_string(int(format));
+        auto existing = by_path.find(key);
+        if (existing != by_path.end())
+        {
+            counts.shared_by_path++;
+            return existing->second;
+        }
+
+        handle h = pool.submit([this, path, format]() { return decode(path, format); }).share();
+        by_path.emplace(key, h);
+        return h;
+    }
+
+    statistics stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counts;
+    }
+
+private:
+    using content_key = std::tuple<uint64_t, size_t, int>; // Hash, size, format
+
+    // A decoded file, and where it came from to compare other files' bytes against.
+    struct decoded_file
+    {
+        shared_ptr<const mipmap> levels;
+        std::string path;
+    };
+
+    mutable std::mutex mutex; // Guards everything below
+    std::unordered_map<std::string, std::string> resolved_names; // Requested name -> canonical path, or ""
+    std::unordered_map<std::string, handle> by_path;              // Canonical path and format
+    std::map<content_key, decoded_file> by_content;
+    statistics counts;
+
+    thread_pool pool; // Last, so its destructor finishes queued decodes while the maps still exist
+
+    shared_ptr<const mipmap> decode(const std::string &path, texel_format format)
+    {
+        mapped_file file;
+        if (!file.open(path))
+        {
+            std::cerr << "ERROR: Could not load image file '" << path << "'.\n";
+            return nullptr;
+        }
+
+        // A matching key only shares a decoded copy once the bytes compare equal too: the hash
+        // is no proof, and a collision would silently render the wrong texture.
+        auto bytes = reinterpret_cast<const unsigned char *>(file.data());
+        content_key key{content_hash(bytes, file.size()), file.size(), int(format)};
+        decoded_file candidate;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto same = by_content.find(key);
+            if (same != by_content.end())
+                candidate = same->second;
+        }
+        if (candidate.levels && same_bytes(candidate.path, bytes, file.size()))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counts.shared_by_content++;
+            return candidate.levels;
+        }
+
+        rtw_image image(bytes, file.size(), format);
+        if (image.width() == 0)
+        {
+            std::cerr << "ERROR: Could not decode image file '" << path << "'.\n";
+            return nullptr;
+        }
+        auto levels = std::make_shared<const mipmap>(image);
+
+        // Two copies of one file may have been decoded at once; keep whichever finished first.
+        // A different file under the same key keeps its own copy, unregistered.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counts.decoded++;
+            auto inserted = by_content.emplace(key, decoded_file{levels, path});
+            if (inserted.second)
+                return levels;
+            candidate = inserted.first->second;
+        }
+        if (!same_bytes(candidate.path, bytes, file.size()))
+            return levels;
+        std::lock_guard<std::mutex> lock(mutex);
+        counts.shared_by_content++;
+        return candidate.levels;
+    }
+
+    // Whether the file at `path` holds exactly `size` bytes equal to `bytes`.
+    static bool same_bytes(const std::string &path, const unsigned char *bytes, size_t size)
+    {
+        mapped_file other;
+        return other.open(path) && other.size() == size && std::memcmp(other.data(), bytes, size) == 0;
+    }
+
+    // 64-bit hash of a file's bytes, eight at a time.
+    static uint64_t content_hash(const unsigned char *bytes, size_t size)
+    {
+        const uint64_t multiplier = 0x9e3779b97f4a7c15ull;
+        uint64_t h = 0xcbf29ce484222325ull ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            h = (h ^ word) * multiplier;
+            h ^= h >> 29;
+        }
+        for (; i < size; i++)
+            h = (h ^ bytes[i]) * multiplier;
+        return h ^ (h >> 32);
+    }
+};
+
+#endif
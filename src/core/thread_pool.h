@@ -0,0 +1,85 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads running submitted tasks in FIFO order. Used for loading
+// independent assets concurrently; the destructor finishes every queued task before joining.
+class thread_pool
+{
+public:
+    // Starts `num_threads` workers (0: one per hardware thread).
+    explicit thread_pool(int num_threads = 0)
+    {
+        if (num_threads <= 0)
+            num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+        for (int i = 0; i < num_threads; i++)
+            workers.emplace_back([this]() { run(); });
+    }
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Queues `task` and returns a future for its result. Exceptions thrown by the task are
+    // delivered through the future.
+    template <typename F>
+    auto submit(F &&task) -> std::future<std::invoke_result_t<std::decay_t<F>>>
+    {
+        using result = std::invoke_result_t<std::decay_t<F>>;
+        auto packaged = std::make_shared<std::packaged_task<result()>>(std::forward<F>(task));
+        auto future = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace([packaged]() { (*packaged)(); });
+        }
+        wake.notify_one();
+        return future;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.h"
+
+// A rotation followed by a translation, mapping an object's local space to world space. This
+// is what any chain of `translate` and `rotate_y` wrappers amounts to, so a chain can be
+// collapsed into one of these.
+class rigid_transform
+{
+public:
+    // Images of the local x, y and z axes; an orthonormal basis.
+    vec3 axis[3] = {vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1)};
+    vec3 offset = vec3(0, 0, 0);
+
+    rigid_transform() {}
+
+    static rigid_transform translation(const vec3 &offset)
+    {
+        rigid_transform t;
+        t.offset = offset;
+        return t;
+    }
+
+    // Rotation about the Y axis, with the sign convention of `rotate_y`.
+    static rigid_transform rotation_y(double sin_theta, double cos_theta)
+    {
+        rigid_transform t;
+        t.axis[0] = vec3(cos_theta, 0, -sin_theta);
+        t.axis[2] = vec3(sin_theta, 0, cos_theta);
+        return t;
+    }
+
+    // The transform that applies `inner` first and then this one.
+    rigid_transform operator*(const rigid_transform &inner) const
+    {
+        rigid_transform t;
+        for (int i = 0; i < 3; i++)
+            t.axis[i] = vector(inner.axis[i]);
+        t.offset = point(inner.offset);
+        return t;
+    }
+
+    bool has_rotation() const
+    {
+        return !(equal(axis[0], vec3(1, 0, 0)) && equal(axis[1], vec3(0, 1, 0)) && equal(axis[2], vec3(0, 0, 1)));
+    }
+
+    bool is_identity() const { return !has_rotation() && equal(offset, vec3(0, 0, 0)); }
+
+    vec3 vector(const vec3 &v) const { return v.x() * axis[0] + v.y() * axis[1] + v.z() * axis[2]; }
+    point3 point(const point3 &p) const { return vector(p) + offset; }
+
+    vec3 inverse_vector(const vec3 &v) const { return vec3(dot(v, axis[0]), dot(v, axis[1]), dot(v, axis[2])); }
+    point3 inverse_point(const point3 &p) const { return inverse_vector(p - offset); }
+
+    // World bounds of a local box: the box around its eight transformed corners.
+    aabb bounds(const aabb &box) const
+    {
+        if (!has_rotation())
+            return box + offset;
+
+        aabb result = aabb::empty;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            point3 p(corner & 1 ? box.x.max : box.x.min,
+                     corner & 2 ? box.y.max : box.y.min,
+                     corner & 4 ? box.z.max : box.z.min);
+            p = point(p);
+            result = aabb(result, aabb(p, p));
+        }
+        return result;
+    }
+
+private:
+    static bool equal(const vec3 &a, const vec3 &b) { return a.x() == b.x() && a.y() == b.y() && a.z() == b.z(); }
+};
+
+#endif
@@ -5,61 +5,97 @@
 #include "hittable.h"
 #include "hittable_list.h"
 
+// Texture density of a triangle for ray cone filtering: the square root of the ratio between
+// its area in texture space and on the surface. `e1`, `e2` are the edges from the first
+// corner, `t0`..`t2` the corners' texture coordinates.
+inline double triangle_uv_density(const vec3 &e1, const vec3 &e2, const point2 &t0, const point2 &t1, const point2 &t2)
+{
+    double area = cross(e1, e2).length();
+    double uv_area = std::fabs((t1.u() - t0.u()) * (t2.v() - t0.v()) - (t1.v() - t0.v()) * (t2.u() - t0.u()));
+    return area > 0 ? std::sqrt(uv_area / area) : 0.0;
+}
+
 class triangle : public hittable {
 public:
     triangle(const point3& p1, const point3& p2, const point3& p3, const point2& t1, const point2& t2, const point2& t3, shared_ptr<material> mat)
-      : p1(p1), p2(p2), p3(p3), t1(t1), t2(t2), t3(t3), mat(mat)
+      : p1(p1), e1(p2 - p1), e2(p3 - p1),
+        tex{geom_real(t1.u()), geom_real(t1.v()), geom_real(t2.u()), geom_real(t2.v()), geom_real(t3.u()), geom_real(t3.v())},
+        has_tex_coords(!(t1 == t2 && t2 == t3)), mat(material_table::global().add(mat))
+    {}
+
+    shared_ptr<hittable> transformed_copy(const rigid_transform &to_world) const override
     {
-        e1 = p2 - p1;
-        e2 = p3 - p1;
-
-        normal = unit_vector(cross(e1, e2));
-
-        point3 min = point3(std::fmin(p1.x(), std::fmin(p2.x(), p3.x())),
-                            std::fmin(p1.y(), std::fmin(p2.y(), p3.y())),
-                            std::fmin(p1.z(), std::fmin(p2.z(), p3.z())));
-        point3 max = point3(std::fmax(p1.x(), std::fmax(p2.x(), p3.x())),
-                            std::fmax(p1.y(), std::fmax(p2.y(), p3.y())),
-                            std::fmax(p1.z(), std::fmax(p2.z(), p3.z())));
-        bbox = aabb(min, max);
+        point3 a = p1.to_vec3();
+        return make_shared<triangle>(to_world.point(a), to_world.point(a + e1.to_vec3()), to_world.point(a + e2.to_vec3()),
+                                     point2(tex[0], tex[1]), point2(tex[2], tex[3]), point2(tex[4], tex[5]), material_table::global().owner(mat));
     }
 
-    aabb bounding_box() const override { return bbox; }
+    aabb bounding_box() const override
+    {
+        // Bound the vertices as stored, so the box encloses exactly what hit() intersects.
+        point3 a = p1.to_vec3();
+        point3 b = a + e1.to_vec3();
+        point3 c = a + e2.to_vec3();
+
+        point3 min = point3(std::fmin(a.x(), std::fmin(b.x(), c.x())),
+                            std::fmin(a.y(), std::fmin(b.y(), c.y())),
+                            std::fmin(a.z(), std::fmin(b.z(), c.z())));
+        point3 max = point3(std::fmax(a.x(), std::fmax(b.x(), c.x())),
+                            std::fmax(a.y(), std::fmax(b.y(), c.y())),
+                            std::fmax(a.z(), std::fmax(b.z(), c.z())));
+        return aabb(min, max);
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override
     {
-        vec3 o = r.origin();
-        vec3 d = r.direction();
+        // Moller-Trumbore in geometry precision. The barycentric tests are widened by the
+        // rounding error bound so rays through a shared edge cannot slip between triangles.
+        const geom_real eps = geom_gamma(8);
+
+        const geom_vec3& o = r.origin_g();
+        geom_vec3 d(r.direction());
 
-        vec3 pvec = cross(d, e2);
-        double det = dot(e1, pvec);
+        geom_vec3 pvec = cross(d, e2);
+        geom_real det = dot(e1, pvec);
 
-        if (std::fabs(det) < 1e-8)
+        if (std::fabs(det) < geom_real(1e-8))
             return false;
 
-        double inv_det = 1.0 / det;
+        geom_real inv_det = 1 / det;
 
-        vec3 tvec = o - p1;
-        double u = dot(tvec, pvec) * inv_det;
+        geom_vec3 tvec = o - p1;
+        geom_real u = dot(tvec, pvec) * inv_det;
 
-        if (u < 0.0 || u > 1.0)
+        if (u < -eps || u > 1 + eps)
             return false;
 
-        vec3 qvec = cross(tvec, e1);
-        double v = dot(d, qvec) * inv_det;
+        geom_vec3 qvec = cross(tvec, e1);
+        geom_real v = dot(d, qvec) * inv_det;
 
-        if (v < 0.0 || u + v > 1.0)
+        if (v < -eps || u + v > 1 + eps)
             return false;
 
         double t = dot(e2, qvec) * inv_det;
 
         if (!ray_t.contains(t))
             return false;
-        
+
         rec.t = t;
+        rec.prim = this;
+        rec.b0 = u;
+        rec.b1 = v;
+
+        return true;
+    }
+
+    void surface(const ray& r, hit_record& rec) const override
+    {
+        double u = rec.b0;
+        double v = rec.b1;
+
         rec.p = r.at(rec.t);
 
-        if(t1 == t2 && t2 == t3)
+        if(!has_tex_coords)
         {
             rec.u = u;
             rec.v = v;
@@ -67,28 +103,27 @@ public:
         else
         {
             double w = 1.0 - u - v;  // Third barycentric coordinate
-    
+
             // Interpolate texture coordinates
-            double tex_u = w * t1.u() + u * t2.u() + v * t3.u();
-            double tex_v = w * t1.v() + u * t2.v() + v * t3.v();
-    
-            rec.u = tex_u;
-            rec.v = tex_v;
+            rec.u = w * tex[0] + u * tex[2] + v * tex[4];
+            rec.v = w * tex[1] + u * tex[3] + v * tex[5];
         }
-        
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
 
-        return true;
+        // Without texture coordinates (u, v) are the barycentrics, i.e. corners (0,0), (1,0), (0,1).
+        rec.uv_density = has_tex_coords
+            ? triangle_uv_density(e1.to_vec3(), e2.to_vec3(), point2(tex[0], tex[1]), point2(tex[2], tex[3]), point2(tex[4], tex[5]))
+            : triangle_uv_density(e1.to_vec3(), e2.to_vec3(), point2(0, 0), point2(1, 0), point2(0, 1));
+
+        rec.mat = mat;
+        rec.set_face_normal(r, unit_vector(cross(e1.to_vec3(), e2.to_vec3())));
     }
 
 private:
-    point3 p1, p2, p3;
-    point2 t1, t2, t3;
-    vec3 e1, e2;
-    vec3 normal;
-    shared_ptr<material> mat;
-    aabb bbox;
+    geom_vec3 p1;
+    geom_vec3 e1, e2;
+    geom_real tex[6];  // Per-vertex texture coordinates (u, v) for the three corners
+    bool has_tex_coords;
+    material_id mat;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,300 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "triangle.h"
+
+// An indexed triangle mesh stored as one primitive. Vertices are shared between triangles
+// through flat index arrays instead of being copied into a `triangle` object per face, and the
+// triangles are kept in the leaf order of an internal `flat_bvh`.
+//
+// The mesh reads its arrays through plain pointers. They either point into vectors the mesh
+// owns, or into external storage such as a mapped mesh cache file, which the mesh then keeps
+// alive through `owner`.
+class triangle_mesh : public hittable
+{
+public:
+    static constexpr uint32_t no_uv = UINT32_MAX;
+
+    // Maps a source material name to a material, or null if it doesn't know the name.
+    using material_lookup = std::function<shared_ptr<material>(const std::string &)>;
+
+    // Read-only arrays of a mesh whose triangles are already in BVH leaf order.
+    struct view
+    {
+        const float *positions = nullptr;     // xyz per vertex
+        const float *uvs = nullptr;           // uv per texture vertex
+        const uint32_t *indices = nullptr;    // Three vertex indices per triangle
+        const uint32_t *uv_indices = nullptr; // Three texture vertex indices per triangle, or null
+        const uint32_t *material_ids = nullptr; // Material slot per triangle, or null for slot 0
+        const flat_bvh::node *nodes = nullptr;
+        size_t num_vertices = 0;
+        size_t num_uvs = 0;
+        size_t num_triangles = 0;
+        size_t num_nodes = 0;
+    };
+
+    // Builds a mesh from owned arrays. `positions` holds xyz per vertex and `indices` three
+    // vertex indices per triangle. `uvs` (uv per texture vertex) and `uv_indices` (three per
+    // triangle, `no_uv` for a corner without one) may both be empty. `material_ids` holds a
+    // slot into `materials` per triangle, or is empty when every triangle uses slot 0.
+    triangle_mesh(std::vector<float> &&positions, std::vector<uint32_t> &&indices, std::vector<float> &&uvs,
+                  std::vector<uint32_t> &&uv_indices, std::vector<uint32_t> &&material_ids,
+                  std::vector<shared_ptr<material>> materials, std::vector<std::string> material_names = {})
+        : owned_positions(std::move(positions)), owned_indices(std::move(indices)), owned_uvs(std::move(uvs)),
+          owned_uv_indices(std::move(uv_indices)), owned_material_ids(std::move(material_ids)),
+          materials(register_materials(materials)), names(std::move(material_names))
+    {
+        build();
+    }
+
+    triangle_mesh(std::vector<float> &&positions, std::vector<uint32_t> &&indices,
+                  std::vector<float> &&uvs, std::vector<uint32_t> &&uv_indices, shared_ptr<material> mat)
+        : triangle_mesh(std::move(positions), std::move(indices), std::move(uvs), std::move(uv_indices), {}, {mat}) {}
+
+    // Wraps arrays that live elsewhere without copying them. `owner` keeps that storage alive.
+    triangle_mesh(const view &arrays, std::vector<shared_ptr<material>> materials,
+                  std::vector<std::string> material_names, shared_ptr<const void> owner)
+        : arrays(arrays), materials(register_materials(materials)), names(std::move(material_names)),
+          owner(std::move(owner))
+    {
+        bvh.adopt(arrays.nodes, arrays.num_nodes);
+        bbox = bvh.bounds();
+    }
+
+    size_t triangle_count() const { return arrays.num_triangles; }
+    size_t vertex_count() const { return arrays.num_vertices; }
+
+    const view &data() const { return arrays; }
+    const std::vector<std::string> &material_names() const { return names; }
+
+    // Reassigns the material of every slot, e.g. once a scene's materials exist after the mesh
+    // was loaded on another thread.
+    void bind_materials(shared_ptr<material> fallback, const material_lookup &lookup)
+    {
+        materials = register_materials(resolve_materials(names, fallback, lookup));
+    }
+
+    // Material per slot: `lookup(name)` where that resolves, `fallback` otherwise.
+    static std::vector<shared_ptr<material>> resolve_materials(const std::vector<std::string> &slot_names,
+                                                               shared_ptr<material> fallback,
+                                                               const material_lookup &lookup)
+    {
+        std::vector<shared_ptr<material>> slot_materials(std::max<size_t>(1, slot_names.size()), fallback);
+        for (size_t slot = 0; slot < slot_names.size(); slot++)
+        {
+            shared_ptr<material> found = lookup && !slot_names[slot].empty() ? lookup(slot_names[slot]) : nullptr;
+            if (found)
+                slot_materials[slot] = found;
+        }
+        return slot_materials;
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        const geom_vec3 &o = r.origin_g();
+        const geom_vec3 d(r.direction());
+
+        return bvh.traverse(r, ray_t, [&](uint32_t first, uint32_t count, interval &t_range)
+        {
+            bool hit_leaf = false;
+            for (uint32_t tri = first; tri < first + count; tri++)
+            {
+                geom_real u, v;
+                double t;
+                if (intersect(tri, o, d, t_range, t, u, v))
+                {
+                    t_range.max = t;
+                    rec.t = t;
+                    rec.prim = this;
+                    rec.prim_id = int(tri);
+                    rec.b0 = u;
+                    rec.b1 = v;
+                    hit_leaf = true;
+                }
+            }
+            return hit_leaf;
+        });
+    }
+
+    void surface(const ray &r, hit_record &rec) const override
+    {
+        size_t tri = size_t(rec.prim_id);
+        double u = rec.b0;
+        double v = rec.b1;
+
+        rec.p = r.at(rec.t);
+
+        // Same conventions as `triangle`: interpolated texture coordinates when the corners
+        // have distinct ones, the barycentrics otherwise.
+        const uint32_t *corner = &arrays.indices[3 * tri];
+        vec3 p0 = vertex(corner[0]).to_vec3();
+        vec3 e1 = vertex(corner[1]).to_vec3() - p0;
+        vec3 e2 = vertex(corner[2]).to_vec3() - p0;
+
+        point2 t0, t1, t2;
+        if (corner_uvs(tri, t0, t1, t2) && !(t0 == t1 && t1 == t2))
+        {
+            double w = 1.0 - u - v;
+            rec.u = w * t0.u() + u * t1.u() + v * t2.u();
+            rec.v = w * t0.v() + u * t1.v() + v * t2.v();
+            rec.uv_density = triangle_uv_density(e1, e2, t0, t1, t2);
+        }
+        else
+        {
+            rec.u = u;
+            rec.v = v;
+            rec.uv_density = triangle_uv_density(e1, e2, point2(0, 0), point2(1, 0), point2(0, 1));
+        }
+
+        uint32_t slot = arrays.material_ids ? arrays.material_ids[tri] : 0;
+        rec.mat = slot < materials.size() ? materials[slot] : material_table::none;
+        rec.set_face_normal(r, unit_vector(cross(e1, e2)));
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    // Heap bytes owned by the mesh; arrays viewed in external storage are not counted.
+    size_t memory_bytes() const
+    {
+        return (owned_positions.capacity() + owned_uvs.capacity()) * sizeof(float) +
+               (owned_indices.capacity() + owned_uv_indices.capacity() + owned_material_ids.capacity()) *
+                   sizeof(uint32_t) +
+               (owner ? 0 : bvh.memory_bytes());
+    }
+
+private:
+    std::vector<float> owned_positions;
+    std::vector<uint32_t> owned_indices;
+    std::vector<float> owned_uvs;
+    std::vector<uint32_t> owned_uv_indices;
+    std::vector<uint32_t> owned_material_ids;
+    view arrays;
+    std::vector<material_id> materials; // Per slot
+    std::vector<std::string> names; // Source material name per slot, if known
+    shared_ptr<const void> owner;
+    flat_bvh bvh;
+    aabb bbox;
+
+    static std::vector<material_id> register_materials(const std::vector<shared_ptr<material>> &slot_materials)
+    {
+        std::vector<material_id> ids;
+        ids.reserve(slot_materials.size());
+        for (const auto &mat : slot_materials)
+            ids.push_back(material_table::global().add(mat));
+        return ids;
+    }
+
+    geom_vec3 vertex(uint32_t index) const
+    {
+        const float *p = &arrays.positions[3 * size_t(index)];
+        return geom_vec3(p[0], p[1], p[2]);
+    }
+
+    bool corner_uvs(size_t tri, point2 &t0, point2 &t1, point2 &t2) const
+    {
+        if (!arrays.uv_indices)
+            return false;
+
+        auto uv = [&](uint32_t index)
+        {
+            return index == no_uv ? point2(0, 0)
+                                  : point2(arrays.uvs[2 * size_t(index)], arrays.uvs[2 * size_t(index) + 1]);
+        };
+        const uint32_t *corner = &arrays.uv_indices[3 * tri];
+        t0 = uv(corner[0]);
+        t1 = uv(corner[1]);
+        t2 = uv(corner[2]);
+        return true;
+    }
+
+    bool intersect(size_t tri, const geom_vec3 &o, const geom_vec3 &d, const interval &ray_t,
+                   double &t, geom_real &u, geom_real &v) const
+    {
+        // Same Moller-Trumbore kernel and edge tolerance as triangle::hit.
+        const geom_real eps = geom_gamma(8);
+
+        const uint32_t *corner = &arrays.indices[3 * tri];
+        geom_vec3 p0 = vertex(corner[0]);
+        geom_vec3 e1 = vertex(corner[1]) - p0;
+        geom_vec3 e2 = vertex(corner[2]) - p0;
+
+        geom_vec3 pvec = cross(d, e2);
+        geom_real det = dot(e1, pvec);
+        if (std::fabs(det) < geom_real(1e-8))
+            return false;
+
+        geom_real inv_det = 1 / det;
+        geom_vec3 tvec = o - p0;
+        u = dot(tvec, pvec) * inv_det;
+        if (u < -eps || u > 1 + eps)
+            return false;
+
+        geom_vec3 qvec = cross(tvec, e1);
+        v = dot(d, qvec) * inv_det;
+        if (v < -eps || u + v > 1 + eps)
+            return false;
+
+        t = dot(e2, qvec) * inv_det;
+        return ray_t.contains(t);
+    }
+
+    void build()
+    {
+        // Build over the triangles' bounds, then reorder the per-triangle arrays into leaf
+        // order so a leaf's triangles are contiguous.
+        size_t count = owned_indices.size() / 3;
+        std::vector<aabb> boxes(count);
+        for (size_t tri = 0; tri < count; tri++)
+        {
+            auto corner = [&](int k)
+            {
+                const float *p = &owned_positions[3 * size_t(owned_indices[3 * tri + k])];
+                return point3(p[0], p[1], p[2]);
+            };
+            point3 a = corner(0), b = corner(1), c = corner(2);
+            boxes[tri] = aabb(aabb(a, b), aabb(c, c));
+        }
+
+        bvh.build(boxes, 4);
+        std::vector<aabb>().swap(boxes);
+
+        permute(owned_indices, bvh.order(), 3);
+        permute(owned_uv_indices, bvh.order(), 3);
+        permute(owned_material_ids, bvh.order(), 1);
+
+        arrays.positions = owned_positions.data();
+        arrays.uvs = owned_uvs.empty() ? nullptr : owned_uvs.data();
+        arrays.indices = owned_indices.data();
+        arrays.uv_indices = owned_uv_indices.empty() ? nullptr : owned_uv_indices.data();
+        arrays.material_ids = owned_material_ids.empty() ? nullptr : owned_material_ids.data();
+        arrays.nodes = bvh.node_data();
+        arrays.num_vertices = owned_positions.size() / 3;
+        arrays.num_uvs = owned_uvs.size() / 2;
+        arrays.num_triangles = count;
+        arrays.num_nodes = bvh.node_count();
+
+        bbox = bvh.bounds();
+    }
+
+    // Reorders per-triangle records of `stride` values into leaf order.
+    static void permute(std::vector<uint32_t> &values, const std::vector<uint32_t> &order, int stride)
+    {
+        if (values.empty())
+            return;
+
+        std::vector<uint32_t> sorted(values.size());
+        for (size_t slot = 0; slot < order.size(); slot++)
+            for (int k = 0; k < stride; k++)
+                sorted[stride * slot + k] = values[stride * size_t(order[slot]) + k];
+        values.swap(sorted);
+    }
+};
+
+#endif
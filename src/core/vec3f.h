@@ -0,0 +1,86 @@
+#ifndef VEC3F_H
+#define VEC3F_H
+
+#include "vec3.h"
+
+// Scalar type used to store and traverse geometry (BVH bounds, mesh vertices). Shading math
+// keeps using double-precision `vec3`; only intersection-side storage follows this type.
+#ifdef RT_SINGLE_PRECISION_GEOMETRY
+using geom_real = float;
+#else
+using geom_real = double;
+#endif
+
+// Compact 3-vector for geometry storage. Unlike `vec3` this carries no sampling helpers, it
+// only provides the handful of operations the intersection kernels need.
+template <typename T>
+class packed_vec3
+{
+public:
+    T e[3];
+
+    packed_vec3() : e{0, 0, 0} {}
+    packed_vec3(T e0, T e1, T e2) : e{e0, e1, e2} {}
+    explicit packed_vec3(const vec3 &v) : e{T(v[0]), T(v[1]), T(v[2])} {}
+
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+
+    T operator[](int i) const { return e[i]; }
+    T &operator[](int i) { return e[i]; }
+
+    vec3 to_vec3() const { return vec3(e[0], e[1], e[2]); }
+};
+
+using vec3f = packed_vec3<float>;
+using geom_vec3 = packed_vec3<geom_real>;
+
+template <typename T>
+inline packed_vec3<T> operator+(const packed_vec3<T> &u, const packed_vec3<T> &v)
+{
+    return packed_vec3<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+}
+
+template <typename T>
+inline packed_vec3<T> operator-(const packed_vec3<T> &u, const packed_vec3<T> &v)
+{
+    return packed_vec3<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+}
+
+template <typename T>
+inline T dot(const packed_vec3<T> &u, const packed_vec3<T> &v)
+{
+    return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+}
+
+template <typename T>
+inline packed_vec3<T> cross(const packed_vec3<T> &u, const packed_vec3<T> &v)
+{
+    return packed_vec3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                          u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                          u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+}
+
+// Conversions that never shrink a range: used when narrowing bounds from double to geom_real
+// so a box stored in single precision still encloses the exact double-precision box.
+inline geom_real round_down(double x)
+{
+    auto r = geom_real(x);
+    return (double(r) > x) ? std::nextafter(r, -std::numeric_limits<geom_real>::infinity()) : r;
+}
+
+inline geom_real round_up(double x)
+{
+    auto r = geom_real(x);
+    return (double(r) < x) ? std::nextafter(r, std::numeric_limits<geom_real>::infinity()) : r;
+}
+
+// Bound on the relative rounding error of n chained floating point operations (PBRT's gamma_n).
+constexpr geom_real geom_gamma(int n)
+{
+    return (n * std::numeric_limits<geom_real>::epsilon() / 2) /
+           (1 - n * std::numeric_limits<geom_real>::epsilon() / 2);
+}
+
+#endif
@@ -7,17 +7,25 @@
 #include "./core/hittable_list.h"
 #include "./core/material.h"
 #include "./core/obj_parser.h"
+#include "./core/oriented_box.h"
 #include "./core/quad.h"
+#include "./core/scene.h"
+#include "./core/scene_file.h"
 #include "./core/sphere.h"
+#include "./core/sphere_set.h"
 #include "./core/sdf_group.h"
 #include "./core/sdsphere.h"
 #include "./core/texture.h"
 
+#include "benchmarks.h"
+
 #include <algorithm>
 #include <vector>
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <cstdlib>
+#include <string>
 
 // void bouncing_spheres()
 // {
@@ -150,62 +158,59 @@ void bubble()
     auto iridescent_glass = make_shared<iridescent>(glass, 0.6);
     auto ball = make_shared<sphere>(point3(0, 0, 0), 2, iridescent_glass);
 
-    camera cam;
+    scene s;
+    s.world.add(ball);
 
-    cam.ar = 16.0 / 9.0;
-    cam.width = 600;
-    cam.samples_per_pixel = 100;
-    cam.max_depth = 50;
-    cam.background = color(0.47, 0.57, 0.74);
+    s.cam.ar = 16.0 / 9.0;
+    s.cam.width = 600;
+    s.cam.samples_per_pixel = 100;
+    s.cam.max_depth = 50;
+    s.cam.background = color(0.47, 0.57, 0.74);
 
-    cam.vfov = 20;
-    cam.lookfrom = point3(0, 0, 12);
-    cam.lookat = point3(0, 0, 0);
-    cam.vup = vec3(0, 1, 0);
+    s.cam.vfov = 20;
+    s.cam.lookfrom = point3(0, 0, 12);
+    s.cam.lookat = point3(0, 0, 0);
+    s.cam.vup = vec3(0, 1, 0);
 
-    cam.defocus_angle = 0;
+    s.cam.defocus_angle = 0;
 
-    hittable_list lights;
-    cam.render(hittable_list(ball), lights);
+    s.render();
 }
 
 void simple_scene()
 {
-    hittable_list world;
+    scene s;
 
     // Floor - large sphere acting as ground
     auto floor_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, floor_material));
+    s.world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, floor_material));
 
     // Light source - emissive sphere
     auto light_material = make_shared<diffuse_light>(color(15, 15, 13));
     auto light_sphere = make_shared<sphere>(point3(-2, 4, 5), 1, light_material);
-    world.add(light_sphere);
+    s.world.add(light_sphere);
 
     // Diffuse sphere - will be illuminated by the light
     auto diffuse_material = make_shared<lambertian>(color(0.8, 0.3, 0.3));
-    world.add(make_shared<sphere>(point3(0, 1.5, 0), 1.5, diffuse_material));
+    s.world.add(make_shared<sphere>(point3(0, 1.5, 0), 1.5, diffuse_material));
 
     // Light list for importance sampling
-    hittable_list lights;
-    lights.add(light_sphere);
-
-    camera cam;
+    s.lights.add(light_sphere);
 
-    cam.ar = 16.0 / 9.0;
-    cam.width = 600;
-    cam.samples_per_pixel = 10;
-    cam.max_depth = 50;
-    cam.background = color(0, 0, 0);
+    s.cam.ar = 16.0 / 9.0;
+    s.cam.width = 600;
+    s.cam.samples_per_pixel = 10;
+    s.cam.max_depth = 50;
+    s.cam.background = color(0, 0, 0);
 
-    cam.vfov = 45;
-    cam.lookfrom = point3(5, 3, 7);
-    cam.lookat = point3(0, 1, 0);
-    cam.vup = vec3(0, 1, 0);
+    s.cam.vfov = 45;
+    s.cam.lookfrom = point3(5, 3, 7);
+    s.cam.lookat = point3(0, 1, 0);
+    s.cam.vup = vec3(0, 1, 0);
 
-    cam.defocus_angle = 0;
+    s.cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    s.render();
 }
 
 // void perlin_spheres()
@@ -305,7 +310,7 @@ void simple_scene()
 // }
 
 void cornell_box() {
-    hittable_list world;
+    scene s;
 
     auto red   = make_shared<lambertian>(color(.65, .05, .05));
     auto white = make_shared<lambertian>(color(.73, .73, .73));
@@ -313,47 +318,41 @@ void cornell_box() {
     auto light = make_shared<diffuse_light>(color(15, 15, 15));
 
     // Cornell box sides
-    world.add(make_shared<quad>(point3(555,0,0), vec3(0,0,555), vec3(0,555,0), green));
-    world.add(make_shared<quad>(point3(0,0,555), vec3(0,0,-555), vec3(0,555,0), red));
-    world.add(make_shared<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
-    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,0,-555), white));
-    world.add(make_shared<quad>(point3(555,0,555), vec3(-555,0,0), vec3(0,555,0), white));
+    s.world.add(make_shared<quad>(point3(555,0,0), vec3(0,0,555), vec3(0,555,0), green));
+    s.world.add(make_shared<quad>(point3(0,0,555), vec3(0,0,-555), vec3(0,555,0), red));
+    s.world.add(make_shared<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
+    s.world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,0,-555), white));
+    s.world.add(make_shared<quad>(point3(555,0,555), vec3(-555,0,0), vec3(0,555,0), white));
 
     // Light
-    world.add(make_shared<quad>(point3(213,554,227), vec3(130,0,0), vec3(0,0,105), light));
+    s.world.add(make_shared<quad>(point3(213,554,227), vec3(130,0,0), vec3(0,0,105), light));
 
    // Box
-    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
-    world.add(box1);
+    s.world.add(make_shared<oriented_box>(point3(0,0,0), point3(165,330,165), 15, vec3(265,0,295), white));
 
     // Glass Sphere
     auto glossy_sphere = make_shared<glossy>(color(0.8, 0.8, 0.8), 0.3, 1.0);
-    world.add(make_shared<sphere>(point3(190,90,190), 90, glossy_sphere));
+    s.world.add(make_shared<sphere>(point3(190,90,190), 90, glossy_sphere));
 
     // Light Sources
     auto empty_material = shared_ptr<material>();
-    hittable_list lights;
-    lights.add(make_shared<quad>(point3(343,554,332), vec3(-130,0,0), vec3(0,0,-105), empty_material));
-    lights.add(make_shared<sphere>(point3(190, 90, 190), 90, empty_material));
-
-    camera cam;
+    s.lights.add(make_shared<quad>(point3(343,554,332), vec3(-130,0,0), vec3(0,0,-105), empty_material));
+    s.lights.add(make_shared<sphere>(point3(190, 90, 190), 90, empty_material));
 
-    cam.ar                = 1.0;
-    cam.width             = 600;
-    cam.samples_per_pixel = 1000;
-    cam.max_depth         = 50;
-    cam.background        = color(0,0,0);
+    s.cam.ar                = 1.0;
+    s.cam.width             = 600;
+    s.cam.samples_per_pixel = 1000;
+    s.cam.max_depth         = 50;
+    s.cam.background        = color(0,0,0);
 
-    cam.vfov     = 40;
-    cam.lookfrom = point3(278, 278, -800);
-    cam.lookat   = point3(278, 278, 0);
-    cam.vup      = vec3(0, 1, 0);
+    s.cam.vfov     = 40;
+    s.cam.lookfrom = point3(278, 278, -800);
+    s.cam.lookat   = point3(278, 278, 0);
+    s.cam.vup      = vec3(0, 1, 0);
 
-    cam.defocus_angle = 0;
+    s.cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    s.render();
 }
 
 // void cornell_smoke() {
@@ -371,13 +370,8 @@ void cornell_box() {
 //     world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
 //     world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
 
-//     shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
-//     box1 = make_shared<rotate_y>(box1, 15);
-//     box1 = make_shared<translate>(box1, vec3(265,0,295));
-
-//     shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
-//     box2 = make_shared<rotate_y>(box2, -18);
-//     box2 = make_shared<translate>(box2, vec3(130,0,65));
+//     auto box1 = make_shared<oriented_box>(point3(0,0,0), point3(165,330,165), 15, vec3(265,0,295), white);
+//     auto box2 = make_shared<oriented_box>(point3(0,0,0), point3(165,165,165), -18, vec3(130,0,65), white);
 
 //     world.add(make_shared<constant_medium>(box1, 0.01, color(0,0,0)));
 //     world.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
@@ -407,9 +401,9 @@ void cornell_box() {
 //         std::cerr << "Failed to load CartoonTree.obj\n";
 //         return;
 //     }
-//     auto world = parser.parse(make_shared<lambertian>(color(0.15, 0.35, 0.20)));
-
-//     std::cerr << "Loaded " << world.objects.size() << " triangles\n";
+//     auto tree = parser.make_mesh(make_shared<lambertian>(color(0.15, 0.35, 0.20)));
+//     std::cerr << "Loaded " << tree->triangle_count() << " triangles\n";
+//     hittable_list world(tree);
 
 //     auto dirt_noise = make_shared<noise_texture>(1.0, color(0.4, 0.2, 0.1));
 //     auto ground_material = make_shared<lambertian>(dirt_noise);
@@ -515,6 +509,45 @@ void cornell_box() {
 //     cam.render(world);
 // }
 
+void particles()
+{
+    // A million small moving spheres stored in one sphere_set.
+    scene s;
+
+    auto ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    s.world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground));
+
+    std::vector<shared_ptr<material>> palette;
+    for (int i = 0; i < 16; i++)
+        palette.push_back(make_shared<lambertian>(color::random() * color::random()));
+    palette.push_back(make_shared<metal>(color(0.8, 0.8, 0.9), 0.1));
+
+    auto cloud = make_shared<sphere_set>();
+    for (int i = 0; i < 1000000; i++)
+    {
+        auto center = point3(random_double(-6, 6), random_double(0.02, 3), random_double(-6, 6));
+        auto center2 = center + vec3(0, random_double(0, 0.05), 0);
+        cloud->add(center, center2, 0.02, palette[random_int(0, int(palette.size()) - 1)]);
+    }
+    cloud->build();
+    s.world.add(cloud);
+
+    s.cam.ar = 16.0 / 9.0;
+    s.cam.width = 400;
+    s.cam.samples_per_pixel = 16;
+    s.cam.max_depth = 20;
+    s.cam.background = color(0.70, 0.80, 1.00);
+
+    s.cam.vfov = 30;
+    s.cam.lookfrom = point3(13, 4, 9);
+    s.cam.lookat = point3(0, 1, 0);
+    s.cam.vup = vec3(0, 1, 0);
+
+    s.cam.defocus_angle = 0;
+
+    s.render();
+}
+
 void estimate_pi()
 {
     std::cout << std::fixed << std::setprecision(12);
@@ -648,54 +681,119 @@ void integrate_cos_cubed()
     std::cout << "Estimate = " << sum / N << '\n';
 }
 
-int main()
+// Built-in scenes, experiments and benchmarks that can be picked by name on the command line.
+struct named_program
+{
+    const char *name;
+    void (*run)();
+    const char *description;
+};
+
+const named_program programs[] = {
+    {"simple_scene", simple_scene, "Diffuse sphere lit by a spherical light"},
+    {"bubble", bubble, "Iridescent glass bubble"},
+    {"cornell_box", cornell_box, "Cornell box with glossy sphere"},
+    // {"bouncing_spheres", bouncing_spheres, "Final scene of the first book"},
+    // {"checkered_spheres", checkered_spheres, "Two checkered spheres"},
+    // {"earth", earth, "Earth texture"},
+    // {"perlin_spheres", perlin_spheres, "Perlin noise spheres"},
+    // {"simple_light", simple_light, "Simple light scene"},
+    // {"quads", quads, "Quads scene"},
+    // {"cornell_smoke", cornell_smoke, "Cornell box with smoke"},
+    // {"load_obj", load_obj, "OBJ model loader"},
+    {"particles", particles, "A million moving spheres in one sphere_set"},
+    {"estimate_pi", estimate_pi, "Monte Carlo pi estimation"},
+    {"estimate_log_sin", estimate_log_sin, "Integration example"},
+    {"estimate_log_sin_halfway_point", estimate_log_sin_halfway_point, "Integration with sorting"},
+    {"integrate_cos_cubed", integrate_cos_cubed, "Cos cubed integration"},
+    {"geometry_precision", bench_geometry_precision, "Mesh memory and traversal throughput"},
+    {"vector_math", bench_vector_math, "Scalar vec3 vs SIMD vector microbenchmark"},
+    {"sphere_set", bench_sphere_set, "sphere_set vs BVH of individual spheres"},
+    {"motion_blur", bench_motion_blur, "Swept vs time-interpolated BVH bounds for moving spheres"},
+    {"boxes", bench_boxes, "Six-quad boxes vs oriented_box"},
+    {"obj_parser", bench_obj_parser, "OBJ import throughput in MB/s"},
+    {"mesh_cache", bench_mesh_cache, "OBJ import vs mapping the binary mesh cache"},
+    {"texture_cache", bench_texture_cache, "Resident mipmaps vs the tiled texture cache under memory budgets"},
+    {"texture_registry", bench_texture_registry, "Decoding per texture vs sharing images through the registry"},
+    {"noise", bench_noise, "Evaluated vs baked Perlin noise: speed and error"},
+    {"texture_program", bench_texture_program, "Virtual texture trees vs compiled texture programs"},
+    {"scatter_allocations", bench_scatter_allocations, "Heap allocations per path vertex in a Cornell box render"},
+    {"light_sampling", bench_light_sampling, "Noise at equal time: light/BSDF mixture vs next-event estimation with MIS"},
+    {"many_lights", bench_many_lights, "Noise at equal time with 4096 lights: uniform vs power vs light BVH selection"},
+    {"environment_light", bench_environment_light, "Noise at equal time under a sky with a sun: BSDF sampling vs environment importance sampling"},
+    {"fast_math", bench_fast_math, "Error bounds and speed of the fast_math.h kernels against libm"},
+    {"path_guiding", bench_path_guiding, "Error at equal time in a Cornell box and a room lit through a small opening: BSDF sampling vs path guiding"},
+    {"bsdf_convention", bench_bsdf_convention, "Directional albedo of each BSDF by eval() and by sample(): checks they agree and include the cosine"},
+};
+
+void print_usage()
+{
+    std::cerr << "Usage: Raytracer [SCENE_FILE] [--spp N] [--width N] [--threads N]\n"
+                 "       Raytracer --run NAME\n"
+                 "       Raytracer --list\n"
+                 "\n"
+                 "Renders SCENE_FILE to stdout as a PPM image. --spp and --width override the file's\n"
+                 "camera settings; --threads sets the number of asset loading threads. With no\n"
+                 "arguments, renders the built-in simple_scene.\n";
+}
+
+int main(int argc, char **argv)
 {
-    switch (15)
+    std::string scene_path;
+    std::string program_name;
+    int spp = 0, width = 0, threads = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--list")
+        {
+            for (const auto &program : programs)
+                std::cout << std::left << std::setw(32) << program.name << program.description << "\n";
+            return 0;
+        }
+        else if (arg == "--run" && has_value)
+            program_name = argv[++i];
+        else if (arg == "--spp" && has_value)
+            spp = std::atoi(argv[++i]);
+        else if (arg == "--width" && has_value)
+            width = std::atoi(argv[++i]);
+        else if (arg == "--threads" && has_value)
+            threads = std::atoi(argv[++i]);
+        else if (arg[0] != '-' && scene_path.empty())
+            scene_path = arg;
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (!scene_path.empty())
+    {
+        scene loaded;
+        if (!scene_file::load(scene_path, loaded, threads))
+            return 1;
+        if (spp > 0)
+            loaded.cam.samples_per_pixel = spp;
+        if (width > 0)
+            loaded.cam.width = width;
+        loaded.render();
+        return 0;
+    }
+
+    if (program_name.empty())
+        program_name = "simple_scene";
+    for (const auto &program : programs)
     {
-    // case 1:
-    //     bouncing_spheres();
-    //     break;
-    // case 2:
-    //     checkered_spheres();
-    //     break;
-    // case 3:
-    //     earth();
-    //     break;
-    case 4:
-        bubble();
-        break;
-    // case 5:
-    //     perlin_spheres();
-    //     break;
-    // case 6:
-    //     simple_light();
-    //     break;
-    // case 7:
-    //     quads();
-    //     break;
-    case 8:
-        cornell_box();
-        break;
-    // case 9:
-    //     cornell_smoke();
-    //     break;
-    // case 10:
-    //     load_obj();
-    //     break;
-    case 11:
-        estimate_pi();
-        break;
-    case 12:
-        estimate_log_sin();
-        break;
-    case 13:
-        estimate_log_sin_halfway_point();
-        break;
-    case 14:
-        integrate_cos_cubed();
-        break;
-    case 15:
-        simple_scene();
-        break;
+        if (program_name == program.name)
+        {
+            program.run();
+            return 0;
+        }
     }
-}
\ No newline at end of file
+
+    std::cerr << "Unknown program '" << program_name << "'; see --list\n";
+    return 1;
+}